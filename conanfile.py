@@ -39,6 +39,7 @@ class HomeReplicationConan(ConanFile):
 
     def build_requirements(self):
         self.build_requires("gtest/1.13.0")
+        self.build_requires("benchmark/1.7.1")
 
     def requirements(self):
         self.requires("nuraft_mesg/[~=0,    include_prerelease=True]@oss/main")
@@ -193,6 +193,13 @@ public:
 
     void on_rollback(int64_t lsn, const sisl::blob& header, const sisl::blob& key, void* ctx) override {}
 
+    void on_snapshot_create(int64_t lsn, std::vector< uint8_t >& user_data,
+                            std::vector< home_replication::pba_t >& pbas) override {}
+
+    void on_snapshot_install(
+        int64_t lsn, const sisl::blob& user_data,
+        const std::vector< std::pair< home_replication::pba_t, home_replication::pba_list_t > >& pba_map) override {}
+
     void on_replica_stop() override {}
 };
 
@@ -1,8 +1,8 @@
 #pragma once
 
-#include <map>
 #include <memory>
-#include <mutex>
+#include <utility>
+#include <vector>
 #include <sisl/fds/buffer.hpp>
 
 #include <home_replication/repl_set.h>
@@ -19,6 +19,8 @@ namespace home_replication {
 
 class ReplicationServiceBackend;
 class ReplicaSetListener;
+template < typename T >
+class UuidRegistry;
 
 enum class backend_impl_t : uint8_t { homestore, jungle };
 
@@ -29,14 +31,16 @@ class ReplicationService {
     friend class HomeReplicationBackend;
 
     std::unique_ptr< ReplicationServiceBackend > m_backend;
-    std::mutex m_rs_map_mtx;
-    std::map< uuid_t, rs_ptr_t > m_rs_map;
+    std::unique_ptr< UuidRegistry< ReplicaSet > > m_rs_registry;
     on_replica_set_init_t m_on_rs_init_cb;
 
     std::shared_ptr< nuraft_mesg::consensus_component > m_messaging;
 
     void on_replica_store_found(uuid_t const uuid, const std::shared_ptr< StateMachineStore >& sm_store,
                                 const std::shared_ptr< nuraft::log_store >& log_store);
+    rs_ptr_t init_replica_set(uuid_t const uuid, const std::shared_ptr< StateMachineStore >& sm_store,
+                              const std::shared_ptr< nuraft::log_store >& log_store);
+
 public:
     ReplicationService(backend_impl_t engine_impl, std::shared_ptr< nuraft_mesg::consensus_component > messaging,
                        on_replica_set_init_t cb);
@@ -44,7 +48,13 @@ public:
 
     rs_ptr_t create_replica_set(uuid_t const uuid);
     rs_ptr_t lookup_replica_set(uuid_t uuid);
+
+    /// @brief Calls cb for every replica set of the service. Replica sets are iterated over a snapshot of the service
+    /// and no lock is held while calling cb, so it is free to create or lookup replica sets.
     void iterate_replica_sets(const std::function< void(const rs_ptr_t&) >& cb);
+
+    /// @brief Raft parameters every replica set of this service is run with
+    static nuraft::raft_params raft_params();
 };
 
 //
@@ -93,6 +103,10 @@ public:
     /// This function is called on followers only when the log entry is going to be overwritten. This function is called
     /// from a random worker thread, but is guaranteed to be serialized.
     ///
+    /// It is also called on the replica a write was issued to with lsn -1, if raft did not accept the write (e.g. the
+    /// replica is not the leader). Such a write never gets an lsn and its pbas are freed by the replica set. This is
+    /// called from the thread that called replica_set::write().
+    ///
     /// For each log index, it is guaranteed that either on_commit() or on_rollback() is called but not both.
     ///
     /// NOTE: Listener should do the free any resources created as part of pre-commit.
@@ -103,6 +117,32 @@ public:
     /// @param ctx - User contenxt passed as part of the replica_set::write() api
     virtual void on_rollback(int64_t lsn, const sisl::blob& header, const sisl::blob& key, void* ctx) = 0;
 
+    /// @brief Called on the leader when raft takes a snapshot of the replica set at lsn.
+    ///
+    /// This function is called from the thread committing lsn, once every log entry upto lsn is committed. Snapshot is
+    /// made up of the lsn, opaque data of the listener (typically its index of keys to pbas) and all the pbas the
+    /// listener owns as of lsn. Data of those pbas is shipped along with the snapshot to any replica which is too far
+    /// behind to catch up from the log.
+    ///
+    /// @param lsn - The log sequence number the snapshot is taken at
+    /// @param user_data - [out] Listener data, passed as is to on_snapshot_install() on the receiving replica
+    /// @param pbas - [out] Pbas owned by the listener as of lsn
+    virtual void on_snapshot_create(int64_t lsn, std::vector< uint8_t >& user_data, std::vector< pba_t >& pbas) = 0;
+
+    /// @brief Called on a replica which received a snapshot from the leader, after the data of all the pbas of the
+    /// snapshot is written locally.
+    ///
+    /// Listener replaces its state with the one in the snapshot. Log entries upto lsn which are not committed on this
+    /// replica yet are never going to be, and the pbas the listener owned before are no longer part of the replica set
+    /// state, so their ownership should be transferred back.
+    ///
+    /// @param lsn - The log sequence number the snapshot is taken at
+    /// @param user_data - Listener data given by on_snapshot_create() on the leader
+    /// @param pba_map - Every pba of the snapshot (as known to the leader) along with the local pbas its data is
+    /// written to. Local pbas are owned by the listener from here on.
+    virtual void on_snapshot_install(int64_t lsn, const sisl::blob& user_data,
+                                     const std::vector< std::pair< pba_t, pba_list_t > >& pba_map) = 0;
+
     /// @brief Called when the replica set is being stopped
     virtual void on_replica_stop() = 0;
 };
@@ -2,7 +2,9 @@
 
 #include <home_replication/repl_decls.h>
 
+#include <atomic>
 #include <string>
+#include <vector>
 
 #include <folly/concurrency/ConcurrentHashMap.h>
 #include <nuraft_mesg/messaging_if.hpp>
@@ -23,6 +25,7 @@ class ReplicaSet : public nuraft_mesg::mesg_state_mgr {
 public:
     friend class ReplicaStateMachine;
     friend class ReplicationService;
+    friend class HomeReplicationBackend;
 
     ReplicaSet(const std::string& group_id, const std::shared_ptr< StateMachineStore >& sm_store,
                const std::shared_ptr< nuraft::log_store >& log_store);
@@ -44,6 +47,23 @@ public:
     /// @param user_ctx - User supplied opaque context which will be passed to listener callbacks
     virtual void write(const sisl::blob& header, const sisl::blob& key, const sisl::sg_list& value, void* user_ctx);
 
+    /// @brief One object of a batch write, fields carry the same meaning as the parameters of write()
+    struct write_obj {
+        sisl::blob header;
+        sisl::blob key;
+        sisl::sg_list value;
+        void* user_ctx{nullptr};
+    };
+
+    /// @brief Replicate a batch of objects to the replica set. It goes through the same steps as write(), but for the
+    /// entire batch at once: pbas for all the objects are allocated in one call, values are written with one vectored
+    /// write, sent in one data channel rpc and the journal entries are appended to raft as one batch. Each object still
+    /// gets its own lsn and listener callbacks, in the order they are in the batch.
+    ///
+    /// @param objs - Objects to replicate. Value of each object is padded to the size of its pbas while writing, so
+    /// similar to write(), value sizes are expected to be aligned to the io alignment of the storage engine.
+    virtual void write_batch(const std::vector< write_obj >& objs);
+
     /// @brief After data is replicated and on_commit to the listener is called. the pbas are implicityly transferred to
     /// listener. This call will transfer the ownership of pba back to the replication service. This listener should
     /// never free the pbas on its own and should always transfer the ownership after it is no longer useful.
@@ -52,11 +72,21 @@ public:
     virtual void transfer_pba_ownership(int64_t lsn, const pba_list_t& pbas);
 
     /// @brief Checks if this replica is the leader in this replica set
-    /// @return true or false
-    bool is_leader();
+    /// @return true or false. Replica set which is not part of a raft group yet is always the leader
+    virtual bool is_leader();
 
     std::shared_ptr< nuraft::state_machine > get_state_machine() override;
 
+    /// @brief Raft server of this replica set
+    /// @return nullptr if the replica set is not part of a raft group yet
+    virtual nuraft::raft_server* raft_server();
+
+    /// @brief Binds the data channel rpcs (SEND_PBAS/FETCH_PBAS) of this replica set with the messaging service, so
+    /// that followers can receive the data directly from the leader, bypassing the raft log.
+    /// @param messaging - Messaging service this replica set is part of
+    /// @return true if all the rpcs are bound successfully
+    bool register_data_service_apis(const std::shared_ptr< nuraft_mesg::consensus_component >& messaging);
+
 protected:
     uint32_t get_logstore_id() const override { return 0; }
 
@@ -68,23 +98,37 @@ protected:
 
     void leave() override {}
 
+    /// @brief Sends the data channel request to all other replicas of this set. Response callback is called for every
+    /// response received.
+    virtual void send_data_service_request(const std::string& request_name, const nuraft_mesg::io_blob_list_t& cli_buf,
+                                           const nuraft_mesg::data_service_response_handler_t& response_cb);
+
 private:
     nuraft::ptr< nuraft::cluster_config > load_config() override { return nullptr; }
     void save_config(const nuraft::cluster_config&) override {}
     void save_state(const nuraft::srv_state&) override {}
     nuraft::ptr< nuraft::srv_state > read_state() override { return nullptr; }
     nuraft::ptr< nuraft::log_store > load_log_store() override { return nullptr; }
-    int32_t server_id() override { return 0; }
+    int32_t server_id() override { return m_server_id.load(); }
     void system_exit(const int) override {}
 
+    /// @brief Records the id of this replica in the raft group, as assigned by the messaging service when it joins
+    void set_server_id(int32_t server_id) { m_server_id.store(server_id); }
+
     void after_precommit_in_leader(const nuraft::raft_server::req_ext_cb_params& cb_params);
 
+    /// @brief Reclaims the pbas whose ownership is transferred back upto the committed lsn, see
+    /// ReplicaStateMachine::checkpoint(). Called periodically by the backend on its checkpoint thread.
+    void checkpoint();
+
 private:
     std::shared_ptr< ReplicaStateMachine > m_state_machine;
     std::shared_ptr< StateMachineStore > m_state_store;
     std::unique_ptr< ReplicaSetListener > m_listener;
     std::shared_ptr< nuraft::log_store > m_data_journal;
     std::string m_group_id;
+    uuid_t m_group_uuid;
+    std::atomic< int32_t > m_server_id{0}; // Raft server id of this replica, 0 till it joins the raft group
 };
 
 } // namespace home_replication
@@ -14,8 +14,8 @@
  *********************************************************************************/
 
 #include "home_raft_log_store.h"
-#include "storage_engine_buffer.h"
 #include <sisl/fds/utils.hpp>
+#include "service/repl_config.h"
 
 using namespace homestore;
 
@@ -38,23 +38,39 @@ static constexpr store_lsn_t to_store_lsn(uint64_t raft_lsn) { return s_cast< st
 static constexpr store_lsn_t to_store_lsn(repl_lsn_t repl_lsn) { return repl_lsn - 1; }
 static constexpr repl_lsn_t to_repl_lsn(store_lsn_t store_lsn) { return store_lsn + 1; }
 
-static nuraft::ptr< nuraft::log_entry > to_nuraft_log_entry(const homestore::log_buffer& log_bytes) {
-    uint8_t* raw_ptr = log_bytes.bytes();
-    uint64_t term = *r_cast< uint64_t* >(raw_ptr);
-    raw_ptr += sizeof(uint64_t);
-    nuraft::log_val_type type = static_cast< nuraft::log_val_type >(*raw_ptr);
-    raw_ptr += sizeof(uint8_t);
+// Set by the store in the type byte of the records it wrote in place, none of the log_val_types has this bit set
+static constexpr uint8_t inline_framed_type_bit{0x80};
+static constexpr uint8_t inline_framed_type_byte() {
+    return inline_framed_type_bit | s_cast< uint8_t >(nuraft::log_val_type::app_log);
+}
 
-    size_t data_len = log_bytes.size() - sizeof(uint64_t) - sizeof(uint8_t);
+// Every record is persisted as [term (8 bytes)][log_val_type (1 byte)][log entry buffer], which is what
+// log_entry::serialize() lays out as well. An app_log entry with inline framing carries these bytes in its own buffer,
+// so its record is read back as a whole into the log entry buffer, keeping the framing reserved at its start. Any other
+// entry gets only the bytes past the framing. Either is copied once out of the log buffer: nuraft::buffer always owns
+// its bytes, in the same allocation as its header, so a log entry can't refer to the log buffer it is read from.
+static nuraft::ptr< nuraft::log_entry > to_nuraft_log_entry(const homestore::log_buffer& log_bytes) {
+    uint8_t const* raw_ptr = log_bytes.bytes();
+    uint64_t const term = *r_cast< uint64_t const* >(raw_ptr);
+    uint8_t const type_byte = raw_ptr[sizeof(uint64_t)];
+
+    size_t const offset = (type_byte == inline_framed_type_byte()) ? 0 : HomeRaftLogStore::inline_framing_size;
+    auto const type = (type_byte == inline_framed_type_byte()) ? nuraft::log_val_type::app_log
+                                                                : s_cast< nuraft::log_val_type >(type_byte);
+    size_t const data_len = log_bytes.size() - offset;
     auto nb = nuraft::buffer::alloc(data_len);
-    nb->put_raw(raw_ptr, data_len);
+    nb->put_raw(raw_ptr + offset, data_len);
+    nb->pos(0);
     return nuraft::cs_new< nuraft::log_entry >(term, nb, type);
 }
 
-static uint64_t extract_term(const homestore::log_buffer& log_bytes) {
-    auto const se_buf = SEBuf{log_bytes.size(), log_bytes.bytes()};
-    SEBufSerializer ss(se_buf);
-    return ss.getU64();
+static uint64_t extract_term(const uint8_t* record) { return *r_cast< uint64_t const* >(record); }
+
+// Entries handed out of the tail cache are log entries of their own, as raft is free to modify the entry it gets. They
+// share the buffer of the cached entry without copying it, since an entry buffer is never written to once appended:
+// the framing is written and the journal entry transformed before the entry is appended and cached.
+static nuraft::ptr< nuraft::log_entry > share_entry(const nuraft::log_entry& entry) {
+    return nuraft::cs_new< nuraft::log_entry >(entry.get_term(), entry.get_buf_ptr(), entry.get_val_type());
 }
 
 HomeRaftLogStore::HomeRaftLogStore(homestore::logstore_id_t logstore_id) {
@@ -83,27 +99,47 @@ void HomeRaftLogStore::remove_store() {
 void HomeRaftLogStore::on_store_created(std::shared_ptr< HomeLogStore > log_store) {
     m_log_store = log_store;
     m_logstore_id = m_log_store->get_store_id();
+
+    // Rebuild the term index from the records replayed on open
+    m_log_store->register_log_found_cb(
+        [this](store_lsn_t lsn, homestore::log_buffer buf, [[maybe_unused]] void* ctx) {
+            m_term_index.append(to_repl_lsn(lsn), extract_term(buf.bytes()));
+        });
     REPL_STORE_LOG(DEBUG, "Home Log store created/opened successfully");
 }
 
 ulong HomeRaftLogStore::next_slot() const {
-    uint64_t next_slot = to_repl_lsn(m_log_store->get_contiguous_issued_seq_num(m_last_durable_lsn)) + 1;
-    REPL_STORE_LOG(DEBUG, "next_slot()={}", next_slot);
-    return next_slot;
+    auto next_slot = m_next_slot.load();
+    if (next_slot < 0) {
+        // Scan starts no lower than the truncation point, as the start can have been moved past slots never written
+        auto const from = std::max(m_last_durable_lsn.load(), m_log_store->truncated_upto());
+        auto const loaded = to_repl_lsn(m_log_store->get_contiguous_issued_seq_num(from)) + 1;
+        m_next_slot.compare_exchange_strong(next_slot, loaded);
+        next_slot = m_next_slot.load();
+    }
+    REPL_STORE_LOG(TRACE, "next_slot()={}", next_slot);
+    return uint64_cast(next_slot);
 }
 
 ulong HomeRaftLogStore::start_index() const {
-    // start_index starts from 1.
-    ulong start_index = std::max((repl_lsn_t)1, to_repl_lsn(m_log_store->truncated_upto()) + 1);
-    REPL_STORE_LOG(DEBUG, "start_index()={}", start_index);
-    return start_index;
+    auto start_index = m_start_index.load();
+    if (start_index < 0) {
+        // start_index starts from 1.
+        auto const loaded = std::max((repl_lsn_t)1, to_repl_lsn(m_log_store->truncated_upto()) + 1);
+        m_start_index.compare_exchange_strong(start_index, loaded);
+        start_index = m_start_index.load();
+    }
+    REPL_STORE_LOG(TRACE, "start_index()={}", start_index);
+    return uint64_cast(start_index);
 }
 
 nuraft::ptr< nuraft::log_entry > HomeRaftLogStore::last_entry() const {
-    store_lsn_t max_seq = m_log_store->get_contiguous_issued_seq_num(m_last_durable_lsn);
-    REPL_STORE_LOG(DEBUG, "last_entry() store seqnum={}", max_seq);
-    if (max_seq < 0) { return m_dummy_log_entry; }
+    auto const last_lsn = s_cast< repl_lsn_t >(next_slot()) - 1;
+    REPL_STORE_LOG(TRACE, "last_entry() lsn={}", last_lsn);
+    if (last_lsn < s_cast< repl_lsn_t >(start_index())) { return m_dummy_log_entry; }
+    if (auto le = cached_entry(last_lsn); le) { return le; }
 
+    store_lsn_t max_seq = to_store_lsn(last_lsn);
     nuraft::ptr< nuraft::log_entry > nle;
     try {
         auto log_bytes = m_log_store->read_sync(max_seq);
@@ -120,15 +156,34 @@ ulong HomeRaftLogStore::append(nuraft::ptr< nuraft::log_entry >& entry) {
     REPL_STORE_LOG(TRACE, "append entry term={}, log_val_type={} size={}", entry->get_term(), entry->get_val_type(),
                    entry->get_buf().size());
 
-    raft_buf_ptr_t entry_buf = entry->serialize();
-    auto next_seq = m_log_store->append_async(
+    raft_buf_ptr_t entry_buf;
+    if (m_inline_framing && (entry->get_val_type() == nuraft::log_val_type::app_log)) {
+        // Framing is written in the bytes reserved for it and the buffer is persisted without copying
+        entry_buf = entry->get_buf_ptr();
+        RELEASE_ASSERT_GE(entry_buf->size(), inline_framing_size, "app_log entry has no room for inline framing");
+        *r_cast< uint64_t* >(entry_buf->data_begin()) = entry->get_term();
+        entry_buf->data_begin()[sizeof(uint64_t)] = inline_framed_type_byte();
+    } else {
+        entry_buf = entry->serialize();
+    }
+
+    // Entry is written at the next slot tracked here, rather than the next seq num of the homestore log store, as
+    // the start can be moved past the next seq num without writing any records (see advance_start_index)
+    auto const lsn = s_cast< repl_lsn_t >(next_slot());
+    m_log_store->write_async(
+        to_store_lsn(lsn),
         sisl::io_blob{entry_buf->data_begin(), uint32_cast(entry_buf->size()), false /* is_aligned */},
         nullptr /* cookie */, [entry_buf](int64_t, sisl::io_blob&, homestore::logdev_key, void*) {});
-    return to_repl_lsn(next_seq);
+    m_term_index.append(lsn, entry->get_term());
+    cache_tail_entry(lsn, entry);
+    m_next_slot.store(lsn + 1);
+    return uint64_cast(lsn);
 }
 
 void HomeRaftLogStore::write_at(ulong index, nuraft::ptr< nuraft::log_entry >& entry) {
     m_log_store->rollback_async(to_store_lsn(index) - 1, nullptr);
+    drop_tail_from(s_cast< repl_lsn_t >(index));
+    m_next_slot.store(s_cast< repl_lsn_t >(index));
     // we need to reset the durable lsn, because its ok to set to lower number as it will be updated on next flush
     // calls, but it is dangerous to set higher number.
     m_last_durable_lsn = -1;
@@ -143,16 +198,40 @@ void HomeRaftLogStore::end_of_append_batch(ulong start, ulong cnt) {
 
 nuraft::ptr< std::vector< nuraft::ptr< nuraft::log_entry > > > HomeRaftLogStore::log_entries(ulong start, ulong end) {
     auto out_vec = std::make_shared< std::vector< nuraft::ptr< nuraft::log_entry > > >();
-    m_log_store->foreach (to_store_lsn(start),
-                          [end, &out_vec](store_lsn_t cur, const homestore::log_buffer& entry) -> bool {
-                              bool ret = (cur < to_store_lsn(end) - 1);
-                              if (cur < to_store_lsn(end)) { out_vec->emplace_back(to_nuraft_log_entry(entry)); }
-                              return ret;
-                          });
+
+    // Part of the range which is in the tail cache is served from it, rest is read from the store
+    std::vector< nuraft::ptr< nuraft::log_entry > > cached;
+    ulong disk_end = end;
+    {
+        std::unique_lock lg(m_tail_mtx);
+        auto const tail_end = m_tail_start_lsn + int64_cast(m_tail.size());
+        auto const from = std::max(s_cast< repl_lsn_t >(start), m_tail_start_lsn);
+        if (!m_tail.empty() && (s_cast< repl_lsn_t >(end) <= tail_end) && (from < s_cast< repl_lsn_t >(end))) {
+            cached.assign(m_tail.begin() + (from - m_tail_start_lsn),
+                          m_tail.begin() + (s_cast< repl_lsn_t >(end) - m_tail_start_lsn));
+            disk_end = uint64_cast(from);
+        }
+    }
+
+    if (start < disk_end) {
+        m_log_store->foreach (to_store_lsn(start),
+                              [disk_end, &out_vec](store_lsn_t cur, const homestore::log_buffer& entry) -> bool {
+                                  bool ret = (cur < to_store_lsn(disk_end) - 1);
+                                  if (cur < to_store_lsn(disk_end)) {
+                                      out_vec->emplace_back(to_nuraft_log_entry(entry));
+                                  }
+                                  return ret;
+                              });
+    }
+    for (const auto& le : cached) {
+        out_vec->emplace_back(share_entry(*le));
+    }
     return out_vec;
 }
 
 nuraft::ptr< nuraft::log_entry > HomeRaftLogStore::entry_at(ulong index) {
+    if (auto le = cached_entry(s_cast< repl_lsn_t >(index)); le) { return le; }
+
     nuraft::ptr< nuraft::log_entry > nle;
     try {
         auto log_bytes = m_log_store->read_sync(to_store_lsn(index));
@@ -165,10 +244,13 @@ nuraft::ptr< nuraft::log_entry > HomeRaftLogStore::entry_at(ulong index) {
 }
 
 ulong HomeRaftLogStore::term_at(ulong index) {
+    if (index < start_index()) { return 0; }
+    if (auto const term = m_term_index.term_at(s_cast< repl_lsn_t >(index)); term) { return *term; }
+
     ulong term;
     try {
         auto log_bytes = m_log_store->read_sync(to_store_lsn(index));
-        term = extract_term(log_bytes);
+        term = extract_term(log_bytes.bytes());
     } catch (const std::exception& e) {
         REPL_STORE_LOG(ERROR, "term_at({}) index out_of_range", index);
         throw e;
@@ -177,34 +259,41 @@ ulong HomeRaftLogStore::term_at(ulong index) {
 }
 
 raft_buf_ptr_t HomeRaftLogStore::pack(ulong index, int32_t cnt) {
-    static constexpr size_t estimated_record_size = 128;
-    size_t estimated_size = cnt * estimated_record_size + sizeof(uint32_t);
-
     //   << Format >>
     // # records (N)        4 bytes
     // +---
     // | log length (X)     4 bytes
     // | log data           X bytes
     // +--- repeat N
-    raft_buf_ptr_t out_buf = nuraft::buffer::alloc(estimated_size);
-    out_buf->put(cnt);
-
-    int32_t remain_cnt = cnt;
-    m_log_store->foreach (to_store_lsn(index),
-                          [this, &out_buf, &remain_cnt]([[maybe_unused]] store_lsn_t cur,
-                                                        const homestore::log_buffer& entry) mutable -> bool {
-                              if (remain_cnt-- > 0) {
-                                  size_t avail_size = out_buf->size() - out_buf->pos();
-                                  if (avail_size < entry.size()) {
-                                      avail_size += std::max(out_buf->size() * 2, (size_t)entry.size());
-                                      out_buf = nuraft::buffer::expand(*out_buf, avail_size);
-                                  }
-                                  REPL_STORE_LOG(TRACE, "packing lsn={} of size={}, avail_size in buffer={}",
-                                                 to_repl_lsn(cur), entry.size(), avail_size);
-                                  out_buf->put(entry.bytes(), entry.size());
-                              }
-                              return (remain_cnt > 0);
-                          });
+    //
+    // Records are gathered first, as references to the buffers they are read into, which sizes the pack exactly
+    // before anything is copied. Packing stops at cnt records or when the next record doesn't fit within the max pack
+    // size, whichever comes first. At least one record is packed, even if it alone is over the max size. Raft resumes
+    // shipping from the next slot of the receiver, so a short pack only means more packs.
+    auto const max_pack_size = uint64_cast(HR_DYNAMIC_CONFIG(max_raft_log_pack_size_kb)) * 1024;
+    std::vector< homestore::log_buffer > records;
+    uint64_t pack_size{sizeof(int32_t)};
+    if (cnt <= 0) { cnt = 0; }
+
+    if (cnt > 0) {
+        m_log_store->foreach (to_store_lsn(index),
+                              [this, cnt, max_pack_size, &records, &pack_size](store_lsn_t cur,
+                                                                               const homestore::log_buffer& entry) {
+                                  auto const rec_size = sizeof(int32_t) + entry.size();
+                                  if (!records.empty() && (pack_size + rec_size > max_pack_size)) { return false; }
+                                  REPL_STORE_LOG(TRACE, "packing lsn={} of size={}", to_repl_lsn(cur), entry.size());
+                                  records.push_back(entry);
+                                  pack_size += rec_size;
+                                  return (records.size() < uint64_cast(cnt));
+                              });
+    }
+
+    raft_buf_ptr_t out_buf = nuraft::buffer::alloc(pack_size);
+    out_buf->put(s_cast< int32_t >(records.size()));
+    for (const auto& rec : records) {
+        out_buf->put(rec.bytes(), rec.size());
+    }
+    out_buf->pos(0);
     return out_buf;
 }
 
@@ -212,43 +301,81 @@ void HomeRaftLogStore::apply_pack(ulong index, nuraft::buffer& pack) {
     pack.pos(0);
     auto num_entries = pack.get_int();
 
-    auto slot = next_slot();
-    if (index < slot) {
+    auto const slot = s_cast< repl_lsn_t >(next_slot());
+    auto lsn = s_cast< repl_lsn_t >(index);
+    if (lsn < slot) {
         // We are asked to apply/insert data behind next slot, so we must rollback before index and then append
-        m_log_store->rollback_async(to_store_lsn(index) - 1, nullptr);
-    } else if (index > slot) {
-        // We are asked to apply/insert data after next slot, so we need to fill in with dummy entries upto the slot
-        // before append the entries
+        m_log_store->rollback_async(to_store_lsn(lsn) - 1, nullptr);
+        drop_tail_from(lsn);
+        m_last_durable_lsn = -1;
+    } else if (lsn > slot) {
+        // We are asked to apply/insert data after next slot. Entries before it are no longer contiguous with the pack,
+        // so the start is moved upto the pack, which skips the slots in between without writing anything for them.
         REPL_STORE_LOG(WARN,
-                       "RaftLogStore is asked to apply pack on lsn={}, but current lsn={} is behind, will be filling "
-                       "with dummy data to make it functional, however, this could result in inconsistent data",
-                       index, to_store_lsn(slot));
-        while (index++ < slot) {
-            append(m_dummy_log_entry);
-        }
+                       "RaftLogStore is asked to apply pack on lsn={}, but next lsn={} is behind, will be moving the "
+                       "start index to it to make it functional, however, this could result in inconsistent data",
+                       lsn, slot);
+        advance_start_index(index);
     }
 
-    for (int i{0}; i < num_entries; ++i) {
+    // Records are written straight out of the pack and flushed every time the unflushed bytes cross the configured
+    // limit, instead of once at the end, so that the log device works through a large pack while it is being applied.
+    // Pack is flushed entirely before returning, as the records written refer to its buffer.
+    auto const flush_size = uint64_cast(HR_DYNAMIC_CONFIG(raft_log_apply_pack_flush_kb)) * 1024;
+    uint64_t unflushed_size{0};
+    for (int i{0}; i < num_entries; ++i, ++lsn) {
         size_t entry_len;
         auto* entry = const_cast< nuraft::byte* >(pack.get_bytes(entry_len));
-        [[maybe_unused]] auto store_sn =
-            m_log_store->append_async(sisl::io_blob{entry, uint32_cast(entry_len), false}, nullptr, nullptr);
-        REPL_STORE_LOG(TRACE, "unpacking nth_entry={} of size={}, lsn={}", i + 1, entry_len, to_repl_lsn(store_sn));
+        m_log_store->write_async(to_store_lsn(lsn), sisl::io_blob{entry, uint32_cast(entry_len), false}, nullptr,
+                                 nullptr);
+        m_term_index.append(lsn, extract_term(entry));
+        REPL_STORE_LOG(TRACE, "unpacking nth_entry={} of size={}, lsn={}", i + 1, entry_len, lsn);
+        m_next_slot.store(lsn + 1);
+
+        unflushed_size += entry_len;
+        if (unflushed_size >= flush_size) {
+            m_log_store->flush_sync(to_store_lsn(lsn));
+            unflushed_size = 0;
+        }
+    }
+    if (num_entries > 0) {
+        m_log_store->flush_sync(to_store_lsn(lsn - 1));
+        m_last_durable_lsn = to_store_lsn(lsn - 1);
     }
-    m_log_store->flush_sync(to_store_lsn(index) + num_entries - 1);
 }
 
 bool HomeRaftLogStore::compact(ulong compact_lsn) {
-    auto cur_max_lsn = m_log_store->get_contiguous_issued_seq_num(m_last_durable_lsn);
-    if (cur_max_lsn < to_store_lsn(compact_lsn)) {
-        // We need to fill the remaining entries with dummy data.
-        for (auto lsn{cur_max_lsn + 1}; lsn <= to_store_lsn(compact_lsn); ++lsn) {
-            append(m_dummy_log_entry);
+    if (compact_lsn < start_index()) { return true; } // Already compacted past it
+    advance_start_index(compact_lsn + 1);
+    return true;
+}
+
+void HomeRaftLogStore::advance_start_index(ulong new_start) {
+    auto const start_lsn = s_cast< repl_lsn_t >(new_start);
+    auto const slot = s_cast< repl_lsn_t >(next_slot());
+
+    // Entries being dropped are flushed before truncating. If the new start is past the last entry (typically after a
+    // snapshot is installed), the slots upto it are skipped here rather than in homestore: next slot moves to the new
+    // start, and the contiguous seq nums are looked up from the truncation point onwards, which homestore persists.
+    // Nothing is written for the slots skipped, and they read as term 0 like any other slot before the start.
+    auto const last_written_lsn = std::min(start_lsn, slot) - 1;
+    if (last_written_lsn > 0) { m_log_store->flush_sync(to_store_lsn(last_written_lsn)); }
+    if (start_lsn > slot) {
+        m_next_slot.store(start_lsn);
+        m_last_durable_lsn.store(to_store_lsn(start_lsn - 1));
+    }
+
+    m_log_store->truncate(to_store_lsn(start_lsn - 1));
+    m_term_index.truncate(start_lsn - 1);
+    m_start_index.store(start_lsn);
+    {
+        std::unique_lock lg(m_tail_mtx);
+        while (!m_tail.empty() && (m_tail_start_lsn < start_lsn)) {
+            m_tail.pop_front();
+            ++m_tail_start_lsn;
         }
     }
-    m_log_store->flush_sync(to_store_lsn(compact_lsn));
-    m_log_store->truncate(to_store_lsn(compact_lsn));
-    return true;
+    REPL_STORE_LOG(DEBUG, "Advanced start index to lsn={}, next_slot={}", start_lsn, next_slot());
 }
 
 bool HomeRaftLogStore::flush() {
@@ -256,8 +383,43 @@ bool HomeRaftLogStore::flush() {
     return true;
 }
 
+void HomeRaftLogStore::cache_tail_entry(repl_lsn_t lsn, const nuraft::ptr< nuraft::log_entry >& entry) {
+    auto const max_entries = HR_DYNAMIC_CONFIG(raft_log_tail_cache_entries);
+    std::unique_lock lg(m_tail_mtx);
+    if (lsn != m_tail_start_lsn + int64_cast(m_tail.size())) {
+        // Entry is not contiguous with the cached tail (overwritten or appended behind the cache's back), restart
+        m_tail.clear();
+        m_tail_start_lsn = lsn;
+    }
+    m_tail.push_back(entry);
+    while (m_tail.size() > max_entries) {
+        m_tail.pop_front();
+        ++m_tail_start_lsn;
+    }
+}
+
+void HomeRaftLogStore::drop_tail_from(repl_lsn_t lsn) {
+    std::unique_lock lg(m_tail_mtx);
+    if (lsn <= m_tail_start_lsn) {
+        m_tail.clear();
+    } else if (lsn < m_tail_start_lsn + int64_cast(m_tail.size())) {
+        m_tail.resize(lsn - m_tail_start_lsn);
+    }
+}
+
+nuraft::ptr< nuraft::log_entry > HomeRaftLogStore::cached_entry(repl_lsn_t lsn) const {
+    nuraft::ptr< nuraft::log_entry > le;
+    {
+        std::unique_lock lg(m_tail_mtx);
+        if ((lsn < m_tail_start_lsn) || (lsn >= m_tail_start_lsn + int64_cast(m_tail.size()))) { return nullptr; }
+        le = m_tail[lsn - m_tail_start_lsn];
+    }
+    return share_entry(*le);
+}
+
 ulong HomeRaftLogStore::last_durable_index() {
-    m_last_durable_lsn = m_log_store->get_contiguous_completed_seq_num(m_last_durable_lsn);
-    return to_repl_lsn(m_last_durable_lsn);
+    auto const durable_lsn = m_log_store->get_contiguous_completed_seq_num(m_last_durable_lsn.load());
+    m_last_durable_lsn.store(durable_lsn);
+    return to_repl_lsn(durable_lsn);
 }
 } // namespace home_replication
@@ -14,8 +14,12 @@
  *********************************************************************************/
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <mutex>
 #include <home_replication/repl_decls.h>
 #include <homestore/logstore_service.hpp>
+#include "log_store/term_index.h"
 
 #if defined __clang__ or defined __GNUC__
 #pragma GCC diagnostic push
@@ -35,6 +39,13 @@ using raft_buf_ptr_t = nuraft::ptr< nuraft::buffer >;
 
 class HomeRaftLogStore : public nuraft::log_store {
 public:
+    // Each record in the log store is laid out as [term (8 bytes)][log_val_type (1 byte)][log entry buffer]. If the
+    // store has inline framing enabled, its app_log entries have this many bytes reserved at the start of their buffer,
+    // in which case the framing is written in place and the buffer is persisted as is, instead of serializing the entry
+    // into a new buffer. Such records are marked by the store in the type byte and read back whole as the log entry
+    // buffer, with the reserved bytes intact.
+    static constexpr size_t inline_framing_size{sizeof(uint64_t) + sizeof(uint8_t)};
+
     explicit HomeRaftLogStore(homestore::logstore_id_t logstore_id = UINT32_MAX);
     virtual ~HomeRaftLogStore() = default;
 
@@ -128,7 +139,9 @@ public:
     virtual raft_buf_ptr_t pack(ulong index, int32_t cnt) override;
 
     /**
-     * Apply the log pack to current log store, starting from index.
+     * Apply the log pack to current log store, starting from index. Pack is written out while it is being applied,
+     * flushing every raft_log_apply_pack_flush_kb of it. If index is beyond the next slot, the slots in between are
+     * filled as a gap, without writing a record for each.
      *
      * @param index The start log index number (inclusive).
      * @param pack
@@ -147,6 +160,14 @@ public:
      */
     virtual bool compact(ulong last_log_index) override;
 
+    /**
+     * Moves the start of the log store to new_start, dropping all log entries before it. If new_start is beyond the
+     * next slot, next slot moves to new_start as well, without writing any filler entries for the slots skipped.
+     *
+     * @param new_start Log index number which becomes the start index.
+     */
+    void advance_start_index(ulong new_start);
+
     /**
      * Synchronously flush all log entries in this log store to the backing storage
      * so that all log entries are guaranteed to be durable upon process crash.
@@ -159,18 +180,37 @@ public:
      * This API is used only when `raft_params::parallel_log_appending_` flag is set.
      * Please refer to the comment of the flag.
      *
-     * NOTE: In home_replication use cases, we use this even without parallel_log_appending_ flag is not set
-     *
      * @return The last durable log index.
      */
     virtual ulong last_durable_index() override;
 
     homestore::logstore_id_t logstore_id() const { return m_logstore_id; }
 
+    /// @brief Every app_log entry appended from here on has inline_framing_size bytes reserved at the start of its
+    /// buffer, which are overwritten by the record framing. Records already in the store are read back as before.
+    void enable_inline_framing() { m_inline_framing = true; }
+
+private:
+    void cache_tail_entry(repl_lsn_t lsn, const nuraft::ptr< nuraft::log_entry >& entry);
+    void drop_tail_from(repl_lsn_t lsn);
+    nuraft::ptr< nuraft::log_entry > cached_entry(repl_lsn_t lsn) const;
+
 private:
     homestore::logstore_id_t m_logstore_id;
+    bool m_inline_framing{false};
     std::shared_ptr< homestore::HomeLogStore > m_log_store;
     nuraft::ptr< nuraft::log_entry > m_dummy_log_entry;
-    store_lsn_t m_last_durable_lsn{-1};
+    std::atomic< store_lsn_t > m_last_durable_lsn{-1};
+    RaftTermIndex m_term_index; // Terms of the entries in store, so that term_at doesn't need to read the log
+
+    // next_slot and start_index, loaded from the store on first use (-1 till then) and maintained on every change
+    mutable std::atomic< repl_lsn_t > m_next_slot{-1};
+    mutable std::atomic< repl_lsn_t > m_start_index{-1};
+
+    // Most recent entries [m_tail_start_lsn, m_tail_start_lsn + m_tail.size()) kept in memory, so that reads of the
+    // tail during steady state replication don't go to the log device
+    mutable std::mutex m_tail_mtx;
+    std::deque< nuraft::ptr< nuraft::log_entry > > m_tail;
+    repl_lsn_t m_tail_start_lsn{0};
 };
 } // namespace home_replication
\ No newline at end of file
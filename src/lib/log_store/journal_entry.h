@@ -1,17 +1,27 @@
 #pragma once
+#include <cassert>
+#include <cstring>
+#include <new>
 #include <boost/uuid/uuid.hpp>
 #include <sisl/utility/enum.hpp>
 #include <sisl/fds/buffer.hpp>
+#include <sisl/fds/utils.hpp>
 #include <home_replication/repl_decls.h>
+#include "log_store/home_raft_log_store.h"
 
 namespace home_replication {
 VENUM(journal_type_t, uint16_t, DATA = 0)
 using raft_buf_ptr_t = nuraft::ptr< nuraft::buffer >;
 
-static constexpr uint16_t JOURNAL_ENTRY_MAJOR{1};
+static constexpr uint16_t JOURNAL_ENTRY_MAJOR{2};
 static constexpr uint16_t JOURNAL_ENTRY_MINOR{0};
 
 struct repl_journal_entry {
+    // Bits of flags
+    // Entry received from the leader which still has the pbas and replica id of the leader, as some of its pbas map to
+    // more than one local pba (see ReplicaStateMachine::transform_journal_entry)
+    static constexpr uint16_t UNTRANSFORMED{0x1};
+
     // Major and minor version. For each major version underlying structures could change. Minor versions can only add
     // fields, not change any existing fields.
     uint16_t major_version{JOURNAL_ENTRY_MAJOR};
@@ -22,25 +32,86 @@ struct repl_journal_entry {
     uint32_t replica_id;
     uint32_t user_header_size;
     uint32_t key_size;
-    // Followed by user_header, then key, then pbas
+    uint16_t flags{0};
+    uint16_t reserved{0};
+    // Followed by user_header, then key, then pbas. Pbas are of the replica replica_id, on followers they are rewritten
+    // with the local pbas only when each of them maps to exactly one local pba, otherwise the entry is UNTRANSFORMED.
 
 public:
-    uint32_t total_size() const {
-        return sizeof(repl_journal_entry) + (n_pbas * sizeof(pba_t)) + user_header_size + key_size;
+    // Journal entry starts past the bytes reserved in the raft buffer for the log store record framing
+    static constexpr size_t offset_in_buf{HomeRaftLogStore::inline_framing_size};
+
+    static constexpr uint32_t total_size(uint16_t n, uint32_t header_size, uint32_t key_size) {
+        return sizeof(repl_journal_entry) + header_size + key_size + (n * (sizeof(pba_t) + sizeof(uint32_t)));
+    }
+    uint32_t total_size() const { return total_size(n_pbas, user_header_size, key_size); }
+
+    static repl_journal_entry* from_buf(const nuraft::buffer& buf) {
+        return r_cast< repl_journal_entry* >(buf.data_begin() + offset_in_buf);
     }
 };
 
+//
+// Builds a journal entry directly into the raft buffer which gets appended to the log store. Size is computed upfront
+// so that the buffer is allocated once and header, key and the pba list are written once, with room reserved for the
+// log store framing so that the buffer is persisted without serializing it again.
+//
+class journal_entry_builder {
+public:
+    journal_entry_builder(journal_type_t code, uint32_t replica_id, const sisl::blob& header, const sisl::blob& key,
+                          uint16_t n_pbas) :
+            m_buf{nuraft::buffer::alloc(repl_journal_entry::offset_in_buf +
+                                        repl_journal_entry::total_size(n_pbas, header.size, key.size))} {
+        auto* entry = new (m_buf->data_begin() + repl_journal_entry::offset_in_buf) repl_journal_entry();
+        entry->code = code;
+        entry->replica_id = replica_id;
+        entry->n_pbas = n_pbas;
+        entry->user_header_size = header.size;
+        entry->key_size = key.size;
+
+        m_cur = uintptr_cast(entry) + sizeof(repl_journal_entry);
+        std::memcpy(m_cur, header.bytes, header.size);
+        m_cur += header.size;
+        std::memcpy(m_cur, key.bytes, key.size);
+        m_cur += key.size;
+    }
+
+    // pba list layout: {pba-1, size-1}, {pba-2, size-2}, ..., {pba-n, size-n}
+    void add_pba(pba_t pba, uint32_t size) {
+        std::memcpy(m_cur, &pba, sizeof(pba_t));
+        m_cur += sizeof(pba_t);
+        std::memcpy(m_cur, &size, sizeof(uint32_t));
+        m_cur += sizeof(uint32_t);
+    }
+
+    raft_buf_ptr_t build() {
+        assert(m_cur == (m_buf->data_begin() + m_buf->size()));
+        return std::move(m_buf);
+    }
+
+private:
+    raft_buf_ptr_t m_buf;
+    uint8_t* m_cur;
+};
+
 struct repl_req {
-    sisl::blob header;                           // User header
-    sisl::blob key;                              // Key to replicate
-    sisl::sg_list value;                         // Raw value - applicable only to leader req
-    fq_pba_list_t remote_fq_pbas;                // List of remote pbas for the value
-    pba_list_t local_pbas;                       // List of corresponding local pbas for the value
-    void* user_ctx{nullptr};                     // User context passed with replica_set::write, valie for leader only
-    int64_t lsn{0};                              // Lsn for this replication req
-    raft_buf_ptr_t journal_entry;                // Journal entry info
-    std::atomic< uint32_t > num_pbas_written{0}; // Total pbas persisted in store
-    std::atomic< bool > is_raft_written{false};  // Has data to raft is flushed
+    // Bits of rollback_state, whichever of the local data write and rollback happens last releases the req
+    static constexpr uint8_t DATA_WRITTEN{0x1};
+    static constexpr uint8_t ROLLED_BACK{0x2};
+
+    sisl::blob header;                            // User header
+    sisl::blob key;                               // Key to replicate
+    sisl::sg_list value;                          // Raw value - applicable only to leader req
+    fq_pba_list_t remote_fq_pbas;                 // List of remote pbas for the value
+    pba_list_t local_pbas;                        // List of corresponding local pbas for the value
+    void* user_ctx{nullptr};                      // User context passed with replica_set::write, valie for leader only
+    int64_t lsn{0};                               // Lsn for this replication req
+    raft_buf_ptr_t journal_entry;                 // Journal entry info
+    std::atomic< uint32_t > num_pbas_written{0};  // Total pbas persisted in store
+    std::atomic< bool > is_raft_written{false};   // Has data to raft is flushed
+    Clock::time_point created_time{Clock::now()}; // Time the req is proposed (leader) or received (follower)
+    Clock::time_point precommit_time;             // Time the req is pre-committed
+    std::atomic< uint8_t > rollback_state{0};     // DATA_WRITTEN/ROLLED_BACK, for req proposed by this replica
 };
 
 } // namespace home_replication
\ No newline at end of file
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <home_replication/repl_service.h>
 #include "state_machine/state_machine.h"
 #include "log_store/journal_entry.h"
@@ -8,8 +12,11 @@ namespace home_replication {
 template < typename LogStoreImplT >
 class ReplicaLogStore : public LogStoreImplT {
 public:
+    // Journal entries are built with the record framing reserved in their buffer (see journal_entry_builder)
     template < typename... Args >
-    ReplicaLogStore(Args&&... args) : LogStoreImplT{std::forward< Args >(args)...} {}
+    ReplicaLogStore(Args&&... args) : LogStoreImplT{std::forward< Args >(args)...} {
+        LogStoreImplT::enable_inline_framing();
+    }
 
     void attach_replica_set(ReplicaSet* rs) {
         m_rs = rs;
@@ -17,67 +24,175 @@ public:
     }
 
     uint64_t append(nuraft::ptr< nuraft::log_entry >& entry) override {
-        repl_req* req = m_sm->transform_journal_entry(entry->get_buf_ptr());
+        repl_req* req = transform_journal_entry(entry);
         auto const lsn = LogStoreImplT::append(entry);
         if (req) { m_sm->link_lsn_to_req(req, int64_cast(lsn)); }
         return lsn;
     }
 
+    void end_of_append_batch(ulong start_lsn, ulong count) override {
+        // Journal flush and the data writes of this batch proceed concurrently without holding the append thread. Raft
+        // is notified once both are done and last_durable_index moves past the batch, which is when the append is
+        // acknowledged (parallel_log_appending_). Leader writes its own data as part of the proposal, so it only waits
+        // for the journal flush here.
+        auto batch = std::make_shared< append_batch >();
+        batch->start_lsn = int64_cast(start_lsn);
+        {
+            std::unique_lock lg(m_batch_mtx);
+            m_inflight_batches.emplace(batch->start_lsn, batch);
+        }
+
+        if (!m_rs->is_leader()) {
+            // Start fetch the batch of data for this lsn range from remote if its not available yet.
+            std::vector< fully_qualified_pba > pbas;
+            for (int64_t lsn = int64_cast(start_lsn); lsn < int64_cast(start_lsn + count); ++lsn) {
+                repl_req* req = m_sm->try_lsn_to_req(lsn);
+                if (req == nullptr) { continue; } // Not a journal entry
+                pbas.insert(std::end(pbas), std::begin(req->remote_fq_pbas), std::end(req->remote_fq_pbas));
+                batch->reqs.push_back(req);
+            }
+
+            fetch_batch_data(batch, pbas);
+        } else {
+            on_batch_part_done(batch);
+        }
+
+        // Flush the journal for this lsn batch
+        iomanager.run_on(iomgr::thread_regex::random_worker,
+                         [this, batch, start_lsn, count]([[maybe_unused]] iomgr::io_thread_addr_t addr) {
+                             auto const flush_start = Clock::now();
+                             LogStoreImplT::end_of_append_batch(start_lsn, count);
+                             HISTOGRAM_OBSERVE(m_sm->metrics(), journal_flush_latency_us,
+                                               get_elapsed_time_us(flush_start));
+                             on_batch_part_done(batch);
+                         });
+    }
+
     void write_at(ulong index, nuraft::ptr< nuraft::log_entry >& entry) override {
-        repl_req* req = m_sm->transform_journal_entry(entry->get_buf_ptr());
+        {
+            // Batches being overwritten no longer hold back the durable index, nor do they refer to the reqs being
+            // rolled back below
+            std::unique_lock lg(m_batch_mtx);
+            auto it = m_inflight_batches.lower_bound(int64_cast(index));
+            if ((it != m_inflight_batches.begin()) && (std::prev(it)->second != nullptr)) {
+                auto& reqs = std::prev(it)->second->reqs;
+                reqs.erase(std::remove_if(reqs.begin(), reqs.end(),
+                                          [index](const repl_req* req) { return req->lsn >= int64_cast(index); }),
+                           reqs.end());
+            }
+            m_inflight_batches.erase(it, m_inflight_batches.end());
+        }
+        m_sm->rollback_reqs(int64_cast(index), int64_cast(LogStoreImplT::next_slot()));
+
+        repl_req* req = transform_journal_entry(entry);
         LogStoreImplT::write_at(index, entry);
         if (req) { m_sm->link_lsn_to_req(req, int64_cast(index)); }
     }
 
-    void end_of_append_batch(ulong start_lsn, ulong count) override {
-        // Skip this call in leader, since this method will synchronously flush the data, which is not required for
-        // leader. Leader will call the flush as part of commit after receiving quorum, upon which time, there is a high
-        // possibility the log entry is already flushed.
-        if (!m_rs->is_leader()) {
-            int64_t end_lsn = int64_cast(start_lsn + count);
-
-            // Start fetch the batch of data for this lsn range from remote if its not available yet.
-            static thread_local std::vector< fully_qualified_pba > s_pbas;
-            static thread_local std::vector< repl_req* > s_reqs;
-            s_pbas.clear();
-            s_reqs.clear();
-            for (int64_t lsn = int64_cast(start_lsn); lsn <= end_lsn; ++lsn) {
-                repl_req* req = m_sm->lsn_to_req(lsn);
-                s_pbas.insert(std::end(s_pbas), std::begin(req->remote_fq_pbas), std::end(req->remote_fq_pbas));
-                s_reqs.push_back(req);
+    void apply_pack(ulong index, nuraft::buffer& pack) override {
+        // Entries from index onwards are replaced by the pack
+        if (index < LogStoreImplT::next_slot()) {
+            {
+                std::unique_lock lg(m_batch_mtx);
+                m_inflight_batches.erase(m_inflight_batches.lower_bound(int64_cast(index)), m_inflight_batches.end());
             }
+            m_sm->rollback_reqs(int64_cast(index), int64_cast(LogStoreImplT::next_slot()));
+        }
+        LogStoreImplT::apply_pack(index, pack);
+    }
 
-            bool wait = m_sm->async_fetch_write_pbas(s_pbas, [this, end_lsn]() {
-                {
-                    std::unique_lock lg(m_batch_mtx);
-                    m_batch_lsn = end_lsn;
-                }
-                m_batch_cv.notify_one();
-            });
-
-            // Flush the journal for this lsn batch
-            LogStoreImplT::end_of_append_batch(start_lsn, count);
-
-            // If we had to fetch the data from remote, wait here until it is completed
-            if (wait) {
-                std::unique_lock< std::mutex > lg(m_batch_mtx);
-                m_batch_cv.wait(lg, [this, end_lsn]() { return (m_batch_lsn == end_lsn); });
-            }
+    ulong last_durable_index() override {
+        auto const journal_durable_lsn = LogStoreImplT::last_durable_index();
+        std::unique_lock lg(m_batch_mtx);
+        if (m_inflight_batches.empty()) { return journal_durable_lsn; }
+        return std::min(journal_durable_lsn, uint64_cast(m_inflight_batches.begin()->first - 1));
+    }
+
+private:
+    // A batch of appended entries, which is durable once both its journal flush and data writes are done
+    struct append_batch {
+        int64_t start_lsn{0};
+        std::vector< repl_req* > reqs;
+        std::atomic< uint32_t > pending{2};
+        std::atomic< bool > failed{false}; // Remote fetch of some of its data gave up
+    };
 
-            // Mark all the pbas also completely written
-            for (auto* req : s_reqs) {
+    void on_batch_part_done(const std::shared_ptr< append_batch >& batch, bool success = true) {
+        if (!success) { batch->failed.store(true); }
+        if (batch->pending.fetch_sub(1) != 1) { return; }
+        if (batch->failed.exchange(false)) {
+            // Data is fetched again, as the batch holds back the durable index, and so the acknowledgement of it and of
+            // every entry after it, till it is done or its entries are overwritten by the leader (write_at/apply_pack)
+            refetch_batch_data(batch);
+            return;
+        }
+
+        bool advanced{false};
+        {
+            // Batches can complete out of order, durable index moves only over the contiguous completed ones
+            std::unique_lock lg(m_batch_mtx);
+            auto it = m_inflight_batches.find(batch->start_lsn);
+            if ((it == m_inflight_batches.end()) || (it->second != batch)) { return; } // Overwritten by write_at
+
+            // Mark all the pbas also completely written. Done under the lock, since write_at rolls back the reqs
+            // once they are out of the batch. Reqs whose commit arrived already are committed once the durable index
+            // moves past them below, see ReplicaStateMachine::on_journal_durable().
+            for (auto* req : batch->reqs) {
                 req->is_raft_written.store(true);
                 req->num_pbas_written.store(req->local_pbas.size());
             }
+            it->second.reset();
+            while (!m_inflight_batches.empty() && (m_inflight_batches.begin()->second == nullptr)) {
+                m_inflight_batches.erase(m_inflight_batches.begin());
+                advanced = true;
+            }
+        }
+
+        if (advanced) {
+            auto* raft_server = m_rs->raft_server();
+            if (raft_server) { raft_server->notify_log_append_completion(true); }
+            m_sm->on_journal_durable();
+        }
+    }
+
+    void fetch_batch_data(const std::shared_ptr< append_batch >& batch,
+                          const std::vector< fully_qualified_pba >& pbas) {
+        bool const wait =
+            m_sm->async_fetch_write_pbas(pbas, [this, batch](bool success) { on_batch_part_done(batch, success); });
+        if (!wait) { on_batch_part_done(batch); }
+    }
+
+    void refetch_batch_data(const std::shared_ptr< append_batch >& batch) {
+        std::vector< fully_qualified_pba > pbas;
+        {
+            std::unique_lock lg(m_batch_mtx);
+            auto it = m_inflight_batches.find(batch->start_lsn);
+            if ((it == m_inflight_batches.end()) || (it->second != batch)) { return; } // Overwritten by write_at
+            for (auto const* req : batch->reqs) {
+                pbas.insert(std::end(pbas), std::begin(req->remote_fq_pbas), std::end(req->remote_fq_pbas));
+            }
         }
+        LOGWARNMOD(home_replication, "Data of the append batch at lsn={} could not be fetched, fetching it again",
+                   batch->start_lsn);
+        COUNTER_INCREMENT(m_sm->metrics(), append_batch_refetches, 1);
+
+        // Pbas left to fetch are waited on for wait_pba_write_timer_sec before they are fetched, which spaces out the
+        // attempts while the leader is unreachable
+        batch->pending.fetch_add(1);
+        fetch_batch_data(batch, pbas);
+    }
+
+    repl_req* transform_journal_entry(const nuraft::ptr< nuraft::log_entry >& entry) {
+        // Only app_log entries carry journal entries, rest (config etc) are internal to raft
+        if (entry->get_val_type() != nuraft::log_val_type::app_log) { return nullptr; }
+        return m_sm->transform_journal_entry(entry->get_buf_ptr());
     }
 
 private:
     ReplicaSet* m_rs{nullptr};
     ReplicaStateMachine* m_sm{nullptr};
     std::mutex m_batch_mtx;
-    std::condition_variable m_batch_cv;
-    int64_t m_batch_lsn{0};
+    std::map< int64_t, std::shared_ptr< append_batch > > m_inflight_batches; // start lsn -> batch, nullptr once done
 };
 
 } // namespace home_replication
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+#include <folly/SharedMutex.h>
+
+namespace home_replication {
+
+// In-memory index of the term of every entry in a raft log store. Terms never decrease with the lsn, so the index is
+// run length encoded as one (start lsn, term) pair per run of consecutive entries of the same term, which keeps it a
+// handful of pairs for the entire log.
+class RaftTermIndex {
+public:
+    using lsn_t = int64_t;
+
+    /// @brief Records the term of count entries starting at lsn. Entries at or beyond lsn are replaced by these.
+    void append(lsn_t lsn, uint64_t term, lsn_t count = 1) {
+        folly::SharedMutexWritePriority::WriteHolder holder(m_lock);
+        while (!m_runs.empty() && (m_runs.back().first >= lsn)) {
+            m_runs.pop_back();
+        }
+        if (m_runs.empty() || (m_runs.back().second != term)) { m_runs.emplace_back(lsn, term); }
+        m_next_lsn = lsn + count;
+    }
+
+    /// @brief Drops all entries upto (and including) lsn from the index
+    void truncate(lsn_t upto_lsn) {
+        folly::SharedMutexWritePriority::WriteHolder holder(m_lock);
+        auto it = std::upper_bound(m_runs.begin(), m_runs.end(), upto_lsn + 1,
+                                   [](lsn_t lsn, const run_t& run) { return lsn < run.first; });
+        if (it != m_runs.begin()) {
+            // Run in which the first remaining entry falls now starts from that entry
+            --it;
+            it->first = upto_lsn + 1;
+        }
+        m_runs.erase(m_runs.begin(), it);
+        if (m_next_lsn <= upto_lsn) { m_next_lsn = upto_lsn + 1; }
+    }
+
+    /// @brief Term of the entry at lsn
+    /// @return std::nullopt if the entry is not in the index
+    std::optional< uint64_t > term_at(lsn_t lsn) const {
+        folly::SharedMutexWritePriority::ReadHolder holder(m_lock);
+        if (lsn >= m_next_lsn) { return std::nullopt; }
+        auto it = std::upper_bound(m_runs.begin(), m_runs.end(), lsn,
+                                   [](lsn_t l, const run_t& run) { return l < run.first; });
+        if (it == m_runs.begin()) { return std::nullopt; }
+        return std::prev(it)->second;
+    }
+
+private:
+    using run_t = std::pair< lsn_t, uint64_t >; // start lsn of the run, term
+
+    mutable folly::SharedMutexWritePriority m_lock;
+    std::vector< run_t > m_runs;
+    lsn_t m_next_lsn{0};
+};
+
+} // namespace home_replication
@@ -1,5 +1,9 @@
+#include <future>
+#include <iomgr/iomgr_timer.hpp>
 #include <home_replication/repl_service.h>
+#include <home_replication/repl_set.h>
 #include "service/home_repl_backend.h"
+#include "service/repl_config.h"
 #include "log_store/repl_log_store.hpp"
 #include "log_store/home_raft_log_store.h"
 #include "storage/home_storage_engine.h"
@@ -17,18 +21,68 @@ HomeReplicationBackend::HomeReplicationBackend(ReplicationService* svc) : Replic
         nullptr);
 }
 
+HomeReplicationBackend::~HomeReplicationBackend() {
+    if (!m_ckpt_running) { return; }
+
+    // Timer is cancelled on the checkpoint thread, where it is re-armed as well, so no pass re-arms it afterwards
+    iomanager.run_on(
+        m_ckpt_thread,
+        [this](iomgr::io_thread_addr_t) {
+            m_ckpt_running = false;
+            if (m_ckpt_timer_hdl != iomgr::null_timer_handle) {
+                iomanager.cancel_timer(m_ckpt_timer_hdl);
+                m_ckpt_timer_hdl = iomgr::null_timer_handle;
+            }
+        },
+        iomgr::wait_type_t::spin);
+    iomanager.run_on(m_ckpt_thread, [](iomgr::io_thread_addr_t) { iomanager.stop_io_loop(); });
+}
+
+void HomeReplicationBackend::start_checkpointer() {
+    std::call_once(m_ckpt_started, [this]() {
+        std::promise< void > started;
+        iomanager.create_reactor("hr_checkpoint", iomgr::INTERRUPT_LOOP, [this, &started](bool is_started) {
+            if (is_started) {
+                m_ckpt_thread = iomanager.iothread_self();
+                started.set_value();
+            }
+        });
+        started.get_future().get();
+        m_ckpt_running = true;
+        iomanager.run_on(m_ckpt_thread, [this](iomgr::io_thread_addr_t) { schedule_checkpoint(); });
+    });
+}
+
+void HomeReplicationBackend::schedule_checkpoint() {
+    // Armed afresh for every pass, so that a change of checkpoint_interval_ms takes effect from the next one
+    m_ckpt_timer_hdl = iomanager.schedule_thread_timer(HR_DYNAMIC_CONFIG(checkpoint_interval_ms) * 1000 * 1000,
+                                                       false /* recurring */, nullptr, [this](void*) {
+                                                           m_ckpt_timer_hdl = iomgr::null_timer_handle;
+                                                           checkpoint_replica_sets();
+                                                           if (m_ckpt_running) { schedule_checkpoint(); }
+                                                       });
+}
+
+void HomeReplicationBackend::checkpoint_replica_sets() {
+    m_svc->iterate_replica_sets([](const rs_ptr_t& rs) {
+        if (rs) { rs->checkpoint(); }
+    });
+}
+
 void HomeReplicationBackend::rs_super_blk_found(const sisl::byte_view& buf, void* meta_cookie) {
     homestore::superblk< home_rs_superblk > rs_sb;
     rs_sb.load(buf, meta_cookie);
     DEBUG_ASSERT_EQ(rs_sb->get_magic(), home_rs_superblk::REPLICA_SET_SB_MAGIC, "Invalid rs metablk, magic mismatch");
     DEBUG_ASSERT_EQ(rs_sb->get_version(), home_rs_superblk::REPLICA_SET_SB_VERSION, "Invalid version of rs metablk");
 
+    start_checkpointer();
     auto sms = std::make_shared< HomeStateMachineStore >(rs_sb);
     auto rls = std::make_shared< ReplicaLogStore< HomeRaftLogStore > >(rs_sb->m_data_journal_id);
     m_svc->on_replica_store_found(rs_sb->uuid, sms, rls);
 }
 
 std::shared_ptr< StateMachineStore > HomeReplicationBackend::create_state_store(uuid_t uuid) {
+    start_checkpointer();
     return std::make_shared< HomeStateMachineStore >(uuid);
 }
 
@@ -1,4 +1,6 @@
 #pragma once
+#include <mutex>
+#include <iomgr/iomgr.hpp>
 #include <sisl/fds/buffer.hpp>
 #include "service/repl_backend.h"
 namespace nuraft {
@@ -11,7 +13,7 @@ class StateMachineStore;
 class HomeReplicationBackend : public ReplicationServiceBackend {
 public:
     HomeReplicationBackend(ReplicationService* svc);
-    ~HomeReplicationBackend() override = default;
+    ~HomeReplicationBackend() override;
 
     std::shared_ptr< StateMachineStore > create_state_store(uuid_t uuid) override;
     std::shared_ptr< nuraft::log_store > create_log_store() override;
@@ -19,5 +21,15 @@ public:
 
 private:
     void rs_super_blk_found(const sisl::byte_view& buf, void* meta_cookie);
+    void start_checkpointer();
+    void schedule_checkpoint();
+    void checkpoint_replica_sets();
+
+private:
+    // Replica sets are checkpointed one after another on a dedicated thread, started along with the first of them
+    std::once_flag m_ckpt_started;
+    iomgr::io_thread_t m_ckpt_thread;
+    iomgr::timer_handle_t m_ckpt_timer_hdl{iomgr::null_timer_handle};
+    bool m_ckpt_running{false}; // Accessed on the checkpoint thread once it is started
 };
 } // namespace home_replication
@@ -8,4 +8,5 @@ SETTINGS_INIT(HomeReplicationSettings, repl_config)
 
 #define HR_DYNAMIC_CONFIG_WITH(...) SETTINGS(repl_config, __VA_ARGS__)
 #define HR_DYNAMIC_CONFIG_THIS(...) SETTINGS_THIS(repl_config, __VA_ARGS__)
-#define HR_DYNAMIC_CONFIG(...) SETTINGS_VALUE(repl_config, __VA_ARGS__)
\ No newline at end of file
+#define HR_DYNAMIC_CONFIG(...) SETTINGS_VALUE(repl_config, __VA_ARGS__)
+#define HR_SETTINGS_FACTORY() SETTINGS_FACTORY(repl_config)
\ No newline at end of file
@@ -8,12 +8,16 @@
 #include <home_replication/repl_set.h>
 #include "service/repl_backend.h"
 #include "service/home_repl_backend.h"
+#include "service/uuid_registry.h"
+#include "service/repl_config.h"
 
 namespace home_replication {
 ReplicationService::ReplicationService(backend_impl_t backend,
                                        std::shared_ptr< nuraft_mesg::consensus_component > messaging,
                                        on_replica_set_init_t cb) :
-        m_on_rs_init_cb{std::move(cb)}, m_messaging(messaging) {
+        m_rs_registry{std::make_unique< UuidRegistry< ReplicaSet > >()},
+        m_on_rs_init_cb{std::move(cb)},
+        m_messaging(messaging) {
     switch (backend) {
     case backend_impl_t::homestore:
         m_backend = std::make_unique< HomeReplicationBackend >(this);
@@ -24,74 +28,72 @@ ReplicationService::ReplicationService(backend_impl_t backend,
         throw std::runtime_error("Repl Services with jungleDB backend is unsupported yet");
     }
 
-    // FIXME: RAFT server parameters, should be a config and reviewed!!!
-    nuraft::raft_params r_params;
-    r_params.with_election_timeout_lower(900)
-        .with_election_timeout_upper(1400)
-        .with_hb_interval(250)
-        .with_max_append_size(10)
-        .with_rpc_failure_backoff(250)
-        .with_auto_forwarding(true)
-        .with_snapshot_enabled(1);
-
     // This closure is where we initialize new ReplicaSet instances. When NuRaft Messging is asked to join a new group
     // either through direct creation or gRPC request it will use this callback to initialize a new state_manager and
     // state_machine for the raft_server it constructs.
     auto group_type_params = nuraft_mesg::consensus_component::register_params{
-        r_params,
-        [this](int32_t const, std::string const& group_id) mutable -> std::shared_ptr< nuraft_mesg::mesg_state_mgr > {
-            return create_replica_set(boost::uuids::string_generator()(group_id));
+        raft_params(),
+        [this](int32_t const srv_id,
+               std::string const& group_id) mutable -> std::shared_ptr< nuraft_mesg::mesg_state_mgr > {
+            // Replica set found on recovery joins its group through here as well, which is when it learns its id
+            auto rs = create_replica_set(boost::uuids::string_generator()(group_id));
+            if (rs) { rs->set_server_id(srv_id); }
+            return rs;
         }};
     m_messaging->register_mgr_type("home_replication", group_type_params);
 }
 
 ReplicationService::~ReplicationService() = default;
 
-rs_ptr_t ReplicationService::lookup_replica_set(uuid_t uuid) {
-    std::unique_lock lg(m_rs_map_mtx);
-    auto it = m_rs_map.find(uuid);
-    return (it == m_rs_map.end() ? nullptr : it->second);
-}
+nuraft::raft_params ReplicationService::raft_params() {
+    // FIXME: RAFT server parameters, should be a config and reviewed!!!
+    nuraft::raft_params r_params;
+    r_params.with_election_timeout_lower(900)
+        .with_election_timeout_upper(1400)
+        .with_hb_interval(250)
+        .with_max_append_size(10)
+        .with_rpc_failure_backoff(250)
+        .with_auto_forwarding(true)
+        .with_snapshot_enabled(s_cast< int32_t >(HR_DYNAMIC_CONFIG(snapshot_distance)));
 
-rs_ptr_t ReplicationService::create_replica_set(uuid_t const uuid) {
-    auto it = m_rs_map.end();
-    bool happened = false;
+    // Followers acknowledge an append only after both journal and data of the entries are durable, which is tracked
+    // asynchronously by the log store (see ReplicaLogStore::end_of_append_batch)
+    r_params.parallel_log_appending_ = true;
+    r_params.reserved_log_items_ = s_cast< int32_t >(HR_DYNAMIC_CONFIG(raft_reserved_log_entries));
+    return r_params;
+}
 
-    {
-        std::unique_lock lg(m_rs_map_mtx);
-        std::tie(it, happened) = m_rs_map.emplace(std::make_pair(uuid, nullptr));
-    }
-    DEBUG_ASSERT(m_rs_map.end() != it, "Could not insert into map!");
-    if (!happened) return it->second;
+rs_ptr_t ReplicationService::lookup_replica_set(uuid_t uuid) { return m_rs_registry->lookup(uuid); }
 
-    auto log_store = m_backend->create_log_store();
-    it->second =
-        std::make_shared< ReplicaSet >(boost::uuids::to_string(uuid), m_backend->create_state_store(uuid), log_store);
-    it->second->attach_listener(std::move(m_on_rs_init_cb(it->second)));
-    m_backend->link_log_store_to_replica_set(log_store.get(), it->second.get());
-    return it->second;
+rs_ptr_t ReplicationService::create_replica_set(uuid_t const uuid) {
+    // Replica set is visible to lookups only once it is fully initialized
+    return m_rs_registry
+        ->get_or_create(uuid,
+                        [this, &uuid]() {
+                            auto log_store = m_backend->create_log_store();
+                            return init_replica_set(uuid, m_backend->create_state_store(uuid), log_store);
+                        })
+        .first;
 }
 
 void ReplicationService::on_replica_store_found(uuid_t const uuid, const std::shared_ptr< StateMachineStore >& sm_store,
                                                 const std::shared_ptr< nuraft::log_store >& log_store) {
-    auto it = m_rs_map.end();
-    bool happened = false;
-
-    {
-        std::unique_lock lg(m_rs_map_mtx);
-        std::tie(it, happened) = m_rs_map.emplace(std::make_pair(uuid, nullptr));
-    }
-    DEBUG_ASSERT(m_rs_map.end() != it, "Could not insert into map!");
-    if (!happened) return;
+    m_rs_registry->get_or_create(uuid, [this, &uuid, &sm_store, &log_store]() {
+        return init_replica_set(uuid, sm_store, log_store);
+    });
+}
 
-    it->second = std::make_shared< ReplicaSet >(boost::uuids::to_string(uuid), sm_store, log_store);
-    it->second->attach_listener(std::move(m_on_rs_init_cb(it->second)));
-    m_backend->link_log_store_to_replica_set(log_store.get(), it->second.get());
+rs_ptr_t ReplicationService::init_replica_set(uuid_t const uuid, const std::shared_ptr< StateMachineStore >& sm_store,
+                                              const std::shared_ptr< nuraft::log_store >& log_store) {
+    auto rs = std::make_shared< ReplicaSet >(boost::uuids::to_string(uuid), sm_store, log_store);
+    rs->attach_listener(std::move(m_on_rs_init_cb(rs)));
+    m_backend->link_log_store_to_replica_set(log_store.get(), rs.get());
+    rs->register_data_service_apis(m_messaging);
+    return rs;
 }
 
 void ReplicationService::iterate_replica_sets(const std::function< void(const rs_ptr_t&) >& cb) {
-    std::unique_lock lg(m_rs_map_mtx);
-    for (const auto& [uuid, rs] : m_rs_map) {
+    for (const auto& rs : m_rs_registry->snapshot()) {
         cb(rs);
     }
 }
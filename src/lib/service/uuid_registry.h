@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <boost/functional/hash.hpp>
+#include <folly/concurrency/ConcurrentHashMap.h>
+#include <home_replication/repl_decls.h>
+
+namespace home_replication {
+
+// Concurrent registry of objects keyed by their uuid, such as the replica sets of a service. Lookups, which are on the
+// path of every request routed to an object, never take a lock. Creation of an uuid is serialized through a small array
+// of mutexes picked by the uuid, so an object is built only once and is published only after it is fully
+// built.
+template < typename T >
+class UuidRegistry {
+public:
+    using obj_ptr_t = std::shared_ptr< T >;
+
+    /// @brief Object registered for uuid
+    /// @return nullptr if there is no such object
+    obj_ptr_t lookup(uuid_t const& uuid) const {
+        auto const it = m_map.find(uuid);
+        return (it == m_map.cend()) ? nullptr : it->second;
+    }
+
+    /// @brief Object registered for uuid, which is built by create_cb and registered if there is no such object yet.
+    /// create_cb is called without any lock held, other than the one serializing creation of this uuid.
+    /// @return Object and whether it was created by this call
+    std::pair< obj_ptr_t, bool > get_or_create(uuid_t const& uuid, const std::function< obj_ptr_t() >& create_cb) {
+        std::unique_lock lg(create_mtx(uuid));
+        if (auto obj = lookup(uuid); obj) { return {std::move(obj), false}; }
+
+        auto obj = create_cb();
+        if (!obj) { return {nullptr, false}; }
+        m_map.insert_or_assign(uuid, obj);
+        return {std::move(obj), true};
+    }
+
+    /// @brief Objects registered as of now. Taken without blocking the other operations, objects created
+    /// concurrently may or may not be part of it.
+    std::vector< obj_ptr_t > snapshot() const {
+        std::vector< obj_ptr_t > objs;
+        objs.reserve(m_map.size());
+        for (auto it = m_map.cbegin(); it != m_map.cend(); ++it) {
+            objs.push_back(it->second);
+        }
+        return objs;
+    }
+
+    size_t size() const { return m_map.size(); }
+
+private:
+    static constexpr size_t num_create_locks{64};
+
+    std::mutex& create_mtx(uuid_t const& uuid) {
+        return m_create_mtx[boost::hash< uuid_t >{}(uuid) % num_create_locks];
+    }
+
+private:
+    folly::ConcurrentHashMap< uuid_t, obj_ptr_t, boost::hash< uuid_t > > m_map;
+    std::array< std::mutex, num_create_locks > m_create_mtx;
+};
+
+} // namespace home_replication
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <folly/concurrency/ConcurrentHashMap.h>
+#include <folly/hash/Hash.h>
+#include <home_replication/repl_decls.h>
+
+namespace home_replication {
+
+// Fixed width key of a fully qualified pba. Size of the pba is not part of the identity.
+struct fq_pba_key {
+    fq_pba_key(uint32_t s, pba_t p) : server_id{s}, pba{p} {}
+    explicit fq_pba_key(const fully_qualified_pba& fq_pba) : fq_pba_key{fq_pba.server_id, fq_pba.pba} {}
+
+    bool operator==(const fq_pba_key& other) const { return (pba == other.pba) && (server_id == other.server_id); }
+
+    uint32_t server_id;
+    pba_t pba;
+};
+
+struct fq_pba_key_hash {
+    // Result is already well mixed, so the table need not mix it again
+    using folly_is_avalanching = std::true_type;
+
+    size_t operator()(const fq_pba_key& key) const {
+        return folly::hash::hash_128_to_64(key.pba, uint64_t{key.server_id});
+    }
+};
+
+// Concurrent map indexed by fully qualified pba. Open addressing (SIMD probed) variant is used where the platform
+// supports it, falls back to the default chained variant otherwise.
+#if FOLLY_SSE_PREREQ(4, 2) && !FOLLY_MOBILE
+template < typename V >
+using fq_pba_map_t = folly::ConcurrentHashMapSIMD< fq_pba_key, V, fq_pba_key_hash >;
+#else
+template < typename V >
+using fq_pba_map_t = folly::ConcurrentHashMap< fq_pba_key, V, fq_pba_key_hash >;
+#endif
+
+} // namespace home_replication
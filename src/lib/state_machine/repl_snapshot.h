@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <home_replication/repl_decls.h>
+#include "state_machine/rpc_data_channel.h"
+
+#if defined __clang__ or defined __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+#include <libnuraft/nuraft.hxx>
+#if defined __clang__ or defined __GNUC__
+#pragma GCC diagnostic pop
+#endif
+#undef auto_lock
+
+namespace home_replication {
+
+//
+// Layout of the logical snapshot objects raft ships to a replica which is behind the start of the log:
+//
+// Object 0 (meta):   [snapshot_meta][user data of the listener]
+// Object N (data):   [pbas_serialized][data of pba-1]...[data of pba-n]
+//
+// Data objects carry the pbas of the snapshot in order, as many as fit in the configured object size (at least one).
+// Split of the pbas into objects is fixed when the snapshot is taken, so any object can be read again by the leader
+// and the receiver asks for the object it needs next, which resumes an interrupted transfer from where it stopped.
+//
+#pragma pack(1)
+struct snapshot_meta {
+    static constexpr uint16_t MAJOR_VERSION{0};
+    static constexpr uint16_t MINOR_VERSION{1};
+
+    uint16_t major_version{MAJOR_VERSION};
+    uint16_t minor_version{MINOR_VERSION};
+    int64_t lsn{0};             // Lsn the snapshot is taken at
+    uint64_t n_pbas{0};         // Total number of pbas in the snapshot
+    uint64_t n_data_objs{0};    // Number of data objects following the meta object
+    uint32_t user_data_size{0}; // Size of the listener data following this header
+};
+#pragma pack()
+
+// Snapshot taken on this replica
+struct repl_snapshot {
+    nuraft::ptr< nuraft::snapshot > raft_snp;
+    bool has_data{true};              // Snapshot installed from another replica is not shipped again
+    std::vector< uint8_t > user_data; // Opaque data of the listener
+    std::vector< pba_t > pbas;        // Pbas owned by the listener as of the snapshot lsn
+    std::vector< uint32_t > sizes;    // Size of each pba
+    std::vector< uint64_t > obj_ends; // Index past the last pba of each data object
+
+    uint64_t n_data_objs() const { return obj_ends.size(); }
+    uint64_t obj_begin(uint64_t obj_id) const { return (obj_id == 1) ? 0 : obj_ends[obj_id - 2]; }
+    uint64_t obj_end(uint64_t obj_id) const { return obj_ends[obj_id - 1]; }
+};
+
+// Snapshot being received on this replica
+struct snapshot_receive_ctx {
+    int64_t lsn{0};
+    std::vector< uint8_t > user_data;
+    uint64_t n_pbas{0};
+    uint64_t n_data_objs{0};
+    uint64_t next_obj_id{1};
+    std::vector< std::pair< pba_t, pba_list_t > > pba_map; // Pba of the leader to the local pbas its data is written to
+
+    bool is_complete() const { return (next_obj_id == n_data_objs + 1) && (pba_map.size() == n_pbas); }
+};
+
+} // namespace home_replication
@@ -1,30 +1,86 @@
 #include <home_replication/repl_set.h>
 
+#include <boost/uuid/string_generator.hpp>
+#include <boost/uuid/nil_generator.hpp>
 #include <sisl/fds/obj_allocator.hpp>
 #include <sisl/fds/vector_pool.hpp>
 #include <home_replication/repl_service.h>
 #include "state_machine/state_machine.h"
+#include "state_machine/rpc_data_channel.h"
 #include "log_store/repl_log_store.hpp"
 #include "log_store/journal_entry.h"
 #include "storage/storage_engine.h"
 
 namespace home_replication {
+static uuid_t to_group_uuid(const std::string& group_id) {
+    try {
+        return boost::uuids::string_generator()(group_id);
+    } catch (const std::runtime_error&) { return boost::uuids::nil_uuid(); }
+}
+
 ReplicaSet::ReplicaSet(const std::string& group_id, const std::shared_ptr< StateMachineStore >& sm_store,
                        const std::shared_ptr< nuraft::log_store >& log_store) :
         m_state_machine{nullptr},
         m_state_store{sm_store},
         m_data_journal{log_store},
-        m_group_id{group_id} {}
+        m_group_id{group_id},
+        m_group_uuid{to_group_uuid(group_id)} {}
 
 void ReplicaSet::write(const sisl::blob& header, const sisl::blob& key, const sisl::sg_list& value, void* user_ctx) {
     m_state_machine->propose(header, key, value, user_ctx);
 }
 
+void ReplicaSet::write_batch(const std::vector< write_obj >& objs) { m_state_machine->propose_batch(objs); }
+
 void ReplicaSet::transfer_pba_ownership(int64_t lsn, const pba_list_t& pbas) {
     m_state_store->add_free_pba_record(lsn, pbas);
 }
 
-// void ReplicaSet::on_data_received() {}
+void ReplicaSet::checkpoint() {
+    // Nothing to reclaim till the state machine is up
+    if (m_state_machine) { m_state_machine->checkpoint(); }
+}
+
+bool ReplicaSet::register_data_service_apis(const std::shared_ptr< nuraft_mesg::consensus_component >& messaging) {
+    // Ensure the state machine is available before any data arrives
+    get_state_machine();
+
+    auto const bind = [this, &messaging](const std::string& rpc_name,
+                                         void (ReplicaStateMachine::*handler)(const sisl::io_blob&,
+                                                                              data_rpc_respond_cb_t)) -> bool {
+        return messaging->bind_data_service_request(
+            rpc_name, m_group_id,
+            [this, handler](const sisl::io_blob& incoming_buf, boost::intrusive_ptr< sisl::GenericRpcData >& rpc_data) {
+                // rpc_data is held by the response callback, which keeps the incoming buffer valid till we respond
+                ((*m_state_machine).*handler)(incoming_buf,
+                                              [this, rpc_data](const nuraft_mesg::io_blob_list_t& out_bufs) mutable {
+                                                  m_repl_svc_ctx->send_data_service_response(out_bufs, rpc_data);
+                                              });
+            });
+    };
+
+    if (!bind(SEND_PBAS_RPC_NAME, &ReplicaStateMachine::on_push_data_received)) {
+        LOGERROR("Failed to bind data service request={} for group={}", SEND_PBAS_RPC_NAME, m_group_id);
+        return false;
+    }
+    if (!bind(FETCH_PBAS_RPC_NAME, &ReplicaStateMachine::on_fetch_data_request)) {
+        LOGERROR("Failed to bind data service request={} for group={}", FETCH_PBAS_RPC_NAME, m_group_id);
+        return false;
+    }
+    return true;
+}
+
+nuraft::raft_server* ReplicaSet::raft_server() { return m_repl_svc_ctx ? m_repl_svc_ctx->_server : nullptr; }
+
+void ReplicaSet::send_data_service_request(const std::string& request_name, const nuraft_mesg::io_blob_list_t& cli_buf,
+                                           const nuraft_mesg::data_service_response_handler_t& response_cb) {
+    if (!m_repl_svc_ctx) {
+        LOGERROR("Replica set group={} is not part of any raft group yet, dropping data service request={}", m_group_id,
+                 request_name);
+        return;
+    }
+    m_repl_svc_ctx->data_service_request(request_name, cli_buf, response_cb);
+}
 
 std::shared_ptr< nuraft::state_machine > ReplicaSet::get_state_machine() {
     if (!m_state_machine)
@@ -33,7 +89,8 @@ std::shared_ptr< nuraft::state_machine > ReplicaSet::get_state_machine() {
 }
 
 bool ReplicaSet::is_leader() {
-    // TODO: Need to implement after setting up RAFT replica set
-    return true;
+    // Replica set which is not part of a raft group yet is standalone and acts as its own leader
+    auto* server = raft_server();
+    return server ? server->is_leader() : true;
 }
 } // namespace home_replication
@@ -1,23 +1,35 @@
 #pragma once
+#include <functional>
+#include <limits>
+#include <string>
 #include <sisl/utility/enum.hpp>
+#include <sisl/fds/buffer.hpp>
+#include <nuraft_mesg/messaging_if.hpp>
 #include <home_replication/repl_decls.h>
 
 namespace home_replication {
 
 VENUM(data_rpc_name_t, uint16_t, SEND_PBAS = 0, FETCH_PBAS = 1)
 
+// Names under which the data channel rpcs are bound with nuraft_mesg data service (binding is per group)
+static const std::string SEND_PBAS_RPC_NAME{"home_repl_send_pbas"};
+static const std::string FETCH_PBAS_RPC_NAME{"home_repl_fetch_pbas"};
+
+// Callback through which the receiver of a data channel rpc sends its response back to the issuer
+using data_rpc_respond_cb_t = std::function< void(const nuraft_mesg::io_blob_list_t&) >;
+
 #pragma pack(1)
 struct data_channel_rpc_hdr {
     static constexpr uint16_t MAJOR_VERSION{0};
     static constexpr uint16_t MINOR_VERSION{1};
-    static constexpr uint32_t max_hdr_size{512};
 
     uint16_t major_version{MAJOR_VERSION};
     uint16_t minor_version{MINOR_VERSION};
-    uint32_t total_size{0};     // Total size of RPC including this rpc header
-    uuid_t group_id;            // UUID of the replica set
-    uint32_t issuer_replica_id; // Server ID it is initiated from
-    data_rpc_name_t rpc;        // Name of the RPC
+    uint32_t total_size{0};        // Total size of RPC including this rpc header
+    uuid_t group_id;               // UUID of the replica set
+    uint32_t issuer_replica_id{0}; // Server ID it is initiated from
+    uint32_t target_replica_id{0}; // Server ID expected to serve the rpc (owner of the pbas for FETCH_PBAS)
+    data_rpc_name_t rpc;           // Name of the RPC
 };
 #pragma pack()
 
@@ -29,49 +41,72 @@ public:
         uint32_t data_size;
     };
 
-    uint16_t n_pbas;
-    _pba_info pinfo[0];
+    uint16_t n_pbas{0};
+    // Followed by n_pbas of _pba_info
 
 public:
-    static pbas_serialized* serialize(const pba_list_t& pbas, uint8_t* raw_ptr) {
-        pbas_serialized* pthis = new (raw_ptr) pbas_serialized();
-        pthis->n_pbas = pbas.size();
-        for (uint16_t i{0}; i < pthis->n_pbas; ++i) {
-            pthis->pinfo[i].pba = pbas[i];
-        }
-        return pthis;
+    static constexpr uint32_t size_needed(uint16_t n) { return sizeof(pbas_serialized) + (n * sizeof(_pba_info)); }
+    uint32_t size() const { return size_needed(n_pbas); }
+
+    _pba_info* pinfo() { return r_cast< _pba_info* >(uintptr_cast(this) + sizeof(pbas_serialized)); }
+    const _pba_info* pinfo() const {
+        return r_cast< const _pba_info* >(r_cast< const uint8_t* >(this) + sizeof(pbas_serialized));
     }
 };
 #pragma pack()
 
+//
+// Layout of data channel rpcs on the wire:
+//
+// SEND_PBAS (leader -> followers):    [data_channel_rpc_hdr][pbas_serialized][data of pba-1]...[data of pba-n]
+// FETCH_PBAS request (follower -> leader): [data_channel_rpc_hdr][pbas_serialized]
+// FETCH_PBAS response (leader -> follower): [data of pba-1]...[data of pba-n]
+//
+// pba and data_size in pbas_serialized are always of the issuer, so data of each pba is data_size bytes long and
+// they are laid out in the same order as the pba list. FETCH_PBAS request is broadcasted to the group, only the replica
+// matching target_replica_id (owner of the pbas) responds with the data, others respond empty.
+//
 #pragma pack(1)
-struct send_pbas_rpc {
+struct data_channel_rpc {
 public:
     data_channel_rpc_hdr common_hdr;
-    pbas_serialized pba_area[0];
+    pbas_serialized pba_area;
 
 public:
-    send_pbas_rpc() : common_hdr.rpc{data_rpc_name_t::SEND_PBAS} {}
+    static constexpr uint32_t hdr_size(uint16_t n_pbas) {
+        return sizeof(data_channel_rpc_hdr) + pbas_serialized::size_needed(n_pbas);
+    }
+    uint32_t hdr_size() const { return hdr_size(pba_area.n_pbas); }
+    uint32_t data_size() const { return common_hdr.total_size - hdr_size(); }
 
-    sisl::blob to_blob() { return sisl::blob{uintptr_cast(this), data_channel_rpc_hdr::max_hdr_size}; }
+    static constexpr uint16_t max_pbas() { return std::numeric_limits< uint16_t >::max(); }
 
-    static constexpr uint16_t max_pbas() {
-        return (data_channel_rpc_hdr::max_hdr_size - sizeof(send_pbas_rpc)) / sizeof(pbas_serialized);
-    }
+    sisl::blob hdr_blob() { return sisl::blob{uintptr_cast(this), hdr_size()}; }
 
-    static send_pbas_rpc* create(const pba_list_t& pbas) {
-        if (pbas.size() > max_pbas()) {
-            LOGERROR("Exceeds max number of pbas that can be sent in this rpc");
-            return nullptr;
-        }
+    static data_channel_rpc* create(data_rpc_name_t rpc_name, const uuid_t& group_id, uint32_t issuer_id,
+                                    uint16_t n_pbas, uint32_t data_size) {
+        auto const sz = hdr_size(n_pbas);
+        auto* bytes = new uint8_t[sz];
+        data_channel_rpc* rpc = new (bytes) data_channel_rpc();
+        rpc->common_hdr.total_size = sz + data_size;
+        rpc->common_hdr.group_id = group_id;
+        rpc->common_hdr.issuer_replica_id = issuer_id;
+        rpc->common_hdr.rpc = rpc_name;
+        rpc->pba_area.n_pbas = n_pbas;
+        return rpc;
+    }
 
-        auto* bytes = new uint8_t[data_channel_rpc_hdr::max_hdr_size];
-        send_pbas_rpc* rpc = new (bytes) send_pbas_rpc();
-        pbas_serialized::serialize(pbas, r_cast< uint8_t* >(pba_area));
+    static void free(data_channel_rpc* rpc) { delete[] uintptr_cast(rpc); }
 
+    /// @brief Validates the incoming bytes and returns the rpc laid over it, nullptr if it is malformed
+    static const data_channel_rpc* from_bytes(const uint8_t* bytes, uint32_t size) {
+        if (size < hdr_size(0)) { return nullptr; }
+        auto const* rpc = r_cast< const data_channel_rpc* >(bytes);
+        if (rpc->common_hdr.major_version != data_channel_rpc_hdr::MAJOR_VERSION) { return nullptr; }
+        if ((size < rpc->hdr_size()) || (size < rpc->common_hdr.total_size)) { return nullptr; }
         return rpc;
     }
-}
+};
 #pragma pack()
 
-} // namespace home_replication
\ No newline at end of file
+} // namespace home_replication
@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <new>
+#include <unordered_map>
 #include <sisl/logging/logging.h>
 #include <sisl/fds/utils.hpp>
 #include <sisl/fds/obj_allocator.hpp>
@@ -13,11 +18,32 @@
 SISL_LOGGING_DECL(home_replication)
 
 namespace home_replication {
+// Alignment needed for the data buffers to be written directly to the storage engine
+static constexpr size_t data_buf_alignment{512};
+
+static bool is_data_buf_aligned(const uint8_t* buf, uint32_t size) {
+    return ((r_cast< uintptr_t >(buf) % data_buf_alignment) == 0) && ((size % data_buf_alignment) == 0);
+}
 
 ReplicaStateMachine::ReplicaStateMachine(const std::shared_ptr< StateMachineStore >& state_store, ReplicaSet* rs) :
-        m_state_store{state_store}, m_rs{rs}, m_group_id{rs->m_group_id} {
+        m_state_store{state_store},
+        m_rs{rs},
+        m_group_id{rs->m_group_id},
+        m_metrics{rs->m_group_id} {
     m_success_ptr = nuraft::buffer::alloc(sizeof(int));
     m_success_ptr->put(0);
+
+    m_metrics.attach_gather_cb([this]() {
+        GAUGE_UPDATE(m_metrics, pending_lsn_reqs, m_lsn_req_map.size());
+        GAUGE_UPDATE(m_metrics, pending_pba_map_entries, m_pba_map.size());
+    });
+}
+
+ReplicaStateMachine::~ReplicaStateMachine() {
+    std::unique_lock lg{m_fetch_mtx};
+    for (const auto& batch : m_inflight_fetches) {
+        cancel_fetch_timer(*batch);
+    }
 }
 
 void ReplicaStateMachine::stop_write_wait_timer() {
@@ -33,7 +59,7 @@ void ReplicaStateMachine::propose(const sisl::blob& header, const sisl::blob& ke
     auto pbas = m_state_store->alloc_pbas(uint32_cast(value.size));
 
     // Step 2: Send the data to all replicas
-    // m_rs->send_in_data_channel(pbas, value);
+    send_in_data_channel(pbas, value);
 
     // Step 3: Create the request structure containing all details essential for callback
     repl_req* req = sisl::ObjectAllocator< repl_req >::make_object();
@@ -46,39 +72,18 @@ void ReplicaStateMachine::propose(const sisl::blob& header, const sisl::blob& ke
     // Step 4: Write the data to underlying store
     m_state_store->async_write(value, pbas, [this, req]([[maybe_unused]] std::error_condition err) {
         assert(!err);
-        ++req->num_pbas_written;
-        check_and_commit(req);
+        HISTOGRAM_OBSERVE(m_metrics, data_write_latency_us, get_elapsed_time_us(req->created_time));
+        on_local_data_written(req);
     });
 
-    // Step 5: Allocate and populate the journal entry
-    auto const entry_size = sizeof(repl_journal_entry) +
-        (pbas.size() * (sizeof(pba_t) + sizeof(uint32_t) /* pba size*/)) + header.size + key.size;
-    raft_buf_ptr_t buf = nuraft::buffer::alloc(entry_size);
-
-    auto* entry = r_cast< repl_journal_entry* >(buf->data_begin());
-    entry->code = journal_type_t::DATA;
-    entry->n_pbas = s_cast< uint16_t >(pbas.size());
-    entry->user_header_size = header.size;
-    entry->key_size = key.size;
-
-    // Step 6: Copy the header and key into the journal entry
-    uint8_t* raw_ptr = uintptr_cast(entry) + sizeof(repl_journal_entry);
-    std::memcpy(raw_ptr, header.bytes, header.size);
-    raw_ptr += header.size;
-    std::memcpy(raw_ptr, key.bytes, key.size);
-
-    raw_ptr += key.size;
-    // now raw_ptr is pointing to pba list portion, layout: {pba-1, size-1}, {pba-2, size-2}, ..., {pba-n, size-n}
-    // Step 7: Copy pba and its size into the buffer;
+    // Step 5: Build the journal entry with header, key and the pba list in a single pass
+    journal_entry_builder builder{journal_type_t::DATA, server_id(), header, key, s_cast< uint16_t >(pbas.size())};
     for (const auto& p : pbas) {
-        // fill in the pba and its size;
-        *(r_cast< pba_t* >(raw_ptr)) = p;
-        raw_ptr += sizeof(pba_t);
-        *(r_cast< uint32_t* >(raw_ptr)) = m_state_store->pba_to_size(p);
-        raw_ptr += sizeof(uint32_t);
+        builder.add_pba(p, m_state_store->pba_to_size(p));
     }
+    raft_buf_ptr_t buf = builder.build();
 
-    // Step 8: Append the entry to the raft group
+    // Step 6: Append the entry to the raft group
     auto* vec = sisl::VectorPool< raft_buf_ptr_t >::alloc();
     vec->push_back(buf);
 
@@ -86,10 +91,133 @@ void ReplicaStateMachine::propose(const sisl::blob& header, const sisl::blob& ke
     param.after_precommit_ = bind_this(ReplicaStateMachine::after_precommit_in_leader, 1);
     param.expected_term_ = 0;
     param.context_ = voidptr_cast(req);
-    // m_raft_server->append_entries_ext(*vec, param);
+    if (!append_to_raft(*vec, param)) { reject_proposed_reqs({req}); }
+    sisl::VectorPool< raft_buf_ptr_t >::free(vec);
+}
+
+void ReplicaStateMachine::propose_batch(const std::vector< ReplicaSet::write_obj >& objs) {
+    if (objs.empty()) { return; }
+
+    // Step 1: Alloc PBAs for all the objects in one shot
+    std::vector< uint32_t > sizes;
+    sizes.reserve(objs.size());
+    for (const auto& obj : objs) {
+        sizes.push_back(uint32_cast(obj.value.size));
+    }
+    auto const obj_pbas = m_state_store->alloc_pbas(sizes);
+
+    // Step 2: Lay out the values back to back, each padded up to the size of its pbas, so that the entire batch can be
+    // written and sent as one
+    sisl::sg_list batch_value;
+    pba_list_t batch_pbas;
+    std::vector< uint32_t > pad_sizes(objs.size(), 0);
+    uint32_t max_pad_size{0};
+    for (size_t i{0}; i < objs.size(); ++i) {
+        RS_REL_ASSERT(!obj_pbas[i].empty(), "alloc_pbas returned null, no space left!");
+        uint32_t alloced_size{0};
+        for (const auto& p : obj_pbas[i]) {
+            alloced_size += m_state_store->pba_to_size(p);
+        }
+        pad_sizes[i] = alloced_size - sizes[i];
+        max_pad_size = std::max(max_pad_size, pad_sizes[i]);
+    }
+
+    uint8_t* pad_buf{nullptr};
+    if (max_pad_size) {
+        pad_buf = iomanager.iobuf_alloc(data_buf_alignment, max_pad_size);
+        std::memset(pad_buf, 0, max_pad_size);
+    }
+    for (size_t i{0}; i < objs.size(); ++i) {
+        batch_value.iovs.insert(batch_value.iovs.end(), objs[i].value.iovs.begin(), objs[i].value.iovs.end());
+        if (pad_sizes[i]) { batch_value.iovs.emplace_back(iovec{pad_buf, pad_sizes[i]}); }
+        batch_value.size += sizes[i] + pad_sizes[i];
+        batch_pbas.insert(batch_pbas.end(), obj_pbas[i].begin(), obj_pbas[i].end());
+    }
+    RS_REL_ASSERT_LE(batch_pbas.size(), data_channel_rpc::max_pbas(), "Too many pbas in a batch write");
+
+    // Step 3: Send the data of the entire batch to all replicas
+    send_in_data_channel(batch_pbas, batch_value);
+
+    // Step 4: Create the request structure for each object, which is passed to raft as one batch context
+    auto* ctx = sisl::ObjectAllocator< propose_batch_ctx >::make_object();
+    ctx->reqs.reserve(objs.size());
+    for (size_t i{0}; i < objs.size(); ++i) {
+        repl_req* req = sisl::ObjectAllocator< repl_req >::make_object();
+        req->header = objs[i].header;
+        req->key = objs[i].key;
+        req->value = objs[i].value;
+        req->local_pbas = obj_pbas[i];
+        req->user_ctx = objs[i].user_ctx;
+        ctx->reqs.push_back(req);
+    }
+
+    // Step 5: Write the data of the entire batch with one vectored write
+    m_state_store->async_write(batch_value, batch_pbas,
+                               [this, reqs = ctx->reqs, pad_buf]([[maybe_unused]] std::error_condition err) {
+                                   assert(!err);
+                                   HISTOGRAM_OBSERVE(m_metrics, data_write_latency_us,
+                                                     get_elapsed_time_us(reqs[0]->created_time));
+                                   if (pad_buf) { iomanager.iobuf_free(pad_buf); }
+                                   for (auto* req : reqs) {
+                                       on_local_data_written(req);
+                                   }
+                               });
+
+    // Step 6: Build the journal entry of each object and append all of them to the raft group as one batch
+    auto* vec = sisl::VectorPool< raft_buf_ptr_t >::alloc();
+    for (size_t i{0}; i < objs.size(); ++i) {
+        journal_entry_builder builder{journal_type_t::DATA, server_id(), objs[i].header, objs[i].key,
+                                      s_cast< uint16_t >(obj_pbas[i].size())};
+        for (const auto& p : obj_pbas[i]) {
+            builder.add_pba(p, m_state_store->pba_to_size(p));
+        }
+        vec->push_back(builder.build());
+    }
+
+    nuraft::raft_server::req_ext_params param;
+    param.after_precommit_ = bind_this(ReplicaStateMachine::after_precommit_batch_in_leader, 1);
+    param.expected_term_ = 0;
+    param.context_ = voidptr_cast(ctx);
+    if (!append_to_raft(*vec, param)) {
+        // Batch is accepted or rejected as a whole, so none of its entries got precommitted
+        RS_DBG_ASSERT_EQ(ctx->next_idx, 0, "Rejected batch has entries precommitted");
+        reject_proposed_reqs(ctx->reqs);
+        sisl::ObjectAllocator< propose_batch_ctx >::deallocate(ctx);
+    }
     sisl::VectorPool< raft_buf_ptr_t >::free(vec);
 }
 
+bool ReplicaStateMachine::append_to_raft(std::vector< raft_buf_ptr_t >& bufs,
+                                         nuraft::raft_server::req_ext_params& params) {
+    auto* raft_server = m_rs->raft_server();
+    if (raft_server == nullptr) {
+        RS_LOG(ERROR, "Replica set is not part of a raft group yet, dropping {} journal entries", bufs.size());
+        return false;
+    }
+
+    auto const result = raft_server->append_entries_ext(bufs, params);
+    if (!result->get_accepted()) {
+        RS_LOG(ERROR, "Raft did not accept {} journal entries, result_code={}", bufs.size(),
+               s_cast< int >(result->get_result_code()));
+        return false;
+    }
+    return true;
+}
+
+void ReplicaStateMachine::reject_proposed_reqs(const std::vector< repl_req* >& reqs) {
+    // Reqs have no lsn, listener is told through a rollback of lsn -1. Whichever of this and the data write completion
+    // comes last releases the req and its pbas, see on_local_data_written()
+    COUNTER_INCREMENT(m_metrics, rejected_proposals, reqs.size());
+    for (auto* req : reqs) {
+        m_rs->m_listener->on_rollback(-1, req->header, req->key, req->user_ctx);
+        if (req->rollback_state.fetch_or(repl_req::ROLLED_BACK) & repl_req::DATA_WRITTEN) {
+            m_state_store->free_pbas(req->local_pbas);
+            COUNTER_INCREMENT(m_metrics, rollback_pbas_freed, req->local_pbas.size());
+            sisl::ObjectAllocator< repl_req >::deallocate(req);
+        }
+    }
+}
+
 raft_buf_ptr_t ReplicaStateMachine::pre_commit_ext(const nuraft::state_machine::ext_op_params& params) {
     // Leader precommit is processed in next callback, since lsn would not have been known to repl layer till we get
     // the next callback.
@@ -99,6 +227,7 @@ raft_buf_ptr_t ReplicaStateMachine::pre_commit_ext(const nuraft::state_machine::
 
         RS_LOG(DEBUG, "pre_commit: {}, size: {}", lsn, data->size());
         repl_req* req = lsn_to_req(lsn);
+        req->precommit_time = Clock::now();
 
         m_rs->m_listener->on_pre_commit(req->lsn, req->header, req->key, req->user_ctx);
     }
@@ -108,33 +237,193 @@ raft_buf_ptr_t ReplicaStateMachine::pre_commit_ext(const nuraft::state_machine::
 void ReplicaStateMachine::after_precommit_in_leader(const nuraft::raft_server::req_ext_cb_params& params) {
     repl_req* req = r_cast< repl_req* >(params.context);
     link_lsn_to_req(req, int64_cast(params.log_idx));
+    req->precommit_time = Clock::now();
+    HISTOGRAM_OBSERVE(m_metrics, propose_to_precommit_latency_us, get_elapsed_time_us(req->created_time));
 
     m_rs->m_listener->on_pre_commit(req->lsn, req->header, req->key, req->user_ctx);
 }
 
+void ReplicaStateMachine::after_precommit_batch_in_leader(const nuraft::raft_server::req_ext_cb_params& params) {
+    auto* ctx = r_cast< propose_batch_ctx* >(params.context);
+    repl_req* req = ctx->reqs[ctx->next_idx++];
+    link_lsn_to_req(req, int64_cast(params.log_idx));
+    req->precommit_time = Clock::now();
+    HISTOGRAM_OBSERVE(m_metrics, propose_to_precommit_latency_us, get_elapsed_time_us(req->created_time));
+    m_rs->m_listener->on_pre_commit(req->lsn, req->header, req->key, req->user_ctx);
+
+    if (ctx->next_idx == ctx->reqs.size()) { sisl::ObjectAllocator< propose_batch_ctx >::deallocate(ctx); }
+}
+
 raft_buf_ptr_t ReplicaStateMachine::commit_ext(const nuraft::state_machine::ext_op_params& params) {
     int64_t lsn = s_cast< int64_t >(params.log_idx);
     raft_buf_ptr_t data = params.data;
 
     RS_LOG(DEBUG, "apply_commit: {}, size: {}", lsn, data->size());
 
-    repl_req* req = lsn_to_req(lsn);
-    if (m_rs->is_leader()) {
-        // This is the time to ensure flushing of journal happens in leader
-        if (m_rs->m_data_journal->last_durable_index() < uint64_cast(lsn)) { m_rs->m_data_journal->flush(); }
-        req->is_raft_written.store(true);
-    }
-    check_and_commit(req);
+    // Commit is released once the req is locally durable, which could be before or after this call. Follower's entries
+    // are durable once both their journal and data are (see ReplicaLogStore), while the data of the reqs proposed by
+    // this replica, even if it is no longer the leader, is tracked by the req.
+    commit_after_journal_flush(lsn_to_req(lsn));
     return m_success_ptr;
 }
 
-void ReplicaStateMachine::check_and_commit(repl_req* req) {
-    if ((req->num_pbas_written.load() == req->local_pbas.size()) && req->is_raft_written.load()) {
-        m_rs->m_listener->on_commit(req->lsn, req->header, req->key, req->local_pbas, req->user_ctx);
-        m_state_store->commit_lsn(req->lsn);
-        m_lsn_req_map.erase(req->lsn);
+void ReplicaStateMachine::commit_after_journal_flush(repl_req* req) {
+    {
+        std::unique_lock lg{m_flush_mtx};
+        m_flush_pending_reqs.push_back(req);
+    }
+    resume_commits();
+}
+
+void ReplicaStateMachine::on_journal_durable() { resume_commits(); }
+
+void ReplicaStateMachine::resume_commits() {
+    {
+        std::unique_lock lg{m_flush_mtx};
+        if (m_flush_in_progress || m_flush_pending_reqs.empty()) { return; }
+        m_flush_in_progress = true;
+    }
+    release_commits(false /* on_worker */);
+}
+
+// Only the one which set m_flush_in_progress releases the commits, so they are committed one at a time in lsn order. It
+// goes on until the req at the front waits for its data write or for the journal to be durable, either of which
+// resumes the release once done. Journal is flushed at most once per release, on a worker as it blocks.
+void ReplicaStateMachine::release_commits(bool on_worker) {
+    bool flushed{false};
+    std::vector< int64_t > ready_lsns;
+    while (true) {
+        bool wait_journal{false};
+        ready_lsns.clear();
+        {
+            std::unique_lock lg{m_flush_mtx};
+            auto const durable_lsn = int64_cast(m_rs->m_data_journal->last_durable_index());
+            while (!m_flush_pending_reqs.empty()) {
+                auto* req = m_flush_pending_reqs.front();
+                if (!req->journal_entry && !(req->rollback_state.load() & repl_req::DATA_WRITTEN)) { break; }
+                if (req->lsn > durable_lsn) {
+                    wait_journal = true;
+                    break;
+                }
+                ready_lsns.push_back(req->lsn);
+                m_flush_pending_reqs.pop_front();
+            }
+
+            // Cleared under the lock which resume_commits() takes after the change it resumes for, so none is missed
+            if (ready_lsns.empty() && (!wait_journal || flushed)) {
+                m_flush_in_progress = false;
+                return;
+            }
+        }
+
+        if (ready_lsns.empty()) {
+            if (!on_worker) {
+                iomanager.run_on(iomgr::thread_regex::random_worker,
+                                 [this]([[maybe_unused]] iomgr::io_thread_addr_t addr) { release_commits(true); });
+                return;
+            }
+            auto const flush_start = Clock::now();
+            m_rs->m_data_journal->flush();
+            HISTOGRAM_OBSERVE(m_metrics, journal_flush_latency_us, get_elapsed_time_us(flush_start));
+            flushed = true;
+            continue;
+        }
+
+        HISTOGRAM_OBSERVE(m_metrics, journal_flush_batch_size, ready_lsns.size());
+        for (auto const lsn : ready_lsns) {
+            commit_req(lsn);
+        }
+    }
+}
+
+void ReplicaStateMachine::commit_req(int64_t lsn) {
+    // Req is claimed by removing it from the lsn map, as it could be rolled back by a snapshot install meanwhile, see
+    // rollback_reqs()
+    auto const it = m_lsn_req_map.find(lsn);
+    if (it == m_lsn_req_map.cend()) { return; }
+    repl_req* req = it->second;
+    if (m_lsn_req_map.erase(lsn) == 0) { return; }
+
+    RS_DBG_ASSERT_EQ(req->num_pbas_written.load(), req->local_pbas.size(), "Committing lsn={} before its data", lsn);
+    HISTOGRAM_OBSERVE(m_metrics, precommit_to_commit_latency_us, get_elapsed_time_us(req->precommit_time));
+    m_rs->m_listener->on_commit(req->lsn, req->header, req->key, req->local_pbas, req->user_ctx);
+    m_state_store->commit_lsn(req->lsn);
+    create_pending_snapshot(req->lsn);
+    sisl::ObjectAllocator< repl_req >::deallocate(req);
+}
+
+void ReplicaStateMachine::on_local_data_written(repl_req* req) {
+    req->num_pbas_written.store(req->local_pbas.size());
+
+    // Req proposed by this replica can be rolled back after it lost the leadership, if that happened while the data
+    // write was in flight, release of the req is left to us. Otherwise the req can be committed and released as soon as
+    // it is marked written, so it is not touched after that.
+    if (req->rollback_state.fetch_or(repl_req::DATA_WRITTEN) & repl_req::ROLLED_BACK) {
+        m_state_store->free_pbas(req->local_pbas);
+        COUNTER_INCREMENT(m_metrics, rollback_pbas_freed, req->local_pbas.size());
+        sisl::ObjectAllocator< repl_req >::deallocate(req);
+        return;
+    }
+    resume_commits();
+}
+
+void ReplicaStateMachine::rollback(uint64_t lsn, nuraft::buffer&) {
+    // Resources of the req are released along with the rest of the entries being overwritten, see rollback_reqs()
+    repl_req* req = try_lsn_to_req(int64_cast(lsn));
+    if (req == nullptr) { return; }
+
+    RS_LOG(DEBUG, "rollback: {}", lsn);
+    m_rs->m_listener->on_rollback(req->lsn, req->header, req->key, req->user_ctx);
+}
+
+void ReplicaStateMachine::rollback_reqs(int64_t from_lsn, int64_t to_lsn) {
+    {
+        // Reqs whose commit is pending are rolled back only by a snapshot install, the ones the releaser has picked up
+        // already are claimed by whichever of it and this removes them from the lsn map first
+        std::unique_lock lg{m_flush_mtx};
+        m_flush_pending_reqs.erase(std::remove_if(m_flush_pending_reqs.begin(), m_flush_pending_reqs.end(),
+                                                  [from_lsn, to_lsn](const repl_req* req) {
+                                                      return (req->lsn >= from_lsn) && (req->lsn < to_lsn);
+                                                  }),
+                                   m_flush_pending_reqs.end());
+    }
+
+    pba_list_t free_pbas;
+    uint64_t n_reqs{0};
+    for (auto lsn = from_lsn; lsn < to_lsn; ++lsn) {
+        repl_req* req = try_lsn_to_req(lsn);
+        if ((req == nullptr) || (m_lsn_req_map.erase(lsn) == 0)) { continue; }
+        ++n_reqs;
+
+        if (req->journal_entry == nullptr) {
+            // Proposed by this replica while it was the leader, whichever of this and its data write completion comes
+            // last releases it
+            if (req->rollback_state.fetch_or(repl_req::ROLLED_BACK) & repl_req::DATA_WRITTEN) {
+                free_pbas.insert(free_pbas.end(), req->local_pbas.begin(), req->local_pbas.end());
+                sisl::ObjectAllocator< repl_req >::deallocate(req);
+            }
+            continue;
+        }
+
+        for (const auto& fq_pba : req->remote_fq_pbas) {
+            auto const it = m_pba_map.find(fq_pba_key{fq_pba});
+            if (it == m_pba_map.end()) { continue; }
+            auto const info = it->second;
+            auto const old_state = info->m_state.exchange(pba_state_t::unknown);
+            m_pba_map.erase(fq_pba_key{fq_pba});
+
+            // Pbas being written are freed by the write completion, see write_remote_pba()
+            if (old_state != pba_state_t::written) {
+                free_pbas.insert(free_pbas.end(), info->m_pbas.begin(), info->m_pbas.end());
+            }
+        }
         sisl::ObjectAllocator< repl_req >::deallocate(req);
     }
+
+    m_state_store->free_pbas(free_pbas);
+    COUNTER_INCREMENT(m_metrics, rollback_reqs, n_reqs);
+    COUNTER_INCREMENT(m_metrics, rollback_pbas_freed, free_pbas.size());
+    if (n_reqs) { RS_LOG(INFO, "Rolled back {} reqs in lsn range [{}, {})", n_reqs, from_lsn, to_lsn); }
 }
 
 uint64_t ReplicaStateMachine::last_commit_index() { return uint64_cast(m_state_store->get_last_commit_lsn()); }
@@ -143,35 +432,45 @@ repl_req* ReplicaStateMachine::transform_journal_entry(const raft_buf_ptr_t& raf
     // Leader has nothing to transform or process
     if (m_rs->is_leader()) { return nullptr; }
 
-    fq_pba_list_t remote_pbas;
-    pba_list_t local_pbas;
+    static constexpr size_t pba_info_size{sizeof(pba_t) + sizeof(uint32_t) /* pba size */};
 
-    repl_journal_entry* entry = r_cast< repl_journal_entry* >(raft_buf->data_begin());
+    repl_journal_entry* entry = repl_journal_entry::from_buf(*raft_buf);
+    RS_REL_ASSERT_EQ(entry->major_version, JOURNAL_ENTRY_MAJOR, "Journal entry of unsupported major version");
     repl_req* req = sisl::ObjectAllocator< repl_req >::make_object();
-    req->header =
-        sisl::blob{uintptr_cast(raft_buf->data_begin()) + sizeof(repl_journal_entry), entry->user_header_size};
-    req->key = sisl::blob{req->header.bytes + req->header.size, req->key.size};
+    req->header = sisl::blob{uintptr_cast(entry) + sizeof(repl_journal_entry), entry->user_header_size};
+    req->key = sisl::blob{req->header.bytes + req->header.size, entry->key_size};
     uint8_t* raw_pba_list = r_cast< uint8_t* >(req->key.bytes + req->key.size);
 
-    // Transform log_entry and also populate the pbas in a list
+    // Map the remote pbas and populate the local pbas of all of them in a single list
+    req->remote_fq_pbas.reserve(entry->n_pbas);
+    req->local_pbas.reserve(entry->n_pbas);
+    bool one_to_one{true};
     for (uint16_t i{0}; i < entry->n_pbas; ++i) {
-        raw_pba_list += (i * (sizeof(pba_t) + sizeof(uint32_t) /* pba size*/));
-        auto const remote_pba = fully_qualified_pba{entry->replica_id, *r_cast< pba_t* >(raw_pba_list),
-                                                    *r_cast< uint32_t* >(raw_pba_list + sizeof(pba_t)) /* pba size */};
-        remote_pbas.push_back(remote_pba);
-
-        auto const [local_pba_list, state] = try_map_pba(remote_pba);
-        // TODO: remove this assert after buf re-alloc is resolved;
-        assert(local_pba_list.size() == 1);
-        *r_cast< pba_t* >(raw_pba_list) = local_pba_list[0];
-        *r_cast< uint32_t* >(raw_pba_list + sizeof(pba_t)) = m_state_store->pba_to_size(local_pba_list[0]);
-        local_pbas.push_back(local_pba_list[0]);
-    }
-    // TODO: Should we leave this on senders id in journal or better to write local id?
-    entry->replica_id = m_server_id;
-
-    req->remote_fq_pbas = remote_pbas;
-    req->local_pbas = local_pbas;
+        uint8_t const* raw_pba = raw_pba_list + (i * pba_info_size);
+        auto const remote_pba = fully_qualified_pba{entry->replica_id, *r_cast< pba_t const* >(raw_pba),
+                                                    *r_cast< uint32_t const* >(raw_pba + sizeof(pba_t))};
+        req->remote_fq_pbas.push_back(remote_pba);
+
+        auto const [local_pba_list, state] = claim_map_pba(remote_pba);
+        one_to_one = one_to_one && (local_pba_list.size() == 1);
+        req->local_pbas.insert(req->local_pbas.end(), local_pba_list.begin(), local_pba_list.end());
+    }
+
+    // Local pbas are written in place of the remote ones only if each remote pba maps to exactly one local pba.
+    // Otherwise the raft buffer would have to grow, so the entry keeps the pbas and replica id of the leader, flagged
+    // as such on disk, and its local pbas are known only through the req, which is looked up by lsn until it is
+    // committed or rolled back.
+    if (one_to_one) {
+        for (uint16_t i{0}; i < entry->n_pbas; ++i) {
+            uint8_t* raw_pba = raw_pba_list + (i * pba_info_size);
+            *r_cast< pba_t* >(raw_pba) = req->local_pbas[i];
+            *r_cast< uint32_t* >(raw_pba + sizeof(pba_t)) = m_state_store->pba_to_size(req->local_pbas[i]);
+        }
+        entry->replica_id = server_id();
+    } else {
+        entry->flags |= repl_journal_entry::UNTRANSFORMED;
+        COUNTER_INCREMENT(m_metrics, multi_pba_journal_entries, 1);
+    }
     req->journal_entry = raft_buf;
 
     return req;
@@ -193,9 +492,32 @@ repl_req* ReplicaStateMachine::lsn_to_req(int64_t lsn) {
     return req;
 }
 
+repl_req* ReplicaStateMachine::try_lsn_to_req(int64_t lsn) {
+    auto const it = m_lsn_req_map.find(lsn);
+    return (it == m_lsn_req_map.cend()) ? nullptr : it->second;
+}
+
 std::pair< pba_list_t, pba_state_t > ReplicaStateMachine::try_map_pba(const fully_qualified_pba& fq_pba) {
-    const auto key_string = fq_pba.to_key_string();
-    const auto it = m_pba_map.find(key_string);
+    auto const info = map_pba(fq_pba);
+    return std::make_pair(info->m_pbas, info->m_state.load());
+}
+
+std::pair< pba_list_t, pba_state_t > ReplicaStateMachine::claim_map_pba(const fully_qualified_pba& fq_pba) {
+    while (true) {
+        auto const info = map_pba(fq_pba);
+        auto claim = local_pba_info::claim_t::unclaimed;
+        if (info->m_claim.compare_exchange_strong(claim, local_pba_info::claim_t::claimed) ||
+            (claim == local_pba_info::claim_t::claimed)) {
+            return std::make_pair(info->m_pbas, info->m_state.load());
+        }
+        // Being reclaimed, it is mapped afresh once out of the map
+        m_pba_map.erase_if_equal(fq_pba_key{fq_pba}, info);
+    }
+}
+
+local_pba_info_ptr ReplicaStateMachine::map_pba(const fully_qualified_pba& fq_pba) {
+    const fq_pba_key key{fq_pba};
+    const auto it = m_pba_map.find(key);
     local_pba_info_ptr local_pbas_ptr{nullptr};
     if (it != m_pba_map.end()) {
         local_pbas_ptr = it->second;
@@ -203,13 +525,46 @@ std::pair< pba_list_t, pba_state_t > ReplicaStateMachine::try_map_pba(const full
         const auto local_pbas = m_state_store->alloc_pbas(fq_pba.size);
         RS_DBG_ASSERT(local_pbas.size() > 0, "alloca_pbas returned null, no space left!");
 
-        local_pbas_ptr = std::make_shared< local_pba_info >(local_pbas, pba_state_t::allocated, nullptr /*waiter*/);
+        local_pbas_ptr = local_pba_info_ptr{sisl::ObjectAllocator< local_pba_info >::make_object(
+            local_pbas, pba_state_t::allocated, nullptr /*waiter*/)};
+
+        // insert to concurrent hash map, if data channel and fetch path raced to map the same pba, only one of them
+        // wins and the other gives up its local pbas.
+        auto const [ins_it, happened] = m_pba_map.insert(key, local_pbas_ptr);
+        if (!happened) {
+            m_state_store->free_pbas(local_pbas);
+            local_pbas_ptr = ins_it->second;
+        }
+    }
+    return local_pbas_ptr;
+}
 
-        // insert to concurrent hash map
-        m_pba_map.insert(key_string, local_pbas_ptr);
+void ReplicaStateMachine::reclaim_unclaimed_pbas() {
+    auto const timeout_us = uint64_cast(HR_DYNAMIC_CONFIG(unclaimed_pba_timeout_ms)) * 1000;
+    std::vector< std::pair< fq_pba_key, local_pba_info_ptr > > reclaimed;
+    for (auto it = m_pba_map.cbegin(); it != m_pba_map.cend(); ++it) {
+        auto const& info = it->second;
+        if (get_elapsed_time_us(info->m_created_time) < timeout_us) { continue; }
+        auto claim = local_pba_info::claim_t::unclaimed;
+        if (info->m_claim.compare_exchange_strong(claim, local_pba_info::claim_t::reclaimed)) {
+            reclaimed.emplace_back(it->first, info);
+        }
     }
+    if (reclaimed.empty()) { return; }
 
-    return std::make_pair(local_pbas_ptr->m_pbas, local_pbas_ptr->m_state);
+    // Removed the same way as a rolled back entry, pbas being written are freed by the write completion
+    pba_list_t free_pbas;
+    for (const auto& [key, info] : reclaimed) {
+        auto const old_state = info->m_state.exchange(pba_state_t::unknown);
+        m_pba_map.erase_if_equal(key, info);
+        if (old_state != pba_state_t::written) {
+            free_pbas.insert(free_pbas.end(), info->m_pbas.begin(), info->m_pbas.end());
+        }
+    }
+    m_state_store->free_pbas(free_pbas);
+    COUNTER_INCREMENT(m_metrics, unclaimed_pbas_freed, free_pbas.size());
+    RS_LOG(INFO, "Reclaimed {} remote pbas no journal entry claimed, freed {} local pbas", reclaimed.size(),
+           free_pbas.size());
 }
 
 //
@@ -217,17 +572,17 @@ std::pair< pba_list_t, pba_state_t > ReplicaStateMachine::try_map_pba(const full
 // if return true /* need to wait */ , cb will be triggered after all local pbas completed writting;
 //
 bool ReplicaStateMachine::async_fetch_write_pbas(const std::vector< fully_qualified_pba >& fq_pba_list,
-                                                 batch_completion_cb_t cb) {
+                                                 pba_waiter_cb_t cb) {
     std::vector< fully_qualified_pba > wait_to_fill_fq_pbas;
-    std::shared_ptr< pba_waiter > waiter = nullptr;
+    pba_waiter_ptr waiter{nullptr};
 
     for (const auto& fq_pba : fq_pba_list) {
-        const auto key_string = fq_pba.to_key_string();
-        auto it = m_pba_map.find(key_string);
+        const fq_pba_key key{fq_pba};
+        auto it = m_pba_map.find(key);
 
         if (it == m_pba_map.end()) {
             auto const [local_pba_list, state] = try_map_pba(fq_pba);
-            it = m_pba_map.find(key_string);
+            it = m_pba_map.find(key);
 
             // add this fq_pba to wait list;
             wait_to_fill_fq_pbas.emplace_back(fq_pba);
@@ -238,10 +593,10 @@ bool ReplicaStateMachine::async_fetch_write_pbas(const std::vector< fully_qualif
         // now "it" points to either newly created map entry or already existed entry;
         if (it->second->m_state != pba_state_t::completed) {
             // only create waiter when there is at least one fq_pba that needs to be waited on;
-            if (waiter == nullptr) { waiter = std::make_shared< pba_waiter >(std::move(cb)); }
+            if (!waiter) { waiter = pba_waiter_ptr{sisl::ObjectAllocator< pba_waiter >::make_object(std::move(cb))}; }
 
             // same waiter can wait on multiple fq_pbas;
-            RS_DBG_ASSERT_EQ(it->second->m_waiter, nullptr, "not expecting to apply waiter on already waited entry.");
+            RS_DBG_ASSERT(!it->second->m_waiter, "not expecting to apply waiter on already waited entry.");
             it->second->m_waiter = waiter;
         }
     }
@@ -261,23 +616,25 @@ bool ReplicaStateMachine::async_fetch_write_pbas(const std::vector< fully_qualif
         // remote;
         m_wait_pba_write_timer_hdl = iomanager.schedule_thread_timer( // timer wakes up in current thread;
             HR_DYNAMIC_CONFIG(wait_pba_write_timer_sec) * 1000 * 1000 * 1000, false /* recurring */,
-            nullptr /* cookie */, [this, &wait_to_fill_fq_pbas]([[maybe_unused]] void* cookie) {
+            nullptr /* cookie */,
+            [this, fq_pbas = std::move(wait_to_fill_fq_pbas)]([[maybe_unused]] void* cookie) mutable {
                 // check input fq_pbas to see if they completed write, if there is
                 // still any fq_pba not completed yet, trigger a remote fetch
-                check_and_fetch_remote_pbas(std::move(wait_to_fill_fq_pbas));
+                COUNTER_INCREMENT(m_metrics, wait_timer_fetches, 1);
+                check_and_fetch_remote_pbas(std::move(fq_pbas));
             });
     }
 
-    // if size is not zero, it means caller needs to wait;
-    return wait_size != 0;
+    // if any pba is yet to complete, waiter is attached to it and cb is called once all of them complete;
+    return waiter != nullptr;
 }
 
 void ReplicaStateMachine::check_and_fetch_remote_pbas(std::vector< fully_qualified_pba > fq_pba_list) {
     auto remote_fetch_pbas = std::make_unique< std::vector< fully_qualified_pba > >();
     for (auto fq_it = fq_pba_list.begin(); fq_it != fq_pba_list.end(); ++fq_it) {
-        auto it = m_pba_map.find(fq_it->to_key_string());
-        if (it->second->m_state != pba_state_t::completed) {
-            // found some pba not completed yet, save to the remote list;
+        auto it = m_pba_map.find(fq_pba_key{*fq_it});
+        // pbas already being written by data channel will complete on their own, fetch only the untouched ones;
+        if ((it != m_pba_map.end()) && (it->second->m_state == pba_state_t::allocated)) {
             remote_fetch_pbas->emplace_back(*fq_it);
         }
     }
@@ -294,11 +651,18 @@ void ReplicaStateMachine::check_and_fetch_remote_pbas(std::vector< fully_qualifi
 pba_state_t ReplicaStateMachine::update_map_pba(const fully_qualified_pba& fq_pba, const pba_state_t& state) {
     RS_DBG_ASSERT(state != pba_state_t::unknown && state != pba_state_t::allocated,
                   "invalid state, not expecting update to state: {}", state);
-    auto it = m_pba_map.find(fq_pba.to_key_string());
-    const auto old_state = it->second->m_state;
-    it->second->m_state = state;
+    auto it = m_pba_map.find(fq_pba_key{fq_pba});
+    if (it == m_pba_map.end()) { return pba_state_t::unknown; } // Rolled back
+    if (state == pba_state_t::written) {
+        // Only one writer should move it out of allocated state, others get the current state back to skip the write
+        auto old_state = pba_state_t::allocated;
+        it->second->m_state.compare_exchange_strong(old_state, state);
+        return old_state;
+    }
+    const auto old_state = it->second->m_state.exchange(state);
+    if (old_state == pba_state_t::unknown) { return old_state; } // Rolled back while being written
 
-    if ((state == pba_state_t::completed) && (it->second->m_waiter != nullptr)) {
+    if ((state == pba_state_t::completed) && it->second->m_waiter) {
         // waiter on this fq_pba can be released.
         // if this is the last fq_pba that this waiter is waiting on, cb will be triggered automatically;
         RS_DBG_ASSERT_EQ(old_state, pba_state_t::written, "invalid state, not expecting state to be: {}", state);
@@ -309,18 +673,808 @@ pba_state_t ReplicaStateMachine::update_map_pba(const fully_qualified_pba& fq_pb
 }
 
 std::size_t ReplicaStateMachine::remove_map_pba(const fully_qualified_pba& fq_pba) {
-    return m_pba_map.erase(fq_pba.to_key_string());
+    return m_pba_map.erase(fq_pba_key{fq_pba});
+}
+
+void ReplicaStateMachine::send_in_data_channel(const pba_list_t& pbas, const sisl::sg_list& value) {
+    auto* rpc = data_channel_rpc::create(data_rpc_name_t::SEND_PBAS, m_rs->m_group_uuid, server_id(),
+                                         s_cast< uint16_t >(pbas.size()), uint32_cast(value.size));
+    auto* pinfo = rpc->pba_area.pinfo();
+    uint64_t remain = value.size;
+    for (size_t i{0}; i < pbas.size(); ++i) {
+        pinfo[i].pba = pbas[i];
+        pinfo[i].data_size = uint32_cast(std::min(uint64_cast(m_state_store->pba_to_size(pbas[i])), remain));
+        remain -= pinfo[i].data_size;
+    }
+
+    nuraft_mesg::io_blob_list_t cli_buf;
+    auto const hdr = rpc->hdr_blob();
+    cli_buf.emplace_back(hdr.bytes, hdr.size, false /* is_aligned */);
+    for (const auto& iov : value.iovs) {
+        cli_buf.emplace_back(r_cast< uint8_t* >(iov.iov_base), uint32_cast(iov.iov_len), false /* is_aligned */);
+    }
+
+    // Data channel is best effort, any follower which misses it will fetch the data from leader once the journal entry
+    // arrives. Request is serialized before the call returns, so the header can be freed right away.
+    m_rs->send_data_service_request(SEND_PBAS_RPC_NAME, cli_buf, [](const sisl::io_blob&) {});
+    data_channel_rpc::free(rpc);
+}
+
+void ReplicaStateMachine::on_push_data_received(const sisl::io_blob& incoming_buf, data_rpc_respond_cb_t respond) {
+    auto const* rpc = data_channel_rpc::from_bytes(incoming_buf.bytes, incoming_buf.size);
+    if ((rpc == nullptr) || (rpc->common_hdr.rpc != data_rpc_name_t::SEND_PBAS)) {
+        RS_LOG(ERROR, "Received malformed data channel rpc of size={}, ignoring it", incoming_buf.size);
+        respond(nuraft_mesg::io_blob_list_t{});
+        return;
+    }
+
+    // Response is sent only after all pbas in this rpc are written. One additional count is held until all the
+    // writes are issued, so that early completions don't respond prematurely.
+    struct push_data_ctx {
+        std::atomic< uint32_t > pending;
+        data_rpc_respond_cb_t respond;
+    };
+    auto const n_pbas = rpc->pba_area.n_pbas;
+    auto ctx = std::make_shared< push_data_ctx >();
+    ctx->pending.store(n_pbas + 1);
+    ctx->respond = std::move(respond);
+    auto const done = [ctx](uint32_t count) {
+        if (ctx->pending.fetch_sub(count) == count) { ctx->respond(nuraft_mesg::io_blob_list_t{}); }
+    };
+
+    const uint8_t* data = incoming_buf.bytes + rpc->hdr_size();
+    uint32_t remain = incoming_buf.size - rpc->hdr_size();
+    auto const* pinfo = rpc->pba_area.pinfo();
+    for (uint16_t i{0}; i < n_pbas; ++i) {
+        if (pinfo[i].data_size > remain) {
+            RS_LOG(ERROR, "Data channel rpc from replica={} is truncated at pba={}, skipping remaining {} pbas",
+                   rpc->common_hdr.issuer_replica_id, pinfo[i].pba, n_pbas - i);
+            done(n_pbas - i);
+            break;
+        }
+        write_remote_pba(fully_qualified_pba{rpc->common_hdr.issuer_replica_id, pinfo[i].pba, pinfo[i].data_size}, data,
+                         false /* copy_data */, [done]() { done(1); });
+        data += pinfo[i].data_size;
+        remain -= pinfo[i].data_size;
+    }
+    done(1);
+}
+
+void ReplicaStateMachine::write_remote_pba(const fully_qualified_pba& fq_pba, const uint8_t* data, bool copy_data,
+                                           const batch_completion_cb_t& cb) {
+    auto const [local_pbas, state] = try_map_pba(fq_pba);
+    if ((state != pba_state_t::allocated) || (update_map_pba(fq_pba, pba_state_t::written) != pba_state_t::allocated)) {
+        // Either data channel or remote fetch is already writing this pba, its idempotent to skip it here.
+        cb();
+        return;
+    }
+
+    // Storage engine needs aligned buffers. Also caller which can't keep the data around till write completes asks to
+    // copy, in both cases we bounce the data through an io buffer.
+    uint8_t* buf = const_cast< uint8_t* >(data);
+    bool const bounce = copy_data || !is_data_buf_aligned(data, fq_pba.size);
+    if (bounce) {
+        buf = iomanager.iobuf_alloc(data_buf_alignment, fq_pba.size);
+        std::memcpy(buf, data, fq_pba.size);
+    }
+
+    sisl::sg_list sgs;
+    sgs.size = fq_pba.size;
+    sgs.iovs.emplace_back(iovec{buf, fq_pba.size});
+    auto const write_start = Clock::now();
+    m_state_store->async_write(sgs, local_pbas, [this, fq_pba, local_pbas, buf, bounce, cb,
+                                                 write_start](std::error_condition err) {
+        RS_REL_ASSERT(!err, "Write of remote pba={} failed, err={}", fq_pba.to_key_string(), err.message());
+        HISTOGRAM_OBSERVE(m_metrics, data_write_latency_us, get_elapsed_time_us(write_start));
+        if (bounce) { iomanager.iobuf_free(buf); }
+        if (update_map_pba(fq_pba, pba_state_t::completed) == pba_state_t::unknown) {
+            // Entry is rolled back while being written, the pbas are not referenced by anyone anymore
+            m_state_store->free_pbas(local_pbas);
+            COUNTER_INCREMENT(m_metrics, rollback_pbas_freed, local_pbas.size());
+        }
+        cb();
+    });
+}
+
+void ReplicaStateMachine::on_fetch_data_request(const sisl::io_blob& incoming_buf, data_rpc_respond_cb_t respond) {
+    auto const* rpc = data_channel_rpc::from_bytes(incoming_buf.bytes, incoming_buf.size);
+    if ((rpc == nullptr) || (rpc->common_hdr.rpc != data_rpc_name_t::FETCH_PBAS)) {
+        RS_LOG(ERROR, "Received malformed fetch rpc of size={}, ignoring it", incoming_buf.size);
+        respond(nuraft_mesg::io_blob_list_t{});
+        return;
+    }
+
+    // Request is broadcasted to the group, only the replica which owns the pbas serves it
+    if (rpc->common_hdr.target_replica_id != server_id()) {
+        respond(nuraft_mesg::io_blob_list_t{});
+        return;
+    }
+
+    // All pbas are read in parallel into their own buffer and the response is sent as a list of those buffers once the
+    // last read completes. One additional count is held until all the reads are issued.
+    struct fetch_read_ctx {
+        std::atomic< uint32_t > pending;
+        std::atomic< bool > failed{false};
+        std::vector< sisl::sg_list > sgs;
+        nuraft_mesg::io_blob_list_t bufs;
+        data_rpc_respond_cb_t respond;
+
+        ~fetch_read_ctx() {
+            for (auto& b : bufs) {
+                iomanager.iobuf_free(b.bytes);
+            }
+        }
+    };
+    auto const n_pbas = rpc->pba_area.n_pbas;
+    auto ctx = std::make_shared< fetch_read_ctx >();
+    ctx->pending.store(n_pbas + 1);
+    ctx->sgs.reserve(n_pbas);
+    ctx->bufs.reserve(n_pbas);
+    ctx->respond = std::move(respond);
+    auto const done = [ctx]() {
+        if (ctx->pending.fetch_sub(1) == 1) {
+            ctx->respond(ctx->failed.load() ? nuraft_mesg::io_blob_list_t{} : ctx->bufs);
+        }
+    };
+
+    auto const* pinfo = rpc->pba_area.pinfo();
+    for (uint16_t i{0}; i < n_pbas; ++i) {
+        auto const pba = pinfo[i].pba;
+        auto const size = pinfo[i].data_size;
+        auto* buf = iomanager.iobuf_alloc(data_buf_alignment, size);
+        ctx->bufs.emplace_back(buf, size, true /* is_aligned */);
+
+        auto& sgs = ctx->sgs.emplace_back();
+        sgs.size = size;
+        sgs.iovs.emplace_back(iovec{buf, size});
+        m_state_store->async_read(pba, sgs, size, [this, ctx, pba, done](std::error_condition err) {
+            if (err) {
+                RS_LOG(ERROR, "Read of pba={} requested by a follower failed, err={}", pba, err.message());
+                ctx->failed.store(true);
+            }
+            done();
+        });
+    }
+    done();
+}
+
+void ReplicaStateMachine::fetch_pba_data_from_leader(
+    std::unique_ptr< std::vector< fully_qualified_pba > > fq_pba_list) {
+    auto const max_pbas = std::clamp(HR_DYNAMIC_CONFIG(max_pbas_per_fetch_rpc), 1u,
+                                     uint32_cast(data_channel_rpc::max_pbas()));
+    auto const max_size = uint64_cast(HR_DYNAMIC_CONFIG(max_fetch_rpc_size_kb)) * 1024;
+
+    // Coalesce the pbas per owning replica, each batch bounded by both count and size so that a single rpc doesn't
+    // hog the owner or bloat the response.
+    std::unordered_map< uint32_t, fetch_batch_ptr > open_batches;
+    std::vector< fetch_batch_ptr > ready_batches;
+    for (const auto& fq_pba : *fq_pba_list) {
+        auto& batch = open_batches[fq_pba.server_id];
+        if (batch && ((batch->fq_pbas.size() >= max_pbas) || ((batch->data_size + fq_pba.size) > max_size))) {
+            ready_batches.push_back(std::move(batch));
+        }
+        if (!batch) {
+            batch = std::make_shared< fetch_batch >();
+            batch->owner_id = fq_pba.server_id;
+        }
+        batch->fq_pbas.push_back(fq_pba);
+        batch->data_size += fq_pba.size;
+    }
+
+    {
+        std::unique_lock lg{m_fetch_mtx};
+        for (auto& batch : ready_batches) {
+            m_fetch_q.push_back(std::move(batch));
+        }
+        for (auto& [owner_id, batch] : open_batches) {
+            m_fetch_q.push_back(std::move(batch));
+        }
+    }
+    issue_pending_fetches();
+}
+
+void ReplicaStateMachine::issue_pending_fetches() {
+    auto const max_in_flight = std::max(HR_DYNAMIC_CONFIG(max_fetch_rpcs_in_flight), 1u);
+    while (true) {
+        fetch_batch_ptr batch;
+        {
+            std::unique_lock lg{m_fetch_mtx};
+            if (m_fetch_q.empty() || (m_inflight_fetches.size() >= max_in_flight)) { return; }
+            batch = std::move(m_fetch_q.front());
+            m_fetch_q.pop_front();
+            m_inflight_fetches.insert(batch);
+        }
+        send_fetch_rpc(batch);
+    }
+}
+
+void ReplicaStateMachine::send_fetch_rpc(const fetch_batch_ptr& batch) {
+    auto* rpc = data_channel_rpc::create(data_rpc_name_t::FETCH_PBAS, m_rs->m_group_uuid, server_id(),
+                                         s_cast< uint16_t >(batch->fq_pbas.size()), 0 /* data_size */);
+    rpc->common_hdr.target_replica_id = batch->owner_id;
+    auto* pinfo = rpc->pba_area.pinfo();
+    for (size_t i{0}; i < batch->fq_pbas.size(); ++i) {
+        pinfo[i].pba = batch->fq_pbas[i].pba;
+        pinfo[i].data_size = batch->fq_pbas[i].size;
+    }
+
+    // Every replica other than the owner responds empty, so the number of responses to expect is known upfront
+    auto* raft_server = m_rs->raft_server();
+    auto const n_peers = raft_server ? uint32_cast(raft_server->get_config()->get_servers().size()) - 1 : 0;
+    uint32_t attempt;
+    {
+        std::unique_lock lg{m_fetch_mtx};
+        attempt = batch->attempt;
+        batch->responses = 0;
+        batch->expected_responses = n_peers;
+        batch->timer_hdl = iomanager.schedule_global_timer(
+            uint64_cast(HR_DYNAMIC_CONFIG(fetch_rpc_timeout_ms)) * 1000 * 1000, false /* recurring */,
+            nullptr /* cookie */, iomgr::thread_regex::all_worker,
+            [this, batch, attempt]([[maybe_unused]] void* cookie) { on_fetch_timeout(batch, attempt); });
+    }
+
+    if (attempt == 0) {
+        COUNTER_INCREMENT(m_metrics, remote_fetch_rpcs, 1);
+        COUNTER_INCREMENT(m_metrics, remote_fetch_pbas, batch->fq_pbas.size());
+    } else {
+        COUNTER_INCREMENT(m_metrics, remote_fetch_retries, 1);
+    }
+    RS_LOG(DEBUG, "Fetching {} pbas of size={} from replica={}, attempt={}", batch->fq_pbas.size(), batch->data_size,
+           batch->owner_id, attempt);
+    nuraft_mesg::io_blob_list_t cli_buf;
+    auto const hdr = rpc->hdr_blob();
+    cli_buf.emplace_back(hdr.bytes, hdr.size, false /* is_aligned */);
+    m_rs->send_data_service_request(FETCH_PBAS_RPC_NAME, cli_buf,
+                                    [this, batch, attempt](const sisl::io_blob& response) {
+                                        on_fetch_data_response(batch, attempt, response);
+                                    });
+    data_channel_rpc::free(rpc);
+}
+
+void ReplicaStateMachine::on_fetch_data_response(const fetch_batch_ptr& batch, uint32_t attempt,
+                                                 const sisl::io_blob& response) {
+    // Replicas which don't own the pbas respond empty
+    bool const valid = (response.size != 0) && (response.size == batch->data_size);
+    if ((response.size != 0) && !valid) {
+        RS_LOG(ERROR, "Fetch response from replica={} has size={}, expected={}, ignoring it", batch->owner_id,
+               response.size, batch->data_size);
+    }
+
+    bool retry{false};
+    {
+        std::unique_lock lg{m_fetch_mtx};
+        if (batch->done) { return; }
+        if (!valid) {
+            // Once every replica asked responded without the data, the attempt is over without waiting for its timeout
+            if ((batch->expected_responses == 0) || (attempt != batch->attempt) ||
+                (++batch->responses < batch->expected_responses)) {
+                return;
+            }
+            cancel_fetch_timer(*batch);
+            retry = next_fetch_attempt(*batch);
+        } else {
+            cancel_fetch_timer(*batch);
+            batch->done = true;
+        }
+    }
+
+    if (!valid) {
+        RS_LOG(WARN, "None of the replicas served {} pbas of replica={} on attempt={}", batch->fq_pbas.size(),
+               batch->owner_id, attempt);
+        if (retry) {
+            send_fetch_rpc(batch);
+        } else {
+            fail_fetch(batch);
+        }
+        return;
+    }
+
+    // Response buffer is valid only within this callback, so data is copied while issuing the writes. Waiters on these
+    // pbas are released as each write completes.
+    const uint8_t* data = response.bytes;
+    for (const auto& fq_pba : batch->fq_pbas) {
+        // Pbas rolled back since the fetch was issued are not to be mapped again
+        if (m_pba_map.find(fq_pba_key{fq_pba}) != m_pba_map.end()) {
+            write_remote_pba(fq_pba, data, true /* copy_data */, []() {});
+        }
+        data += fq_pba.size;
+    }
+    release_fetch_slot(batch);
+}
+
+void ReplicaStateMachine::on_fetch_timeout(const fetch_batch_ptr& batch, uint32_t attempt) {
+    bool retry;
+    {
+        std::unique_lock lg{m_fetch_mtx};
+        if (batch->done || (attempt != batch->attempt)) { return; } // Attempt is over already
+        batch->timer_hdl = iomgr::null_timer_handle;
+        retry = next_fetch_attempt(*batch);
+    }
+
+    RS_LOG(WARN, "Fetch of {} pbas from replica={} timed out on attempt={}", batch->fq_pbas.size(), batch->owner_id,
+           attempt);
+    if (retry) {
+        send_fetch_rpc(batch);
+    } else {
+        fail_fetch(batch);
+    }
+}
+
+// Called with m_fetch_mtx held once the attempt in flight is over. Returns true if the rpc is to be sent again, else
+// the batch is given up on.
+bool ReplicaStateMachine::next_fetch_attempt(fetch_batch& batch) {
+    if (batch.attempt < HR_DYNAMIC_CONFIG(max_fetch_rpc_retries)) {
+        ++batch.attempt;
+        return true;
+    }
+    batch.done = true;
+    return false;
+}
+
+// Called with m_fetch_mtx held
+void ReplicaStateMachine::cancel_fetch_timer(fetch_batch& batch) {
+    if (batch.timer_hdl != iomgr::null_timer_handle) {
+        iomanager.cancel_timer(batch.timer_hdl);
+        batch.timer_hdl = iomgr::null_timer_handle;
+    }
+}
+
+void ReplicaStateMachine::fail_fetch(const fetch_batch_ptr& batch) {
+    RS_LOG(ERROR, "Giving up on fetching {} pbas from replica={} after {} attempts, failing their waiters",
+           batch->fq_pbas.size(), batch->owner_id, batch->attempt + 1);
+    COUNTER_INCREMENT(m_metrics, remote_fetch_failures, 1);
+
+    for (const auto& fq_pba : batch->fq_pbas) {
+        auto const it = m_pba_map.find(fq_pba_key{fq_pba});
+        if (it == m_pba_map.end()) { continue; } // Rolled back
+
+        // Pba is claimed the same way a write claims it, so that its waiter is not released concurrently. Ones already
+        // being written complete on their own.
+        if (update_map_pba(fq_pba, pba_state_t::written) != pba_state_t::allocated) { continue; }
+        local_pba_info_ptr info = it->second;
+        if (info->m_waiter) {
+            info->m_waiter->m_failed.store(true);
+            info->m_waiter.reset();
+        }
+
+        // Pba goes back to allocated, to be filled by a later data channel write or fetch
+        auto state = pba_state_t::written;
+        if (!info->m_state.compare_exchange_strong(state, pba_state_t::allocated)) {
+            // Rolled back while it was claimed, the pbas are not referenced by anyone anymore
+            m_state_store->free_pbas(info->m_pbas);
+            COUNTER_INCREMENT(m_metrics, rollback_pbas_freed, info->m_pbas.size());
+        }
+    }
+    release_fetch_slot(batch);
 }
 
-void ReplicaStateMachine::fetch_pba_data_from_leader(std::unique_ptr< std::vector< fully_qualified_pba > >) {
-    // TODO: to be implemented;
+void ReplicaStateMachine::release_fetch_slot(const fetch_batch_ptr& batch) {
+    {
+        std::unique_lock lg{m_fetch_mtx};
+        m_inflight_fetches.erase(batch);
+    }
+    issue_pending_fetches();
+}
+
+///////////////////////////// Checkpoint Section ////////////////////////////
+void ReplicaStateMachine::checkpoint() {
+    reclaim_unclaimed_pbas();
+
+    auto const ckpt_lsn = m_state_store->get_checkpoint_lsn();
+    auto upto_lsn = m_state_store->get_last_commit_lsn();
+    {
+        std::unique_lock lg{m_snp_mtx};
+        if (m_last_snapshot && m_last_snapshot->has_data) {
+            upto_lsn = std::min(upto_lsn, int64_cast(m_last_snapshot->raft_snp->get_last_log_idx()));
+        }
+    }
+    // Raft keeps entries below the snapshot in the journal (reserved_log_items_), which lagging followers replay and
+    // fetch the pbas of from this replica, so pbas are freed only once their entries are compacted out of the journal
+    upto_lsn = std::min(upto_lsn, int64_cast(m_rs->m_data_journal->start_index()) - 1);
+    if (upto_lsn <= ckpt_lsn) { return; }
+
+    std::vector< std::pair< int64_t, pba_list_t > > records;
+    m_state_store->get_free_pba_records(ckpt_lsn + 1, upto_lsn + 1, [&records](int64_t lsn, const pba_list_t& pbas) {
+        records.emplace_back(lsn, pbas);
+    });
+    std::sort(records.begin(), records.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    // Records are taken in lsn order until the rate limit, checkpoint stops short of the first lsn left out. An lsn can
+    // have several records, which are taken all together or not at all, as the records kept are those past the
+    // checkpoint lsn and would otherwise be freed again by the next checkpoint.
+    uint64_t const max_pbas =
+        (uint64_cast(HR_DYNAMIC_CONFIG(checkpoint_max_free_pbas_per_sec)) * HR_DYNAMIC_CONFIG(checkpoint_interval_ms)) /
+        1000;
+    pba_list_t free_pbas;
+    auto new_ckpt_lsn = upto_lsn;
+    for (size_t i{0}; i < records.size();) {
+        auto const lsn = records[i].first;
+        auto end = i;
+        size_t lsn_pbas{0};
+        for (; (end < records.size()) && (records[end].first == lsn); ++end) {
+            lsn_pbas += records[end].second.size();
+        }
+        if (max_pbas && !free_pbas.empty() && (free_pbas.size() + lsn_pbas > max_pbas)) {
+            new_ckpt_lsn = lsn - 1;
+            break;
+        }
+        for (; i < end; ++i) {
+            free_pbas.insert(free_pbas.end(), records[i].second.begin(), records[i].second.end());
+        }
+    }
+
+    // Checkpoint is made durable before the pbas are freed, so that a crash in between leaks them rather than freeing
+    // them again after restart, by when they could belong to someone else
+    m_state_store->checkpoint_lsn(new_ckpt_lsn);
+    m_state_store->remove_free_pba_records_upto(new_ckpt_lsn);
+    m_state_store->free_pbas(free_pbas);
+    COUNTER_INCREMENT(m_metrics, checkpoint_pbas_freed, free_pbas.size());
+    RS_LOG(DEBUG, "Checkpointed upto lsn={}, freed {} pbas of {} free pba records", new_ckpt_lsn, free_pbas.size(),
+           records.size());
 }
 
+///////////////////////////// Snapshot Section ////////////////////////////
 void ReplicaStateMachine::create_snapshot(nuraft::snapshot& s, nuraft::async_result< bool >::handler_type& when_done) {
     RS_LOG(DEBUG, "create_snapshot {}/{}", s.get_last_log_idx(), s.get_last_log_term());
+
+    // Snapshot passed in is valid only during this call
+    auto const snp_buf = s.serialize();
+    auto raft_snp = nuraft::snapshot::deserialize(*snp_buf);
+
+    // Commits on this replica can lag behind raft, while the data write or journal flush of an entry is pending. In
+    // that case the snapshot is taken once the commits catch upto its lsn.
+    {
+        std::unique_lock lg{m_snp_mtx};
+        if (m_state_store->get_last_commit_lsn() < int64_cast(s.get_last_log_idx())) {
+            RS_DBG_ASSERT(!m_pending_snp, "Snapshot creation is requested while another one is pending");
+            m_pending_snp = std::move(raft_snp);
+            m_pending_snp_done = when_done;
+            m_pending_snp_lsn.store(int64_cast(s.get_last_log_idx()));
+            return;
+        }
+    }
+
+    take_snapshot(raft_snp);
+    auto null_except = std::shared_ptr< std::exception >();
+    auto ret_val{true};
+    if (when_done) when_done(ret_val, null_except);
+}
+
+void ReplicaStateMachine::create_pending_snapshot(int64_t committed_lsn) {
+    auto const pending_lsn = m_pending_snp_lsn.load();
+    if ((pending_lsn < 0) || (committed_lsn < pending_lsn)) { return; }
+
+    nuraft::ptr< nuraft::snapshot > raft_snp;
+    nuraft::async_result< bool >::handler_type when_done;
+    {
+        std::unique_lock lg{m_snp_mtx};
+        if (!m_pending_snp) { return; }
+        raft_snp = std::move(m_pending_snp);
+        when_done = std::move(m_pending_snp_done);
+        m_pending_snp = nullptr;
+        m_pending_snp_done = nullptr;
+        m_pending_snp_lsn.store(-1);
+    }
+
+    take_snapshot(raft_snp);
     auto null_except = std::shared_ptr< std::exception >();
-    auto ret_val{false};
+    auto ret_val{true};
     if (when_done) when_done(ret_val, null_except);
 }
 
+void ReplicaStateMachine::take_snapshot(const nuraft::ptr< nuraft::snapshot >& raft_snp) {
+    auto const lsn = int64_cast(raft_snp->get_last_log_idx());
+    auto snp = std::make_shared< repl_snapshot >();
+    snp->raft_snp = raft_snp;
+    m_rs->m_listener->on_snapshot_create(lsn, snp->user_data, snp->pbas);
+
+    // Pbas are split into data objects upfront, each object bounded by the configured size and the number of pbas it
+    // can describe, so that an object read again later carries the same pbas.
+    auto const max_obj_size = std::max(uint64_cast(HR_DYNAMIC_CONFIG(snapshot_obj_size_kb)) * 1024, uint64_t{1});
+    uint64_t obj_size{0};
+    uint64_t obj_npbas{0};
+    snp->sizes.reserve(snp->pbas.size());
+    for (size_t i{0}; i < snp->pbas.size(); ++i) {
+        auto const size = m_state_store->pba_to_size(snp->pbas[i]);
+        if ((obj_npbas > 0) && (((obj_size + size) > max_obj_size) || (obj_npbas == data_channel_rpc::max_pbas()))) {
+            snp->obj_ends.push_back(i);
+            obj_size = 0;
+            obj_npbas = 0;
+        }
+        snp->sizes.push_back(size);
+        obj_size += size;
+        ++obj_npbas;
+    }
+    if (obj_npbas > 0) { snp->obj_ends.push_back(snp->pbas.size()); }
+
+    RS_LOG(INFO, "Snapshot taken at lsn={} with {} pbas in {} data objects", lsn, snp->pbas.size(),
+           snp->n_data_objs());
+    std::unique_lock lg{m_snp_mtx};
+    m_last_snapshot = std::move(snp);
+}
+
+nuraft::ptr< nuraft::snapshot > ReplicaStateMachine::last_snapshot() {
+    std::unique_lock lg{m_snp_mtx};
+    return m_last_snapshot ? m_last_snapshot->raft_snp : nullptr;
+}
+
+int ReplicaStateMachine::read_logical_snp_obj(nuraft::snapshot& s, void*& /* user_snp_ctx */, ulong obj_id,
+                                              raft_buf_ptr_t& data_out, bool& is_last_obj) {
+    std::shared_ptr< repl_snapshot > snp;
+    {
+        std::unique_lock lg{m_snp_mtx};
+        snp = m_last_snapshot;
+    }
+    if (!snp || !snp->has_data || (snp->raft_snp->get_last_log_idx() != s.get_last_log_idx())) {
+        RS_LOG(ERROR, "Asked to read object={} of snapshot at lsn={}, which is not the latest snapshot taken", obj_id,
+               s.get_last_log_idx());
+        return -1;
+    }
+
+    if (obj_id == 0) {
+        data_out = nuraft::buffer::alloc(sizeof(snapshot_meta) + snp->user_data.size());
+        auto* meta = new (data_out->data_begin()) snapshot_meta();
+        meta->lsn = int64_cast(s.get_last_log_idx());
+        meta->n_pbas = snp->pbas.size();
+        meta->n_data_objs = snp->n_data_objs();
+        meta->user_data_size = uint32_cast(snp->user_data.size());
+        if (!snp->user_data.empty()) {
+            std::memcpy(data_out->data_begin() + sizeof(snapshot_meta), snp->user_data.data(), snp->user_data.size());
+        }
+        is_last_obj = (snp->n_data_objs() == 0);
+        return 0;
+    }
+
+    if (obj_id > snp->n_data_objs()) {
+        RS_LOG(ERROR, "Asked to read object={} of snapshot at lsn={}, which has only {} data objects", obj_id,
+               s.get_last_log_idx(), snp->n_data_objs());
+        return -1;
+    }
+
+    uint64_t data_size{0};
+    for (auto i = snp->obj_begin(obj_id); i < snp->obj_end(obj_id); ++i) {
+        data_size += snp->sizes[i];
+    }
+
+    // Object over the read rate limit is deferred, raft asks for it again on its next attempt to sync this replica
+    if (!snapshot_read_allowed(data_size)) {
+        COUNTER_INCREMENT(m_metrics, snapshot_read_throttled, 1);
+        return -1;
+    }
+
+    data_out = read_snapshot_data_obj(*snp, obj_id, data_size);
+    if (!data_out) { return -1; }
+    is_last_obj = (obj_id == snp->n_data_objs());
+    COUNTER_INCREMENT(m_metrics, snapshot_objs_sent, 1);
+    COUNTER_INCREMENT(m_metrics, snapshot_bytes_sent, data_size);
+    return 0;
+}
+
+bool ReplicaStateMachine::snapshot_read_allowed(uint64_t size) {
+    auto const max_rate = uint64_cast(HR_DYNAMIC_CONFIG(snapshot_read_rate_mbps)) * 1024 * 1024;
+    if (max_rate == 0) { return true; }
+
+    std::unique_lock lg{m_snp_mtx};
+    if (get_elapsed_time_us(m_snp_read_window_start) >= 1000 * 1000) {
+        m_snp_read_window_start = Clock::now();
+        m_snp_read_window_bytes = 0;
+    }
+    // An object larger than the limit is still read, in a window of its own
+    if ((m_snp_read_window_bytes > 0) && ((m_snp_read_window_bytes + size) > max_rate)) { return false; }
+    m_snp_read_window_bytes += size;
+    return true;
+}
+
+raft_buf_ptr_t ReplicaStateMachine::read_snapshot_data_obj(const repl_snapshot& snp, uint64_t obj_id,
+                                                           uint64_t data_size) {
+    auto const begin = snp.obj_begin(obj_id);
+    auto const n_pbas = s_cast< uint16_t >(snp.obj_end(obj_id) - begin);
+
+    auto out_buf = nuraft::buffer::alloc(pbas_serialized::size_needed(n_pbas) + data_size);
+    auto* pba_area = new (out_buf->data_begin()) pbas_serialized();
+    pba_area->n_pbas = n_pbas;
+    auto* pinfo = pba_area->pinfo();
+
+    // All pbas are read in parallel into an aligned buffer, which is copied into the object once the last read
+    // completes. Raft expects the object to be ready on return, so this waits for the reads.
+    struct snapshot_read_ctx {
+        std::atomic< uint32_t > pending;
+        std::atomic< bool > failed{false};
+        std::vector< sisl::sg_list > sgs;
+        std::promise< void > done;
+    };
+    auto ctx = std::make_shared< snapshot_read_ctx >();
+    ctx->pending.store(n_pbas);
+    ctx->sgs.resize(n_pbas);
+    auto all_read = ctx->done.get_future();
+
+    auto* buf = iomanager.iobuf_alloc(data_buf_alignment, data_size);
+    uint64_t offset{0};
+    for (uint16_t i{0}; i < n_pbas; ++i) {
+        auto const pba = snp.pbas[begin + i];
+        auto const size = snp.sizes[begin + i];
+        pinfo[i].pba = pba;
+        pinfo[i].data_size = size;
+
+        auto& sgs = ctx->sgs[i];
+        sgs.size = size;
+        sgs.iovs.emplace_back(iovec{buf + offset, size});
+        offset += size;
+        m_state_store->async_read(pba, sgs, size, [this, ctx, pba](std::error_condition err) {
+            if (err) {
+                RS_LOG(ERROR, "Read of snapshot pba={} failed, err={}", pba, err.message());
+                ctx->failed.store(true);
+            }
+            if (ctx->pending.fetch_sub(1) == 1) { ctx->done.set_value(); }
+        });
+    }
+    all_read.wait();
+
+    if (!ctx->failed.load()) { std::memcpy(out_buf->data_begin() + pba_area->size(), buf, data_size); }
+    iomanager.iobuf_free(buf);
+    return ctx->failed.load() ? nullptr : out_buf;
+}
+
+void ReplicaStateMachine::save_logical_snp_obj(nuraft::snapshot& s, ulong& obj_id, nuraft::buffer& data,
+                                               bool /* is_first_obj */, bool /* is_last_obj */) {
+    auto const lsn = int64_cast(s.get_last_log_idx());
+    data.pos(0);
+
+    if (obj_id == 0) {
+        auto const* meta = r_cast< const snapshot_meta* >(data.data_begin());
+        if ((data.size() < sizeof(snapshot_meta)) || (meta->major_version != snapshot_meta::MAJOR_VERSION) ||
+            (meta->lsn != lsn) || (data.size() < (sizeof(snapshot_meta) + meta->user_data_size))) {
+            RS_LOG(ERROR, "Received malformed meta object of snapshot at lsn={}, asking for it again", lsn);
+            return;
+        }
+
+        // Starting over discards whatever was received of an earlier attempt
+        discard_snapshot_receive();
+        m_snp_recv = std::make_unique< snapshot_receive_ctx >();
+        m_snp_recv->lsn = lsn;
+        m_snp_recv->n_pbas = meta->n_pbas;
+        m_snp_recv->n_data_objs = meta->n_data_objs;
+        auto const* user_data = data.data_begin() + sizeof(snapshot_meta);
+        m_snp_recv->user_data.assign(user_data, user_data + meta->user_data_size);
+        m_snp_recv->pba_map.reserve(meta->n_pbas);
+        RS_LOG(INFO, "Receiving snapshot at lsn={} with {} pbas in {} data objects", lsn, meta->n_pbas,
+               meta->n_data_objs);
+        obj_id = m_snp_recv->next_obj_id;
+        return;
+    }
+
+    if (!m_snp_recv || (m_snp_recv->lsn != lsn)) {
+        // This replica restarted or leader moved on to a newer snapshot since the meta object was received
+        RS_LOG(WARN, "Received object={} of snapshot at lsn={} without its meta object, starting over", obj_id, lsn);
+        discard_snapshot_receive();
+        obj_id = 0;
+        return;
+    }
+
+    // Object resent or out of order is ignored, leader is asked for the one needed next
+    if (obj_id != m_snp_recv->next_obj_id) {
+        RS_LOG(DEBUG, "Received object={} of snapshot at lsn={}, expecting object={}", obj_id, lsn,
+               m_snp_recv->next_obj_id);
+        obj_id = m_snp_recv->next_obj_id;
+        return;
+    }
+
+    if (!write_snapshot_data_obj(data)) {
+        RS_LOG(ERROR, "Failed to apply object={} of snapshot at lsn={}, asking for it again", obj_id, lsn);
+        return;
+    }
+    COUNTER_INCREMENT(m_metrics, snapshot_objs_received, 1);
+    obj_id = ++m_snp_recv->next_obj_id;
+}
+
+bool ReplicaStateMachine::write_snapshot_data_obj(const nuraft::buffer& data) {
+    auto const* pba_area = r_cast< const pbas_serialized* >(data.data_begin());
+    if ((data.size() < pbas_serialized::size_needed(0)) || (data.size() < pba_area->size())) { return false; }
+
+    auto const n_pbas = pba_area->n_pbas;
+    auto const* pinfo = pba_area->pinfo();
+    uint64_t data_size{0};
+    for (uint16_t i{0}; i < n_pbas; ++i) {
+        data_size += pinfo[i].data_size;
+    }
+    if ((data.size() != (pba_area->size() + data_size)) ||
+        ((m_snp_recv->pba_map.size() + n_pbas) > m_snp_recv->n_pbas)) {
+        return false;
+    }
+
+    // Object is valid only during the call, so its data is copied into an aligned buffer and written to newly
+    // allocated local pbas. Object is applied only after all of its writes complete.
+    struct snapshot_write_ctx {
+        std::atomic< uint32_t > pending;
+        std::atomic< bool > failed{false};
+        std::promise< void > done;
+    };
+    auto ctx = std::make_shared< snapshot_write_ctx >();
+    ctx->pending.store(n_pbas + 1);
+    auto all_written = ctx->done.get_future();
+    auto const write_done = [ctx](bool failed) {
+        if (failed) { ctx->failed.store(true); }
+        if (ctx->pending.fetch_sub(1) == 1) { ctx->done.set_value(); }
+    };
+
+    auto* buf = iomanager.iobuf_alloc(data_buf_alignment, data_size);
+    std::memcpy(buf, data.data_begin() + pba_area->size(), data_size);
+    std::vector< std::pair< pba_t, pba_list_t > > mapped;
+    mapped.reserve(n_pbas);
+    uint64_t offset{0};
+
+    // Snapshot data is kept apart from the data being replicated meanwhile, which outlives most of it
+    pba_alloc_hints hints;
+    hints.size_class = pba_alloc_hints::bulk_size_class;
+    for (uint16_t i{0}; i < n_pbas; ++i) {
+        auto const size = pinfo[i].data_size;
+        auto const local_pbas = m_state_store->alloc_pbas(size, hints);
+        RS_REL_ASSERT(!local_pbas.empty(), "alloc_pbas returned null, no space left!");
+        mapped.emplace_back(pinfo[i].pba, local_pbas);
+
+        sisl::sg_list sgs;
+        sgs.size = size;
+        sgs.iovs.emplace_back(iovec{buf + offset, size});
+        offset += size;
+        m_state_store->async_write(sgs, local_pbas, [this, write_done](std::error_condition err) {
+            if (err) { RS_LOG(ERROR, "Write of snapshot data failed, err={}", err.message()); }
+            write_done(bool(err));
+        });
+    }
+    write_done(false);
+    all_written.wait();
+    iomanager.iobuf_free(buf);
+
+    if (ctx->failed.load()) {
+        pba_list_t free_pbas;
+        for (const auto& [remote_pba, local_pbas] : mapped) {
+            free_pbas.insert(free_pbas.end(), local_pbas.begin(), local_pbas.end());
+        }
+        m_state_store->free_pbas(free_pbas);
+        return false;
+    }
+    m_snp_recv->pba_map.insert(m_snp_recv->pba_map.end(), mapped.begin(), mapped.end());
+    return true;
+}
+
+void ReplicaStateMachine::discard_snapshot_receive() {
+    if (!m_snp_recv) { return; }
+    pba_list_t free_pbas;
+    for (const auto& [remote_pba, local_pbas] : m_snp_recv->pba_map) {
+        free_pbas.insert(free_pbas.end(), local_pbas.begin(), local_pbas.end());
+    }
+    m_state_store->free_pbas(free_pbas);
+    m_snp_recv.reset();
+}
+
+bool ReplicaStateMachine::apply_snapshot(nuraft::snapshot& s) {
+    auto const lsn = int64_cast(s.get_last_log_idx());
+    if (!m_snp_recv || (m_snp_recv->lsn != lsn) || !m_snp_recv->is_complete()) {
+        RS_LOG(ERROR, "Asked to apply snapshot at lsn={}, which is not received completely", lsn);
+        return false;
+    }
+
+    // Reqs upto the snapshot which are not committed here yet never will be, they are released along with their pbas
+    rollback_reqs(m_state_store->get_last_commit_lsn() + 1, lsn + 1);
+
+    m_rs->m_listener->on_snapshot_install(
+        lsn, sisl::blob{m_snp_recv->user_data.data(), uint32_cast(m_snp_recv->user_data.size())},
+        m_snp_recv->pba_map);
+    m_state_store->commit_lsn(lsn);
+    m_snp_recv.reset();
+
+    // Installed snapshot becomes the latest one of this replica, but its data is owned by the listener now, so it is
+    // not shipped again. A replica behind it is served once this replica takes a snapshot of its own.
+    auto const snp_buf = s.serialize();
+    auto snp = std::make_shared< repl_snapshot >();
+    snp->raft_snp = nuraft::snapshot::deserialize(*snp_buf);
+    snp->has_data = false;
+    {
+        std::unique_lock lg{m_snp_mtx};
+        m_last_snapshot = std::move(snp);
+    }
+    RS_LOG(INFO, "Installed snapshot at lsn={}", lsn);
+    return true;
+}
+
 } // namespace home_replication
@@ -1,11 +1,21 @@
 #pragma once
 
 #include <vector>
+#include <deque>
+#include <mutex>
 #include <functional>
+#include <unordered_set>
 #include <iomgr/iomgr.hpp>
+#include <boost/smart_ptr/intrusive_ptr.hpp>
 #include <folly/concurrency/ConcurrentHashMap.h>
+#include <sisl/fds/obj_allocator.hpp>
+#include <sisl/metrics/metrics.hpp>
 #include <sisl/utility/enum.hpp>
 #include <home_replication/repl_decls.h>
+#include <home_replication/repl_set.h>
+#include "state_machine/rpc_data_channel.h"
+#include "state_machine/pba_map.h"
+#include "state_machine/repl_snapshot.h"
 
 #if defined __clang__ or defined __GNUC__
 #pragma GCC diagnostic push
@@ -79,17 +89,67 @@ class StateMachineStore;
 struct repl_req;
 using raft_buf_ptr_t = nuraft::ptr< nuraft::buffer >;
 
+class ReplicaStateMachineMetrics : public sisl::MetricsGroup {
+public:
+    explicit ReplicaStateMachineMetrics(const std::string& group_id) :
+            sisl::MetricsGroup("ReplicaStateMachine", group_id) {
+        REGISTER_HISTOGRAM(journal_flush_batch_size, "Number of commits released together in lsn order",
+                           HistogramBucketsType(LinearUpto64Buckets));
+        REGISTER_HISTOGRAM(journal_flush_latency_us, "Latency of journal flush in us");
+        REGISTER_HISTOGRAM(propose_to_precommit_latency_us, "Latency from propose to pre-commit in leader in us");
+        REGISTER_HISTOGRAM(precommit_to_commit_latency_us, "Latency from pre-commit to commit in us");
+        REGISTER_HISTOGRAM(data_write_latency_us, "Latency of writing the data of a request to storage in us");
+        REGISTER_GAUGE(pending_lsn_reqs, "Number of requests received and yet to be committed");
+        REGISTER_GAUGE(pending_pba_map_entries, "Number of remote pbas mapped to local pbas");
+        REGISTER_COUNTER(remote_fetch_rpcs, "Number of fetch rpcs issued to fetch data from remote");
+        REGISTER_COUNTER(remote_fetch_pbas, "Number of pbas fetched from remote");
+        REGISTER_COUNTER(remote_fetch_retries, "Number of fetch rpcs sent again for lack of a valid response");
+        REGISTER_COUNTER(remote_fetch_failures, "Number of fetch batches given up on after all the retries");
+        REGISTER_COUNTER(append_batch_refetches, "Number of times data of an append batch is fetched again");
+        REGISTER_COUNTER(wait_timer_fetches, "Number of times wait for data channel timed out into a remote fetch");
+        REGISTER_COUNTER(snapshot_objs_sent, "Number of snapshot objects read to be shipped to other replicas");
+        REGISTER_COUNTER(snapshot_bytes_sent, "Size of pba data read to be shipped in snapshots");
+        REGISTER_COUNTER(snapshot_objs_received, "Number of snapshot objects received and written");
+        REGISTER_COUNTER(snapshot_read_throttled, "Number of snapshot object reads deferred by the read rate limit");
+        REGISTER_COUNTER(multi_pba_journal_entries, "Number of received entries not rewritten with local pbas");
+        REGISTER_COUNTER(rollback_reqs, "Number of requests rolled back on log entries being overwritten");
+        REGISTER_COUNTER(rollback_pbas_freed, "Number of local pbas freed on rollback");
+        REGISTER_COUNTER(rejected_proposals, "Number of requests proposed by this replica which raft did not accept");
+        REGISTER_COUNTER(checkpoint_pbas_freed, "Number of pbas of the free pba records freed by checkpoints");
+        REGISTER_COUNTER(unclaimed_pbas_freed, "Number of local pbas freed as no journal entry claimed their data");
+        register_me_to_farm();
+    }
+
+    ReplicaStateMachineMetrics(const ReplicaStateMachineMetrics&) = delete;
+    ReplicaStateMachineMetrics(ReplicaStateMachineMetrics&&) noexcept = delete;
+    ReplicaStateMachineMetrics& operator=(const ReplicaStateMachineMetrics&) = delete;
+    ReplicaStateMachineMetrics& operator=(ReplicaStateMachineMetrics&&) noexcept = delete;
+    ~ReplicaStateMachineMetrics() { deregister_me_from_farm(); }
+};
+
 ENUM(pba_state_t, uint32_t, unknown, allocated, written, completed)
 
 using batch_completion_cb_t = std::function< void(void) >;
+using pba_waiter_cb_t = std::function< void(bool /* success */) >;
 
+// pba_waiter and local_pba_info are created for every remote pba on the follower, so they are carved out of per-thread
+// object pools and reference counted intrusively, which avoids a malloc and a separate control block per instance.
 struct pba_waiter {
-    pba_waiter(batch_completion_cb_t&& cb) : m_cb{std::move(cb)} {}
-    ~pba_waiter() { m_cb(); }
-    batch_completion_cb_t m_cb;
+    pba_waiter(pba_waiter_cb_t&& cb) : m_cb{std::move(cb)} {}
+    ~pba_waiter() { m_cb(!m_failed.load()); }
+    pba_waiter_cb_t m_cb;
+    std::atomic< bool > m_failed{false}; // Remote fetch of one of the pbas waited on gave up
+    std::atomic< uint32_t > m_ref_cnt{0};
+
+    friend void intrusive_ptr_add_ref(pba_waiter* waiter) { waiter->m_ref_cnt.fetch_add(1, std::memory_order_relaxed); }
+    friend void intrusive_ptr_release(pba_waiter* waiter) {
+        if (waiter->m_ref_cnt.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            sisl::ObjectAllocator< pba_waiter >::deallocate(waiter);
+        }
+    }
 };
 
-using pba_waiter_ptr = std::shared_ptr< pba_waiter >;
+using pba_waiter_ptr = boost::intrusive_ptr< pba_waiter >;
 
 //
 // Requirements:
@@ -100,6 +160,8 @@ using pba_waiter_ptr = std::shared_ptr< pba_waiter >;
 // waiter by 1 (if there is a waiter) by removing the waiter; and the waiter's cb will be called when the last pba
 // finishes its write
 // 4. Waiter can be nullptr, meaning no waiter is waiting on this pba to complete its write;
+// 5. If the remote fetch of a pba gives up after max_fetch_rpc_retries, its waiter is marked failed and removed from it
+// as well, the pba stays allocated to be filled by a later write; waiter's cb is then called with false;
 //
 // async_fetch_write_pbas:
 // 1. if all fq_pbas are found in map (most common cases for non-resync-mode), apply waiter to all the local pbas whose
@@ -112,11 +174,9 @@ using pba_waiter_ptr = std::shared_ptr< pba_waiter >;
 //     map, trigger fetch pba from remote (by calling try_map_pba, which will create entry in map with local_pba),
 //          2.b.1 if it returns true, meaning fq_pba is found (data channel received this fq_pba after
 //          MAP_PBA_WAITER_TIMER), apply waiter to it;
-//          2.b.2 if it returns false, the local pba is newly allocated, we should call new api
-//          "fetch_pba_data_from_leader" (TODO) to fill this data to this local_pba and apply waiter on it;
-//          - In phase 1 we can do it in current thread;
-//          - In phase 2 we might need to move it to a dedicated thread (or pool of threads) to fetch data from remote;
-//                       use boost::intrusive_ptr;
+//          2.b.2 if it returns false, the local pba is newly allocated, we call "fetch_pba_data_from_leader" to
+//          fill this data to this local_pba and apply waiter on it; fetches are coalesced per owner of the pbas and
+//          bounded number of FETCH_PBAS rpcs are kept in flight, rest are queued and issued as responses arrive;
 //
 // 3. at this point, local_pba for every fq_pba is created in the map, and callback should be called already or after
 // last pba write is completd;
@@ -141,12 +201,25 @@ using pba_waiter_ptr = std::shared_ptr< pba_waiter >;
 // even though data is already started to fetch from leader;
 //
 // update_map_pba:
-// 1. will update from allocated to written state when write is sent;
+// 1. will update from allocated to written state when write is sent; only one caller can make this transition, others
+// will get back the state which is already moved past allocated and should skip the write;
 // 2. will update frmo written to completed state when write is completed;
 //
 // remove_map_pba:
 // 1. when commit is about to finish, it should remove the fq_pba from the map via this api;
 //
+// Rollback (rollback_reqs):
+// 1. entry of every rolled back fq_pba is moved to unknown state and removed from the map, its local pbas are freed
+// right away unless the write to them is in flight (written state);
+// 2. write completion which finds the entry gone or in unknown state frees the local pbas instead;
+//
+// Claim:
+// 1. entry mapped by the data channel ahead of its journal entry is unclaimed, the journal entry claims it once it
+// arrives (see transform_journal_entry);
+// 2. entry left unclaimed for unclaimed_pba_timeout_ms belongs to a proposal which raft rejected or overwrote before
+// it reached this replica, it is removed and its local pbas are freed like a rolled back one (see
+// reclaim_unclaimed_pbas); journal entry which races with it maps the remote pba afresh;
+//
 
 // if ref_cnt drops to zero, remove this waiter;
 // The last one who remove the waiter will trigger callback to caller, because same waiter can be associated with
@@ -155,17 +228,29 @@ struct local_pba_info {
     local_pba_info(const pba_list_t& l, pba_state_t s, const pba_waiter_ptr w) :
             m_pbas{std::move(l)}, m_state{s}, m_waiter{w} {}
 
-    pba_list_t m_pbas;       // a remote pba can map to multiple local pbas
-    pba_state_t m_state;     // state applies to all of the local pbas
-    pba_waiter_ptr m_waiter; // only one waiter can wait on same pba;
+    pba_list_t m_pbas;                    // a remote pba can map to multiple local pbas
+    std::atomic< pba_state_t > m_state;   // state applies to all of the local pbas
+    pba_waiter_ptr m_waiter;              // only one waiter can wait on same pba;
+    std::atomic< uint32_t > m_ref_cnt{0}; // intrusive reference count
+
+    enum class claim_t : uint8_t { unclaimed, claimed, reclaimed };
+    std::atomic< claim_t > m_claim{claim_t::unclaimed}; // whether a journal entry refers to it, see Claim above
+    Clock::time_point m_created_time{Clock::now()};
+
+    friend void intrusive_ptr_add_ref(local_pba_info* info) { info->m_ref_cnt.fetch_add(1, std::memory_order_relaxed); }
+    friend void intrusive_ptr_release(local_pba_info* info) {
+        if (info->m_ref_cnt.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            sisl::ObjectAllocator< local_pba_info >::deallocate(info);
+        }
+    }
 };
 
-using local_pba_info_ptr = std::shared_ptr< local_pba_info >;
+using local_pba_info_ptr = boost::intrusive_ptr< local_pba_info >;
 
 class ReplicaStateMachine : public nuraft::state_machine {
 public:
     ReplicaStateMachine(const std::shared_ptr< StateMachineStore >& state_store, ReplicaSet* rs);
-    ~ReplicaStateMachine() override = default;
+    ~ReplicaStateMachine() override;
     ReplicaStateMachine(ReplicaStateMachine const&) = delete;
     ReplicaStateMachine& operator=(ReplicaStateMachine const&) = delete;
 
@@ -173,14 +258,19 @@ public:
     uint64_t last_commit_index() override;
     raft_buf_ptr_t pre_commit_ext(const nuraft::state_machine::ext_op_params& params) override;
     raft_buf_ptr_t commit_ext(const nuraft::state_machine::ext_op_params& params) override;
-    void rollback(uint64_t lsn, nuraft::buffer&) override { LOGCRITICAL("Unimplemented rollback on: [{}]", lsn); }
+    void rollback(uint64_t lsn, nuraft::buffer& data) override;
 
-    bool apply_snapshot(nuraft::snapshot&) override { return false; }
+    bool apply_snapshot(nuraft::snapshot& s) override;
     void create_snapshot(nuraft::snapshot& s, nuraft::async_result< bool >::handler_type& when_done) override;
-    nuraft::ptr< nuraft::snapshot > last_snapshot() override { return nullptr; }
+    nuraft::ptr< nuraft::snapshot > last_snapshot() override;
+    int read_logical_snp_obj(nuraft::snapshot& s, void*& user_snp_ctx, ulong obj_id, raft_buf_ptr_t& data_out,
+                             bool& is_last_obj) override;
+    void save_logical_snp_obj(nuraft::snapshot& s, ulong& obj_id, nuraft::buffer& data, bool is_first_obj,
+                              bool is_last_obj) override;
 
     ////////// APIs outside of nuraft::state_machine requirements ////////////////////
     void propose(const sisl::blob& header, const sisl::blob& key, const sisl::sg_list& value, void* user_ctx);
+    void propose_batch(const std::vector< ReplicaSet::write_obj >& objs);
 
     repl_req* transform_journal_entry(const raft_buf_ptr_t& raft_buf);
 
@@ -200,7 +290,7 @@ public:
     /// @param pba : The fq_pba that this api wants to update its state
     /// @param to_state : The state that will be updated to
     ///
-    /// @return : current state before this api is called;
+    /// @return : current state before this api is called; unknown if the fq_pba is rolled back
     ///
     pba_state_t update_map_pba(const fully_qualified_pba& pba, const pba_state_t& to_state);
 
@@ -219,12 +309,13 @@ public:
     /// storage engine and update the map. It then calls callback after all pbas in the list are fetched.
     ///
     /// @param fq_pbas : Vector of fq_pbas that needs to mapped
-    /// @param cb : completion callback called after all pbas are fetched if that is needed.
+    /// @param cb : completion callback called after all pbas are fetched if that is needed. It is called with false if
+    /// the remote fetch of any of them gave up, after max_fetch_rpc_retries.
     /// @return : Returns if all fq_pbas have their corresponding map is readily available.
     /// if return false /* no need to wait */, no cb will be triggered;
     /// if return true /* need to wait */ , cb will be triggered after all local pbas completed writting;
     ///
-    bool async_fetch_write_pbas(const std::vector< fully_qualified_pba >& fq_pbas, batch_completion_cb_t cb);
+    bool async_fetch_write_pbas(const std::vector< fully_qualified_pba >& fq_pbas, pba_waiter_cb_t cb);
 
     ///
     /// @brief : check the input fq_pba_list that if anyone is still not completed its write.
@@ -243,25 +334,148 @@ public:
     ///
     void fetch_pba_data_from_leader(std::unique_ptr< std::vector< fully_qualified_pba > > fq_pba_list);
 
+    ///
+    /// @brief : Data channel receive path on followers. Leader pushes the data of its pbas along with the pba list,
+    /// which are mapped to local pbas and written, so that by the time journal entry arrives the data is in place.
+    ///
+    /// @param incoming_buf : Raw SEND_PBAS rpc as received from the leader
+    /// @param respond : Callback to send the response with, called after all the pbas are written locally
+    ///
+    void on_push_data_received(const sisl::io_blob& incoming_buf, data_rpc_respond_cb_t respond);
+
+    ///
+    /// @brief : Data channel serving path on the owner of the pbas (leader). Follower which missed the data channel
+    /// asks for the data of the pbas, which are read from the storage engine and sent back in the requested order.
+    ///
+    /// @param incoming_buf : Raw FETCH_PBAS rpc as received from the follower
+    /// @param respond : Callback to send the read data with, an empty response is sent if this replica is not the one
+    /// expected to serve the request or if the read failed
+    ///
+    void on_fetch_data_request(const sisl::io_blob& incoming_buf, data_rpc_respond_cb_t respond);
+
     void stop_write_wait_timer();
 
     void link_lsn_to_req(repl_req* req, int64_t lsn);
     repl_req* lsn_to_req(int64_t lsn);
+    repl_req* try_lsn_to_req(int64_t lsn); // nullptr if there is no req for this lsn
+
+    ///
+    /// @brief : Releases the requests of all the lsns in [from_lsn, to_lsn), whose log entries are being overwritten
+    /// by the new leader. Listener is notified of the rollback of the pre-committed ones already through rollback().
+    /// Requests are removed from the lsn map, their fq_pbas from the pba map and their local pbas freed, all in one
+    /// pass over the range.
+    ///
+    /// @param from_lsn : First lsn being overwritten
+    /// @param to_lsn : Next slot of the log before the overwrite
+    ///
+    void rollback_reqs(int64_t from_lsn, int64_t to_lsn);
+
+    ///
+    /// @brief : Called by the log store every time its durable index moves forward, which resumes the release of the
+    /// commits waiting for it.
+    ///
+    void on_journal_durable();
+
+    ///
+    /// @brief : Frees the pbas of the free pba records upto the committed lsn in lsn order, after persisting the
+    /// checkpoint lsn and truncating the free pba records upto it. Records past the latest snapshot are held back,
+    /// since the snapshot could still be shipped with their pbas, and so are records of entries still in the raft
+    /// journal, which lagging followers can fetch the pbas of. Raft compacts the journal on every snapshot, keeping
+    /// raft_reserved_log_entries below it. Called periodically from the checkpoint thread, frees at most
+    /// checkpoint_max_free_pbas_per_sec worth of pbas in one call, taking all the records of an lsn or none of them.
+    /// Pbas written by the data channel which no journal entry claimed in time are reclaimed along the way.
+    ///
+    void checkpoint();
+
+    ReplicaStateMachineMetrics& metrics() { return m_metrics; }
 
 private:
+    // Set of remote pbas of one owner fetched in a single FETCH_PBAS rpc. Request is broadcasted, only the first valid
+    // response is consumed. Rpc is sent again if no valid response arrives within fetch_rpc_timeout_ms, or once every
+    // replica asked responded without the data.
+    struct fetch_batch {
+        uint32_t owner_id{0};
+        std::vector< fully_qualified_pba > fq_pbas;
+        uint64_t data_size{0};
+
+        // Following are protected by m_fetch_mtx
+        uint32_t attempt{0};            // Attempt the rpc in flight belongs to, 0 for the first one
+        uint32_t responses{0};          // Responses without the data received for the attempt in flight
+        uint32_t expected_responses{0}; // Number of replicas the attempt in flight is broadcasted to
+        bool done{false};               // Served or given up on, its rpc slot is released
+        iomgr::timer_handle_t timer_hdl{iomgr::null_timer_handle};
+    };
+    using fetch_batch_ptr = std::shared_ptr< fetch_batch >;
+
+    // Raft context of a batch of proposals, after_precommit is called once for every entry of the batch in order
+    struct propose_batch_ctx {
+        std::vector< repl_req* > reqs;
+        size_t next_idx{0};
+    };
+
+    // Raft server id of this replica, which is 0 until the replica set joins its raft group
+    uint32_t server_id() const { return uint32_cast(m_rs->server_id()); }
     void after_precommit_in_leader(const nuraft::raft_server::req_ext_cb_params& params);
-    void check_and_commit(repl_req* req);
+    void after_precommit_batch_in_leader(const nuraft::raft_server::req_ext_cb_params& params);
+    bool append_to_raft(std::vector< raft_buf_ptr_t >& bufs, nuraft::raft_server::req_ext_params& params);
+    void reject_proposed_reqs(const std::vector< repl_req* >& reqs);
+    void commit_req(int64_t lsn);
+    void on_local_data_written(repl_req* req);
+    void commit_after_journal_flush(repl_req* req);
+    void resume_commits();
+    void release_commits(bool on_worker);
+    void send_in_data_channel(const pba_list_t& pbas, const sisl::sg_list& value);
+    local_pba_info_ptr map_pba(const fully_qualified_pba& fq_pba);
+    std::pair< pba_list_t, pba_state_t > claim_map_pba(const fully_qualified_pba& fq_pba);
+    void reclaim_unclaimed_pbas();
+    void write_remote_pba(const fully_qualified_pba& fq_pba, const uint8_t* data, bool copy_data,
+                          const batch_completion_cb_t& cb);
+    void issue_pending_fetches();
+    void send_fetch_rpc(const fetch_batch_ptr& batch);
+    void on_fetch_data_response(const fetch_batch_ptr& batch, uint32_t attempt, const sisl::io_blob& response);
+    void on_fetch_timeout(const fetch_batch_ptr& batch, uint32_t attempt);
+    bool next_fetch_attempt(fetch_batch& batch);
+    void cancel_fetch_timer(fetch_batch& batch);
+    void fail_fetch(const fetch_batch_ptr& batch);
+    void release_fetch_slot(const fetch_batch_ptr& batch);
+    void take_snapshot(const nuraft::ptr< nuraft::snapshot >& raft_snp);
+    void create_pending_snapshot(int64_t committed_lsn);
+    bool snapshot_read_allowed(uint64_t size);
+    raft_buf_ptr_t read_snapshot_data_obj(const repl_snapshot& snp, uint64_t obj_id, uint64_t data_size);
+    bool write_snapshot_data_obj(const nuraft::buffer& data);
+    void discard_snapshot_receive();
 
 private:
     std::shared_ptr< StateMachineStore > m_state_store;
-    folly::ConcurrentHashMap< std::string, local_pba_info_ptr > m_pba_map; // fully_qualified_pba to local pba mapping;
+    fq_pba_map_t< local_pba_info_ptr > m_pba_map; // fully_qualified_pba to local pba mapping;
     folly::ConcurrentHashMap< int64_t, repl_req* > m_lsn_req_map;
     ReplicaSet* m_rs;
     std::string m_group_id;
-    uint32_t m_server_id;                        // TODO: Populate the value from replica set/RAFT
     nuraft::ptr< nuraft::buffer > m_success_ptr; // Preallocate the success return to raft
     iomgr::timer_handle_t m_wait_pba_write_timer_hdl{iomgr::null_timer_handle};
     bool resync_mode{false};
+
+    // Group commit: commits waiting for the req to be locally durable, released in lsn order by one thread at a time,
+    // the one which sets m_flush_in_progress
+    std::mutex m_flush_mtx;
+    std::deque< repl_req* > m_flush_pending_reqs;
+    bool m_flush_in_progress{false};
+
+    std::mutex m_fetch_mtx;                                   // Protects the fetch queue and the fetches in flight
+    std::deque< fetch_batch_ptr > m_fetch_q;                  // Fetch batches waiting for an rpc slot
+    std::unordered_set< fetch_batch_ptr > m_inflight_fetches; // Fetch batches holding an rpc slot
+
+    // Snapshots: latest one taken or installed, and the one waiting for the commits to catch upto its lsn
+    std::mutex m_snp_mtx;
+    std::shared_ptr< repl_snapshot > m_last_snapshot;
+    nuraft::ptr< nuraft::snapshot > m_pending_snp;
+    nuraft::async_result< bool >::handler_type m_pending_snp_done;
+    std::atomic< int64_t > m_pending_snp_lsn{-1};
+    Clock::time_point m_snp_read_window_start{Clock::now()}; // Window of the snapshot read rate limit
+    uint64_t m_snp_read_window_bytes{0};
+    std::unique_ptr< snapshot_receive_ctx > m_snp_recv; // Snapshot being received, accessed by raft one at a time
+
+    ReplicaStateMachineMetrics m_metrics;
 };
 
 } // namespace home_replication
@@ -1,4 +1,8 @@
 #include "home_storage_engine.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <unordered_set>
 #include <sisl/fds/utils.hpp>
 #include <boost/uuid/uuid_io.hpp>
 #include <homestore/blkdata_service.hpp>
@@ -20,8 +24,102 @@
 SISL_LOGGING_DECL(home_replication)
 
 namespace home_replication {
-static constexpr store_lsn_t to_store_lsn(repl_lsn_t raft_lsn) { return raft_lsn - 1; }
-static constexpr repl_lsn_t to_repl_lsn(store_lsn_t store_lsn) { return store_lsn + 1; }
+// Carves nblks out of the allocated blks in order, starting at the cursor (cur, consumed_nblks) which is advanced past
+// them. A piece can straddle two allocated blkids, in which case it gets a part of each.
+static void carve_blks(const pba_list_t& blks, size_t& cur, uint32_t& consumed_nblks, uint32_t nblks,
+                       pba_list_t& out_pbas) {
+    while (nblks > 0) {
+        RELEASE_ASSERT_LT(cur, blks.size(), "Allocated blks are short of the requested nblks={}", nblks);
+        homestore::BlkId const blkid{blks[cur]};
+        uint32_t const n = std::min(nblks, uint32_cast(blkid.get_nblks()) - consumed_nblks);
+        homestore::BlkId const piece{s_cast< homestore::blk_num_t >(blkid.get_blk_num() + consumed_nblks),
+                                     s_cast< homestore::blk_count_t >(n), blkid.get_chunk_num()};
+        out_pbas.push_back(piece.to_integer());
+        nblks -= n;
+        consumed_nblks += n;
+        if (consumed_nblks == blkid.get_nblks()) {
+            ++cur;
+            consumed_nblks = 0;
+        }
+    }
+}
+
+///////////////////////////// SuperBlkFlusher Section ////////////////////////////
+// Flushes the superblk of every replica set on this node from one recurring timer on the truncate thread. Stores queue
+// themselves once they have something to flush since the last pass, so an idle replica set costs nothing per pass and
+// the number of timers does not grow with the number of replica sets.
+//
+// What is shared is the scheduling of the flushes, not the writes: the commit lsn lives in the superblk of each replica
+// set, so a pass still writes one meta blk per dirty replica set. Cost of a pass grows with the number of replica sets
+// committing within the interval. Gathering the lsns into one table written once per pass would need a meta blk of its
+// own, and a recovery step merging it into the superblks of the replica sets.
+class SuperBlkFlusher {
+public:
+    static SuperBlkFlusher& instance() {
+        static SuperBlkFlusher s_flusher;
+        return s_flusher;
+    }
+
+    void add_store() {
+        std::unique_lock lg{m_timer_mtx};
+        if (++m_nstores > 1) { return; }
+        iomanager.run_on(homestore::logstore_service().truncate_thread(), [this](iomgr::io_thread_addr_t) {
+            m_timer_hdl =
+                iomanager.schedule_thread_timer(HR_DYNAMIC_CONFIG(commit_lsn_flush_ms) * 1000 * 1000,
+                                                true /* recurring */, nullptr, [this](void*) { flush_dirty_stores(); });
+        });
+    }
+
+    void remove_store(HomeStateMachineStore* store) {
+        {
+            // Waits for the pass which might be flushing this store. Store is left marked dirty, so it is never queued
+            // again.
+            std::unique_lock flush_lg{m_flush_mtx};
+            store->m_sb_dirty.store(true);
+            std::unique_lock lg{m_dirty_mtx};
+            m_dirty_stores.erase(store);
+        }
+
+        std::unique_lock lg{m_timer_mtx};
+        if (--m_nstores > 0) { return; }
+        iomanager.run_on(
+            homestore::logstore_service().truncate_thread(),
+            [this](iomgr::io_thread_addr_t) {
+                if (m_timer_hdl != iomgr::null_timer_handle) {
+                    iomanager.cancel_timer(m_timer_hdl);
+                    m_timer_hdl = iomgr::null_timer_handle;
+                }
+            },
+            iomgr::wait_type_t::spin);
+    }
+
+    void mark_dirty(HomeStateMachineStore* store) {
+        std::unique_lock lg{m_dirty_mtx};
+        m_dirty_stores.insert(store);
+    }
+
+private:
+    void flush_dirty_stores() {
+        std::unique_lock flush_lg{m_flush_mtx};
+        std::unordered_set< HomeStateMachineStore* > stores;
+        {
+            std::unique_lock lg{m_dirty_mtx};
+            stores.swap(m_dirty_stores);
+        }
+        for (auto* store : stores) {
+            store->flush_super_block();
+        }
+    }
+
+private:
+    std::mutex m_timer_mtx;
+    uint32_t m_nstores{0}; // Stores being flushed, timer runs as long as there is any
+    iomgr::timer_handle_t m_timer_hdl{iomgr::null_timer_handle};
+
+    std::mutex m_flush_mtx; // Held for the duration of a pass
+    std::mutex m_dirty_mtx;
+    std::unordered_set< HomeStateMachineStore* > m_dirty_stores;
+};
 
 ///////////////////////////// HomeStateMachineStore Section ////////////////////////////
 HomeStateMachineStore::HomeStateMachineStore(uuid_t rs_uuid) : m_sb{"replica_set"} {
@@ -36,11 +134,14 @@ HomeStateMachineStore::HomeStateMachineStore(uuid_t rs_uuid) : m_sb{"replica_set
         homestore::logstore_service().create_new_log_store(homestore::LogStoreService::CTRL_LOG_FAMILY_IDX, true);
     if (!m_free_pba_store) { throw std::runtime_error("Failed to create log store"); }
     m_sb->free_pba_store_id = m_free_pba_store->get_store_id();
+    m_sb->commit_lsn = 0;
+    m_sb->m_checkpoint_lsn = 0;
+    m_sb->free_pba_next_seq = 0;
     m_sb.write();
     m_sb_in_mem = *m_sb;
     SM_STORE_LOG(DEBUG, "New free pba record logstore={} created", m_sb->free_pba_store_id);
 
-    start_sb_flush_timer();
+    start_sb_flush();
 }
 
 HomeStateMachineStore::HomeStateMachineStore(const homestore::superblk< home_rs_superblk >& rs_sb) :
@@ -48,34 +149,148 @@ HomeStateMachineStore::HomeStateMachineStore(const homestore::superblk< home_rs_
     LOGDEBUGMOD(home_replication, "Opening existing replica state machine store for uuid={}", rs_sb->uuid);
     m_sb = rs_sb;
     m_sb_in_mem = *m_sb;
+    m_commit_lsn.store(m_sb_in_mem.commit_lsn);
+    m_checkpoint_lsn.store(m_sb_in_mem.m_checkpoint_lsn);
+    m_last_flushed_commit_lsn = m_sb_in_mem.commit_lsn;
+    m_free_truncated_lsn.store(m_sb_in_mem.m_checkpoint_lsn);
+    m_free_next_seq = m_sb_in_mem.free_pba_next_seq;
     SM_STORE_LOG(DEBUG, "Opening free pba record logstore={}", m_sb->free_pba_store_id);
     homestore::logstore_service().open_log_store(homestore::LogStoreService::CTRL_LOG_FAMILY_IDX,
                                                  m_sb->free_pba_store_id, true,
                                                  bind_this(HomeStateMachineStore::on_store_created, 1));
 }
 
-HomeStateMachineStore::~HomeStateMachineStore() { stop_sb_flush_timer(); }
+HomeStateMachineStore::~HomeStateMachineStore() {
+    stop_sb_flush();
+    // Blks reserved but not handed out are not tracked anywhere else, they would leak across a restart
+    release_pba_streams();
+    // Staged lsns and free pba records are not lost on a clean shutdown
+    if (m_free_pba_store) {
+        flush_free_pba_records();
+        persist_super_block(false /* force */);
+    }
+}
 
 void HomeStateMachineStore::on_store_created(std::shared_ptr< homestore::HomeLogStore > free_pba_store) {
     assert(m_sb->free_pba_store_id == free_pba_store->get_store_id());
     m_free_pba_store = free_pba_store;
-    // m_free_pba_store->register_log_found_cb(
-    //     [this](int64_t lsn, homestore::log_buffer buf, [[maybe_unused]] void* ctx) { m_entry_found_cb(lsn, buf); });
+    {
+        // Seq nums truncated since the superblk was last written are not reused either
+        std::unique_lock lg{m_free_staging_mtx};
+        m_free_next_seq = std::max(m_free_next_seq, m_free_pba_store->truncated_upto() + 1);
+    }
+    m_free_pba_store->register_log_found_cb(
+        [this](store_lsn_t seq, homestore::log_buffer buf, [[maybe_unused]] void* ctx) {
+            on_free_pba_batch_found(seq, buf);
+        });
     SM_STORE_LOG(DEBUG, "Successfully opened free pba record logstore={}", m_sb->free_pba_store_id);
 
-    start_sb_flush_timer();
+    start_sb_flush();
 }
 
 void HomeStateMachineStore::destroy() {
+    // Flusher must be done with this store before the logstore and superblk it flushes are removed
+    stop_sb_flush();
+    release_pba_streams();
+    {
+        std::unique_lock lg{m_free_staging_mtx};
+        m_free_staging.clear();
+        m_free_staging_size = 0;
+        m_free_batches.clear();
+    }
     SM_STORE_LOG(DEBUG, "Free pba record logstore={} is being physically removed", m_sb->free_pba_store_id);
     homestore::logstore_service().remove_log_store(homestore::LogStoreService::CTRL_LOG_FAMILY_IDX,
                                                    m_sb->free_pba_store_id);
     m_free_pba_store.reset();
     m_sb.destroy();
-    stop_sb_flush_timer();
 }
 
-pba_list_t HomeStateMachineStore::alloc_pbas(uint32_t size) { return homestore::data_service().alloc_blks(size); }
+pba_list_t HomeStateMachineStore::alloc_pbas(uint32_t size, const pba_alloc_hints& hints) {
+    auto const page_size = homestore::data_service().get_page_size();
+    return alloc_blks(sisl::round_up(size, page_size) / page_size, hints);
+}
+
+std::vector< pba_list_t > HomeStateMachineStore::alloc_pbas(const std::vector< uint32_t >& sizes,
+                                                            const pba_alloc_hints& hints) {
+    auto const page_size = homestore::data_service().get_page_size();
+    uint64_t total_size{0};
+    for (auto const size : sizes) {
+        total_size += sisl::round_up(size, page_size);
+    }
+
+    std::vector< pba_list_t > out_pbas(sizes.size());
+    if (total_size > std::numeric_limits< uint32_t >::max()) {
+        // Too large to be allocated in one shot, allocate them individually
+        for (size_t i{0}; i < sizes.size(); ++i) {
+            out_pbas[i] = alloc_pbas(sizes[i], hints);
+        }
+        return out_pbas;
+    }
+
+    // Allocate for the entire batch and carve out the blocks of each io in order
+    auto const all_pbas = alloc_blks(uint32_cast(total_size / page_size), hints);
+    size_t cur{0};
+    uint32_t consumed_nblks{0};
+    for (size_t i{0}; i < sizes.size(); ++i) {
+        carve_blks(all_pbas, cur, consumed_nblks, sisl::round_up(sizes[i], page_size) / page_size, out_pbas[i]);
+    }
+    return out_pbas;
+}
+
+pba_list_t HomeStateMachineStore::alloc_blks(uint32_t nblks, const pba_alloc_hints& hints) {
+    auto const page_size = homestore::data_service().get_page_size();
+    uint32_t const extent_nblks = (HR_DYNAMIC_CONFIG(pba_stream_extent_kb) * 1024) / page_size;
+    if (!hints.same_stream || (nblks >= extent_nblks)) {
+        return homestore::data_service().alloc_blks(nblks * page_size);
+    }
+
+    pba_list_t out_pbas;
+    pba_list_t leftover;
+    {
+        std::unique_lock lg{m_stream_mtx};
+        auto& stream = m_streams[std::min(hints.size_class, s_cast< uint8_t >(pba_alloc_hints::max_size_classes - 1))];
+        if (stream.remaining_nblks < nblks) {
+            // Rest of the extent is either used up first, or given back to keep the allocation in one piece
+            auto& rest = hints.prefer_contiguous ? leftover : out_pbas;
+            nblks -= hints.prefer_contiguous ? 0 : stream.remaining_nblks;
+            carve_blks(stream.extent, stream.cur, stream.consumed_nblks, stream.remaining_nblks, rest);
+
+            stream.extent = homestore::data_service().alloc_blks(extent_nblks * page_size);
+            stream.cur = 0;
+            stream.consumed_nblks = 0;
+            stream.remaining_nblks = 0;
+            for (const auto& p : stream.extent) {
+                stream.remaining_nblks += homestore::BlkId{p}.get_nblks();
+            }
+        }
+
+        if (stream.remaining_nblks >= nblks) {
+            carve_blks(stream.extent, stream.cur, stream.consumed_nblks, nblks, out_pbas);
+            stream.remaining_nblks -= nblks;
+            nblks = 0;
+        }
+    }
+
+    free_pbas(leftover);
+    if (nblks > 0) {
+        // Not enough free space left for an entire extent, allocate the rest directly
+        auto const pbas = homestore::data_service().alloc_blks(nblks * page_size);
+        out_pbas.insert(out_pbas.end(), pbas.begin(), pbas.end());
+    }
+    return out_pbas;
+}
+
+void HomeStateMachineStore::release_pba_streams() {
+    pba_list_t leftover;
+    {
+        std::unique_lock lg{m_stream_mtx};
+        for (auto& stream : m_streams) {
+            carve_blks(stream.extent, stream.cur, stream.consumed_nblks, stream.remaining_nblks, leftover);
+            stream = pba_stream{};
+        }
+    }
+    free_pbas(leftover);
+}
 
 void HomeStateMachineStore::async_write(const sisl::sg_list& sgs, const pba_list_t& in_pba_list,
                                         const io_completion_cb_t& cb) {
@@ -104,100 +319,260 @@ void HomeStateMachineStore::free_pba(pba_t pba) {
                                              []([[maybe_unused]] std::error_condition err) { assert(!err); });
 }
 
+void HomeStateMachineStore::free_pbas(const pba_list_t& pbas) {
+    // Blks which are adjacent on the device are freed as one, which cuts the number of frees for data written in order
+    for (const auto& pba : merge_adjacent_pbas(pbas)) {
+        free_pba(pba);
+    }
+}
+
+pba_list_t HomeStateMachineStore::merge_adjacent_pbas(const pba_list_t& pbas) {
+    pba_list_t out_pbas;
+    if (pbas.empty()) { return out_pbas; }
+
+    std::vector< homestore::BlkId > blkids;
+    blkids.reserve(pbas.size());
+    for (const auto& p : pbas) {
+        blkids.emplace_back(p);
+    }
+    std::sort(blkids.begin(), blkids.end(), [](const homestore::BlkId& a, const homestore::BlkId& b) {
+        return (a.get_chunk_num() < b.get_chunk_num()) ||
+            ((a.get_chunk_num() == b.get_chunk_num()) && (a.get_blk_num() < b.get_blk_num()));
+    });
+
+    homestore::BlkId merged{blkids[0]};
+    for (size_t i{1}; i < blkids.size(); ++i) {
+        auto const& b = blkids[i];
+        if ((b.get_chunk_num() == merged.get_chunk_num()) &&
+            (b.get_blk_num() == merged.get_blk_num() + merged.get_nblks()) &&
+            (uint32_cast(merged.get_nblks()) + b.get_nblks() <= homestore::BlkId::max_blks_in_op())) {
+            merged = homestore::BlkId{merged.get_blk_num(),
+                                      s_cast< homestore::blk_count_t >(merged.get_nblks() + b.get_nblks()),
+                                      merged.get_chunk_num()};
+        } else {
+            out_pbas.push_back(merged.to_integer());
+            merged = b;
+        }
+    }
+    out_pbas.push_back(merged.to_integer());
+    return out_pbas;
+}
+
 //////////////// StateMachine Superblock/commit update section /////////////////////////////
 void HomeStateMachineStore::commit_lsn(repl_lsn_t lsn) {
-    folly::SharedMutexWritePriority::ReadHolder holder(m_sb_lock);
-    m_sb_in_mem.commit_lsn = lsn;
+    // Commits are released in lsn order, only the max is kept regardless, so that the commit lsn never moves back
+    auto cur_lsn = m_commit_lsn.load(std::memory_order_relaxed);
+    while ((cur_lsn < lsn) &&
+           !m_commit_lsn.compare_exchange_weak(cur_lsn, lsn, std::memory_order_release, std::memory_order_relaxed)) {}
+    mark_sb_dirty();
 }
 
-repl_lsn_t HomeStateMachineStore::get_last_commit_lsn() const {
-    folly::SharedMutexWritePriority::ReadHolder holder(m_sb_lock);
-    return m_sb_in_mem.commit_lsn;
+repl_lsn_t HomeStateMachineStore::get_last_commit_lsn() const { return m_commit_lsn.load(std::memory_order_acquire); }
+
+void HomeStateMachineStore::checkpoint_lsn(repl_lsn_t lsn) {
+    m_checkpoint_lsn.store(lsn, std::memory_order_release);
+    persist_super_block(true /* force */);
 }
 
-void HomeStateMachineStore::start_sb_flush_timer() {
-    iomanager.run_on(homestore::logstore_service().truncate_thread(), [this](iomgr::io_thread_addr_t) {
-        m_sb_flush_timer_hdl =
-            iomanager.schedule_thread_timer(HR_DYNAMIC_CONFIG(commit_lsn_flush_ms) * 1000 * 1000, true /* recurring */,
-                                            nullptr, [this](void*) { flush_super_block(); });
-    });
+repl_lsn_t HomeStateMachineStore::get_checkpoint_lsn() const {
+    return m_checkpoint_lsn.load(std::memory_order_acquire);
 }
 
-void HomeStateMachineStore::stop_sb_flush_timer() {
-    if (m_sb_flush_timer_hdl != iomgr::null_timer_handle) {
-        iomanager.run_on(
-            homestore::logstore_service().truncate_thread(),
-            [this](iomgr::io_thread_addr_t) {
-                iomanager.cancel_timer(m_sb_flush_timer_hdl);
-                m_sb_flush_timer_hdl = iomgr::null_timer_handle;
-            },
-            iomgr::wait_type_t::spin);
-    }
+void HomeStateMachineStore::start_sb_flush() {
+    m_sb_flush_started = true;
+    SuperBlkFlusher::instance().add_store();
 }
 
-void HomeStateMachineStore::flush_super_block() {
-    bool do_flush{false};
+void HomeStateMachineStore::stop_sb_flush() {
+    if (!m_sb_flush_started) { return; }
+    m_sb_flush_started = false;
+    SuperBlkFlusher::instance().remove_store(this);
+}
+
+void HomeStateMachineStore::mark_sb_dirty() {
+    // Queued only once between the passes of the flusher, so the commit path rarely goes beyond the flag check
+    if (m_sb_dirty.load(std::memory_order_relaxed) || m_sb_dirty.exchange(true)) { return; }
+    SuperBlkFlusher::instance().mark_dirty(this);
+}
+
+void HomeStateMachineStore::persist_super_block(bool force) {
+    // Staged lsns are snapshotted without holding off the committers. Checkpoint lsn is read before the commit lsn,
+    // both only move forward and checkpoint never passes the commit, so the pair persisted is always a consistent one.
+    std::unique_lock lg{m_sb_write_mtx};
+    auto const checkpoint_lsn = m_checkpoint_lsn.load(std::memory_order_acquire);
+    auto const commit_lsn = m_commit_lsn.load(std::memory_order_acquire);
+    if (!force && (commit_lsn == m_last_flushed_commit_lsn) && (checkpoint_lsn == m_sb->m_checkpoint_lsn)) { return; }
+
+    // Free pba records of the lsns committed are added before their commit, they are made durable ahead of the commit
+    // lsn so that a restart never finds an lsn committed without the pbas it gave up
+    if (m_free_pba_store) { flush_free_pba_records(); }
+
+    m_sb->commit_lsn = commit_lsn;
+    m_sb->m_checkpoint_lsn = checkpoint_lsn;
     {
-        folly::SharedMutexWritePriority::WriteHolder holder(m_sb_lock);
-        if (m_sb_in_mem.commit_lsn > m_last_flushed_commit_lsn) {
-            *m_sb = m_sb_in_mem;
-            do_flush = true;
-        }
+        std::unique_lock lg{m_free_staging_mtx};
+        m_sb->free_pba_next_seq = m_free_next_seq;
     }
+    m_sb.write();
+    m_last_flushed_commit_lsn = commit_lsn;
+}
+
+void HomeStateMachineStore::flush_super_block() {
+    // Updates from here on queue the store again for the next pass
+    m_sb_dirty.store(false);
+    persist_super_block(false /* force */);
 
-    if (do_flush) { m_sb.write(); }
+    // Staged free pba records are persisted at least this often, even when the commit lsn has not moved
+    persist_free_pba_records();
 }
 
 //////////////// Free PBA Record section /////////////////////////////
+static constexpr uint64_t free_pba_record_size(size_t num_pbas) {
+    return sizeof(repl_lsn_t) + sizeof(uint32_t) + (num_pbas * sizeof(pba_t));
+}
+
 void HomeStateMachineStore::add_free_pba_record(repl_lsn_t lsn, const pba_list_t& pbas) {
-    // Serialize it as
-    // # num pbas (N)       4 bytes
+    bool persist{false};
+    {
+        std::unique_lock lg{m_free_staging_mtx};
+        m_free_staging.emplace_back(lsn, pbas);
+        m_free_staging_size += free_pba_record_size(pbas.size());
+        persist = (m_free_staging_size >= HR_DYNAMIC_CONFIG(free_pba_record_batch_kb) * 1024);
+    }
+    if (persist) {
+        persist_free_pba_records();
+    } else {
+        mark_sb_dirty();
+    }
+}
+
+void HomeStateMachineStore::persist_free_pba_records() {
+    std::vector< std::pair< repl_lsn_t, pba_list_t > > records;
+    uint64_t size_needed{sizeof(uint32_t)};
+    {
+        std::unique_lock lg{m_free_staging_mtx};
+        if (m_free_staging.empty()) { return; }
+        records.swap(m_free_staging);
+        size_needed += m_free_staging_size;
+        m_free_staging_size = 0;
+    }
+    std::sort(records.begin(), records.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    // Serialize all the staged records as one log record, stored at a seq num of its own. Several batches can hold
+    // records of the same lsn, so the lsn of every record is in the payload and is never used as the seq num.
+    // # num records (M)    4 bytes
     // +---
-    // | PBA                8 bytes
-    // +--- repeat N
-    uint32_t size_needed = sizeof(uint32_t) + (pbas.size() * sizeof(pba_t));
-    sisl::io_blob b{size_needed, 0 /* unaligned */};
-    *(r_cast< uint32_t* >(b.bytes)) = uint32_cast(pbas.size());
-
-    pba_t* raw_ptr = r_cast< pba_t* >(b.bytes + sizeof(uint32_t));
-    for (const auto pba : pbas) {
-        *raw_ptr = pba;
-        ++raw_ptr;
-    }
-    m_last_write_lsn.store(lsn);
-    m_free_pba_store->write_async(to_store_lsn(lsn), b, nullptr,
+    // | LSN                8 bytes
+    // | # num pbas (N)     4 bytes
+    // | +---
+    // | | PBA              8 bytes
+    // | +--- repeat N
+    // +--- repeat M
+    sisl::io_blob b{uint32_cast(size_needed), 0 /* unaligned */};
+    uint8_t* raw_ptr = b.bytes;
+    *(r_cast< uint32_t* >(raw_ptr)) = uint32_cast(records.size());
+    raw_ptr += sizeof(uint32_t);
+    for (const auto& [lsn, pbas] : records) {
+        *(r_cast< repl_lsn_t* >(raw_ptr)) = lsn;
+        raw_ptr += sizeof(repl_lsn_t);
+        *(r_cast< uint32_t* >(raw_ptr)) = uint32_cast(pbas.size());
+        raw_ptr += sizeof(uint32_t);
+        std::memcpy(raw_ptr, pbas.data(), pbas.size() * sizeof(pba_t));
+        raw_ptr += pbas.size() * sizeof(pba_t);
+    }
+
+    // Seq num is taken and the write issued under the lock, so that batches are written in the order of their seq nums
+    std::unique_lock lg{m_free_staging_mtx};
+    auto const seq = m_free_next_seq++;
+    m_free_batches.emplace_back(seq, records.back().first);
+    m_free_pba_store->write_async(seq, b, nullptr,
                                   [](int64_t, sisl::io_blob& b, homestore::logdev_key, void*) { b.buf_free(); });
 }
 
+void HomeStateMachineStore::on_free_pba_batch_found(store_lsn_t seq, const homestore::log_buffer& buf) {
+    // Batches are replayed in the order of their seq nums, highest lsn of each is that of its last record
+    uint8_t const* raw_ptr = buf.bytes();
+    uint32_t const num_records = *(r_cast< uint32_t const* >(raw_ptr));
+    raw_ptr += sizeof(uint32_t);
+    repl_lsn_t last_lsn{0};
+    for (uint32_t i{0}; i < num_records; ++i) {
+        last_lsn = *(r_cast< repl_lsn_t const* >(raw_ptr));
+        raw_ptr += sizeof(repl_lsn_t);
+        uint32_t const num_pbas = *(r_cast< uint32_t const* >(raw_ptr));
+        raw_ptr += sizeof(uint32_t) + (num_pbas * sizeof(pba_t));
+    }
+
+    std::unique_lock lg{m_free_staging_mtx};
+    m_free_batches.emplace_back(seq, last_lsn);
+    m_free_next_seq = std::max(m_free_next_seq, seq + 1);
+}
+
 void HomeStateMachineStore::get_free_pba_records(repl_lsn_t start_lsn, repl_lsn_t end_lsn,
                                                  const std::function< void(repl_lsn_t, const pba_list_t&) >& cb) {
-    m_free_pba_store->foreach (to_store_lsn(start_lsn),
-                               [end_lsn, &cb](store_lsn_t lsn, const homestore::log_buffer& entry) -> bool {
-                                   auto rlsn = to_repl_lsn(lsn);
-                                   bool ret = (rlsn < end_lsn - 1);
-                                   if (rlsn < end_lsn) {
-                                       pba_list_t plist;
-                                       uint32_t num_pbas = *(r_cast< uint32_t* >(entry.bytes()));
-                                       pba_t* raw_ptr = r_cast< pba_t* >(entry.bytes() + sizeof(uint32_t));
-                                       for (uint32_t i{0}; i < num_pbas; ++i) {
-                                           plist.push_back(*raw_ptr);
-                                           ++raw_ptr;
-                                       }
-                                       cb(rlsn, plist);
-                                   }
-                                   return ret;
-                               });
+    // Staged records are made durable first, so that every record added so far is visited
+    flush_free_pba_records();
+
+    // Seq nums say nothing about the lsns of the records in a batch, so every batch not yet truncated is looked into
+    store_lsn_t first_seq;
+    {
+        std::unique_lock lg{m_free_staging_mtx};
+        if (m_free_batches.empty()) { return; }
+        first_seq = m_free_batches.front().first;
+    }
+    auto const truncated_lsn = m_free_truncated_lsn.load();
+    m_free_pba_store->foreach (
+        first_seq,
+        [start_lsn, end_lsn, truncated_lsn, &cb](store_lsn_t, const homestore::log_buffer& entry) -> bool {
+            uint8_t const* raw_ptr = entry.bytes();
+            uint32_t const num_records = *(r_cast< uint32_t const* >(raw_ptr));
+            raw_ptr += sizeof(uint32_t);
+            pba_list_t plist;
+            for (uint32_t i{0}; i < num_records; ++i) {
+                auto const rlsn = *(r_cast< repl_lsn_t const* >(raw_ptr));
+                raw_ptr += sizeof(repl_lsn_t);
+                uint32_t const num_pbas = *(r_cast< uint32_t const* >(raw_ptr));
+                raw_ptr += sizeof(uint32_t);
+                if ((rlsn >= start_lsn) && (rlsn < end_lsn) && (rlsn > truncated_lsn)) {
+                    plist.assign(r_cast< pba_t const* >(raw_ptr), r_cast< pba_t const* >(raw_ptr) + num_pbas);
+                    cb(rlsn, plist);
+                }
+                raw_ptr += num_pbas * sizeof(pba_t);
+            }
+            return true;
+        });
 }
 
 void HomeStateMachineStore::remove_free_pba_records_upto(repl_lsn_t lsn) {
-    m_free_pba_store->truncate(to_store_lsn(lsn));
-    m_last_write_lsn.store(0);
+    store_lsn_t truncate_seq{-1};
+    {
+        std::unique_lock lg{m_free_staging_mtx};
+        auto const it = std::stable_partition(m_free_staging.begin(), m_free_staging.end(),
+                                              [lsn](const auto& record) { return record.first > lsn; });
+        for (auto r = it; r != m_free_staging.end(); ++r) {
+            m_free_staging_size -= free_pba_record_size(r->second.size());
+        }
+        m_free_staging.erase(it, m_free_staging.end());
+
+        // Batches are truncated upto the first one which still holds records past lsn
+        while (!m_free_batches.empty() && (m_free_batches.front().second <= lsn)) {
+            truncate_seq = m_free_batches.front().first;
+            m_free_batches.pop_front();
+        }
+    }
+
+    // Batches left can still hold records upto lsn, they are skipped while reading
+    auto cur_truncated = m_free_truncated_lsn.load();
+    while ((cur_truncated < lsn) && !m_free_truncated_lsn.compare_exchange_weak(cur_truncated, lsn)) {}
+    if (truncate_seq >= 0) { m_free_pba_store->truncate(truncate_seq); }
 }
 
 void HomeStateMachineStore::flush_free_pba_records() {
-    auto last_lsn = m_last_write_lsn.load();
-    m_free_pba_store->flush_sync(last_lsn == 0 ? homestore::invalid_lsn() : to_store_lsn(last_lsn));
+    persist_free_pba_records();
+    store_lsn_t last_seq;
+    {
+        std::unique_lock lg{m_free_staging_mtx};
+        last_seq = m_free_next_seq - 1;
+    }
+    m_free_pba_store->flush_sync(last_seq < 0 ? homestore::invalid_lsn() : last_seq);
 }
-
-// TODO: PENDING CHECKPOINT AND FLUSH CODE
 } // namespace home_replication
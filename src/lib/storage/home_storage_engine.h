@@ -1,5 +1,11 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <vector>
 #include <homestore/logstore_service.hpp>
 #include <homestore/superblk_handler.hpp>
 #include <iomgr/iomgr.hpp>
@@ -11,7 +17,7 @@ using store_lsn_t = int64_t;
 #pragma pack(1)
 struct home_rs_superblk {
     static constexpr uint64_t REPLICA_SET_SB_MAGIC = 0xABCDF00D;
-    static constexpr uint32_t REPLICA_SET_SB_VERSION = 1;
+    static constexpr uint32_t REPLICA_SET_SB_VERSION = 2;
 
     uint64_t magic{REPLICA_SET_SB_MAGIC};
     uint32_t version{REPLICA_SET_SB_VERSION};
@@ -20,6 +26,7 @@ struct home_rs_superblk {
     homestore::logstore_id_t m_data_journal_id; // Logstore id for the data journal
     repl_lsn_t commit_lsn;                      // LSN upto which this replica has committed
     repl_lsn_t m_checkpoint_lsn;                // LSN upto which this replica have checkpointed the data
+    store_lsn_t free_pba_next_seq;              // Seq num past every batch of free pba records written so far
 
     uint64_t get_magic() const { return magic; }
     uint32_t get_version() const { return version; }
@@ -27,6 +34,8 @@ struct home_rs_superblk {
 #pragma pack()
 
 class HomeStateMachineStore : public StateMachineStore {
+    friend class SuperBlkFlusher;
+
 public:
     HomeStateMachineStore(uuid_t rs_uuid);
     HomeStateMachineStore(const homestore::superblk< home_rs_superblk >& rs_sb);
@@ -38,13 +47,27 @@ public:
      * @brief : API to allocate physical block address(pba) based on input size
      *
      * @param size : io size that is required for allocation
+     * @param hints : placement hints, by default the pbas are carved out in order from an extent reserved for this
+     * replica set, which keeps its data clustered and each io on as few pbas as possible
      *
      * @return : a list of pbas that can fullfill the input size;
      *
      * Note: each pba represents a physical block address that can be used to do write.
      * API "pba_to_size" can be called to know what is the total size that this pba represents;
      */
-    pba_list_t alloc_pbas(uint32_t size) override;
+    pba_list_t alloc_pbas(uint32_t size, const pba_alloc_hints& hints = pba_alloc_hints{}) override;
+
+    /**
+     * @brief : allocate pbas for a batch of ios with a single allocation;
+     *
+     * @param sizes : io size required for each io in the batch
+     * @param hints : placement hints, applied to the batch as a whole
+     *
+     * @return : list of pbas for each io, in the same order as sizes; each io is rounded up to the page size so that
+     * the ios are laid out back to back on the returned pbas;
+     */
+    std::vector< pba_list_t > alloc_pbas(const std::vector< uint32_t >& sizes,
+                                         const pba_alloc_hints& hints = pba_alloc_hints{}) override;
 
     /**
      * @brief : asynchronouswrite API
@@ -72,6 +95,22 @@ public:
      */
     void free_pba(pba_t pba) override;
 
+    /**
+     * @brief : free a list of pbas, adjacent ones are merged and freed together;
+     *
+     * @param pbas : pbas to be freed, in any order;
+     */
+    void free_pbas(const pba_list_t& pbas) override;
+
+    /**
+     * @brief : merge the pbas which are adjacent on the device, as free_pbas does before freeing them;
+     *
+     * @param pbas : pbas to be merged, in any order;
+     *
+     * @return : merged pbas, ordered by their position on the device;
+     */
+    static pba_list_t merge_adjacent_pbas(const pba_list_t& pbas);
+
     /**
      * @brief : get the size of this pba;
      *
@@ -87,6 +126,14 @@ public:
     ////////////////// State machine and free pba persistence ///////////////////
     void commit_lsn(repl_lsn_t lsn) override;
     repl_lsn_t get_last_commit_lsn() const override;
+
+    /**
+     * @brief : persist the lsn upto which the free pba records are processed, synchronously;
+     *
+     * @param lsn : lsn upto (and including) which the pbas of free pba records are freed
+     */
+    void checkpoint_lsn(repl_lsn_t lsn) override;
+    repl_lsn_t get_checkpoint_lsn() const override;
     void add_free_pba_record(repl_lsn_t lsn, const pba_list_t& pbas) override;
     void get_free_pba_records(repl_lsn_t start_lsn, repl_lsn_t end_lsn,
                               const std::function< void(repl_lsn_t, const pba_list_t&) >& cb) override;
@@ -94,19 +141,48 @@ public:
     void flush_free_pba_records() override;
 
 private:
+    // Extent reserved for the allocations of one size class of this replica set, which are carved out of it in order
+    struct pba_stream {
+        pba_list_t extent;          // Blks of the extent as allocated
+        size_t cur{0};              // Blk of the extent being carved out
+        uint32_t consumed_nblks{0}; // Number of blks of the current one already carved out
+        uint32_t remaining_nblks{0};
+    };
+
+    pba_list_t alloc_blks(uint32_t nblks, const pba_alloc_hints& hints);
+    void release_pba_streams();
+    void persist_free_pba_records();
+    void on_free_pba_batch_found(store_lsn_t seq, const homestore::log_buffer& buf);
     void on_store_created(std::shared_ptr< homestore::HomeLogStore > log_store);
-    void start_sb_flush_timer();
-    void stop_sb_flush_timer();
+    void start_sb_flush();
+    void stop_sb_flush();
+    void mark_sb_dirty();
     void flush_super_block();
+    void persist_super_block(bool force);
 
 private:
     std::shared_ptr< homestore::HomeLogStore > m_free_pba_store; // Logstore for storing free pba records
     homestore::superblk< home_rs_superblk > m_sb;                // Superblk where we store the state machine etc
-    mutable folly::SharedMutexWritePriority m_sb_lock;           // Lock to protect staged sb and persisting sb
-    home_rs_superblk m_sb_in_mem;                                // Cached version which is used to read and for staging
-    std::atomic< repl_lsn_t > m_last_write_lsn{0};               // LSN which was lastly written, to track flushes
-    repl_lsn_t m_last_flushed_commit_lsn{0};
-    iomgr::timer_handle_t m_sb_flush_timer_hdl;
+    std::mutex m_sb_write_mtx;                                   // Serializes persisting the superblk
+    home_rs_superblk m_sb_in_mem;                                // Cached version of the fields which never change
+    std::atomic< repl_lsn_t > m_commit_lsn{0};                   // Staged commit lsn, updated without any lock
+    std::atomic< repl_lsn_t > m_checkpoint_lsn{0};               // Staged checkpoint lsn
+    repl_lsn_t m_last_flushed_commit_lsn{0};                     // Protected by m_sb_write_mtx
+    std::atomic< bool > m_sb_dirty{false};                       // Queued to the flusher since its last pass
+    bool m_sb_flush_started{false};
+
+    std::mutex m_stream_mtx;
+    std::array< pba_stream, pba_alloc_hints::max_size_classes > m_streams;
+
+    std::mutex m_free_staging_mtx;
+    std::vector< std::pair< repl_lsn_t, pba_list_t > > m_free_staging; // Free pba records yet to be persisted
+    uint64_t m_free_staging_size{0};                                   // Serialized size of the staged records
+    std::atomic< repl_lsn_t > m_free_truncated_lsn{0}; // Records upto this lsn are removed, though not yet physically
+
+    // Every batch of free pba records is written at a seq num of its own, in the order the batches are taken out of
+    // staging, and is truncated once the highest lsn of it and of every batch before it is removed
+    store_lsn_t m_free_next_seq{0};                                    // Protected by m_free_staging_mtx
+    std::deque< std::pair< store_lsn_t, repl_lsn_t > > m_free_batches; // Seq num and highest lsn of every batch
 };
 
 } // namespace home_replication
@@ -11,13 +11,26 @@ namespace home_replication {
 typedef std::function< void(std::error_condition) > io_completion_cb_t;
 using repl_lsn_t = int64_t;
 
+// Hints of the caller on where the pbas it allocates are to be placed
+struct pba_alloc_hints {
+    static constexpr uint8_t max_size_classes{4};
+    static constexpr uint8_t bulk_size_class{1}; // Data written in bulk, such as that of an installed snapshot
+
+    bool same_stream{true};       // Place next to the previous allocations of this replica set
+    bool prefer_contiguous{true}; // Prefer a single pba for the entire size over pieces spread across the free space
+    uint8_t size_class{0};        // Allocations of different classes (eg. by lifetime of the data) are kept apart
+};
+
 class StateMachineStore {
 public:
     ////////////// Storage Writes of Data Blocks ///////////////////////
-    virtual pba_list_t alloc_pbas(uint32_t size) = 0;
+    virtual pba_list_t alloc_pbas(uint32_t size, const pba_alloc_hints& hints = pba_alloc_hints{}) = 0;
+    virtual std::vector< pba_list_t > alloc_pbas(const std::vector< uint32_t >& sizes,
+                                                 const pba_alloc_hints& hints = pba_alloc_hints{}) = 0;
     virtual void async_write(const sisl::sg_list& sgs, const pba_list_t& in_pbas, const io_completion_cb_t& cb) = 0;
     virtual void async_read(pba_t pba, sisl::sg_list& sgs, uint32_t size, const io_completion_cb_t& cb) = 0;
     virtual void free_pba(pba_t pba) = 0;
+    virtual void free_pbas(const pba_list_t& pbas) = 0;
     virtual uint32_t pba_to_size(pba_t pba) const = 0;
 
     //////////////////// Control operations ///////////////////////////////
@@ -26,6 +39,8 @@ public:
     ////////////////// State machine and free pba persistence ///////////////////
     virtual void commit_lsn(repl_lsn_t lsn) = 0;
     virtual repl_lsn_t get_last_commit_lsn() const = 0;
+    virtual void checkpoint_lsn(repl_lsn_t lsn) = 0;
+    virtual repl_lsn_t get_checkpoint_lsn() const = 0;
     virtual void add_free_pba_record(repl_lsn_t lsn, const pba_list_t& pbas) = 0;
     virtual void get_free_pba_records(repl_lsn_t from_lsn, repl_lsn_t to_lsn,
                                       const std::function< void(repl_lsn_t lsn, const pba_list_t& pba) >& cb) = 0;
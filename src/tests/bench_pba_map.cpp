@@ -0,0 +1,81 @@
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <folly/concurrency/ConcurrentHashMap.h>
+
+#include "state_machine/pba_map.h"
+
+using namespace home_replication;
+
+SISL_LOGGING_INIT(HOMEREPL_LOG_MODS)
+
+// Compares the former string keyed pba map against the fixed width key index, on the operations the follower runs per
+// remote pba: insert on map, lookup on state update/fetch.
+struct string_keyed {
+    using map_t = folly::ConcurrentHashMap< std::string, uint64_t >;
+    static std::string key(const fully_qualified_pba& fq_pba) { return fq_pba.to_key_string(); }
+};
+
+struct binary_keyed {
+    using map_t = fq_pba_map_t< uint64_t >;
+    static fq_pba_key key(const fully_qualified_pba& fq_pba) { return fq_pba_key{fq_pba}; }
+};
+
+static std::vector< fully_qualified_pba > generate_pbas(size_t count) {
+    std::mt19937_64 re{0xbadc0ffee};
+    std::uniform_int_distribution< uint32_t > server_gen{1, 3};
+    std::uniform_int_distribution< pba_t > pba_gen{0, (1ul << 48)};
+
+    std::vector< fully_qualified_pba > pbas;
+    pbas.reserve(count);
+    for (size_t i{0}; i < count; ++i) {
+        pbas.emplace_back(server_gen(re), pba_gen(re), 4096);
+    }
+    return pbas;
+}
+
+template < typename T >
+static void BM_insert(benchmark::State& state) {
+    auto const pbas = generate_pbas(state.range(0));
+    for (auto _ : state) {
+        typename T::map_t map;
+        for (const auto& fq_pba : pbas) {
+            map.insert(T::key(fq_pba), fq_pba.pba);
+        }
+        benchmark::DoNotOptimize(map.size());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template < typename T >
+static void BM_lookup(benchmark::State& state) {
+    static std::unique_ptr< typename T::map_t > s_map;
+    static std::vector< fully_qualified_pba > s_pbas;
+    if (state.thread_index() == 0) {
+        s_pbas = generate_pbas(state.range(0));
+        s_map = std::make_unique< typename T::map_t >();
+        for (const auto& fq_pba : s_pbas) {
+            s_map->insert(T::key(fq_pba), fq_pba.pba);
+        }
+    }
+
+    size_t idx = state.thread_index();
+    for (auto _ : state) {
+        auto const it = s_map->find(T::key(s_pbas[idx % s_pbas.size()]));
+        benchmark::DoNotOptimize(it->second);
+        idx += 7;
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0) { s_map.reset(); }
+}
+
+BENCHMARK_TEMPLATE(BM_insert, string_keyed)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(BM_insert, binary_keyed)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(BM_lookup, string_keyed)->Arg(1 << 16)->ThreadRange(1, 8);
+BENCHMARK_TEMPLATE(BM_lookup, binary_keyed)->Arg(1 << 16)->ThreadRange(1, 8);
+
+BENCHMARK_MAIN();
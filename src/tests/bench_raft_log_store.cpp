@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <iomgr/io_environment.hpp>
+#include <homestore/homestore.hpp>
+#include <sisl/options/options.h>
+
+#include <home_replication/repl_decls.h>
+#include "log_store/home_raft_log_store.h"
+
+using namespace home_replication;
+
+SISL_LOGGING_INIT(HOMEREPL_LOG_MODS)
+
+SISL_OPTIONS_ENABLE(logging, bench_raft_log_store)
+SISL_OPTION_GROUP(bench_raft_log_store,
+                  (num_threads, "", "num_threads", "number of threads",
+                   ::cxxopts::value< uint32_t >()->default_value("2"), "number"),
+                  (num_devs, "", "num_devs", "number of devices to create",
+                   ::cxxopts::value< uint32_t >()->default_value("2"), "number"),
+                  (dev_size_mb, "", "dev_size_mb", "size of each device in MB",
+                   ::cxxopts::value< uint64_t >()->default_value("2048"), "number"),
+                  (num_entries, "", "num_entries", "number of entries in the log to catch up on",
+                   ::cxxopts::value< uint32_t >()->default_value("1000000"), "number"),
+                  (entry_size, "", "entry_size", "size of each log entry in bytes",
+                   ::cxxopts::value< uint32_t >()->default_value("128"), "number"));
+
+static const std::string s_fpath_root{"/tmp/bench_raft_log_store"};
+
+static void remove_files(uint32_t ndevices) {
+    for (uint32_t i{0}; i < ndevices; ++i) {
+        const std::string fpath{s_fpath_root + std::to_string(i + 1)};
+        if (std::filesystem::exists(fpath)) { std::filesystem::remove(fpath); }
+    }
+}
+
+static void init_files(uint32_t ndevices, uint64_t dev_size) {
+    remove_files(ndevices);
+    for (uint32_t i{0}; i < ndevices; ++i) {
+        const std::string fpath{s_fpath_root + std::to_string(i + 1)};
+        std::ofstream ofs{fpath, std::ios::binary | std::ios::out | std::ios::trunc};
+        std::filesystem::resize_file(fpath, dev_size);
+    }
+}
+
+// Leader side of a follower catching up: the log is read in batches of append entries through log_entries(), for the
+// entries which are framed in place by their producer (read back whole, framing included) and for the ones serialized
+// by the log store (read back past the framing). Either is copied once out of the log buffer.
+static std::unique_ptr< HomeRaftLogStore > s_framed_store;
+static std::unique_ptr< HomeRaftLogStore > s_serialized_store;
+
+static void fill_store(HomeRaftLogStore& store, bool framed) {
+    auto const num_entries = SISL_OPTIONS["num_entries"].as< uint32_t >();
+    auto const entry_size = SISL_OPTIONS["entry_size"].as< uint32_t >();
+    if (framed) { store.enable_inline_framing(); }
+    for (uint32_t i{0}; i < num_entries; ++i) {
+        auto buf = nuraft::buffer::alloc(entry_size);
+        std::memset(buf->data_begin(), 0xab, entry_size);
+        auto le = nuraft::cs_new< nuraft::log_entry >(1 /* term */, buf);
+        store.append(le);
+    }
+    store.flush();
+}
+
+static void BM_catch_up(benchmark::State& state, HomeRaftLogStore* store) {
+    auto const batch = uint64_cast(state.range(0));
+    auto const end = store->next_slot();
+    uint64_t nbytes{0};
+    for (auto _ : state) {
+        for (auto start = store->start_index(); start < end; start += batch) {
+            auto const entries = store->log_entries(start, std::min(start + batch, end));
+            for (const auto& le : *entries) {
+                nbytes += le->get_buf().size();
+            }
+            benchmark::DoNotOptimize(entries);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * (end - store->start_index()));
+    state.SetBytesProcessed(nbytes);
+}
+
+static void start_homestore() {
+    auto const ndevices = SISL_OPTIONS["num_devs"].as< uint32_t >();
+    auto const dev_size = SISL_OPTIONS["dev_size_mb"].as< uint64_t >() * 1024 * 1024;
+    init_files(ndevices, dev_size);
+
+    std::vector< homestore::dev_info > device_info;
+    for (uint32_t i{0}; i < ndevices; ++i) {
+        const std::filesystem::path fpath{s_fpath_root + std::to_string(i + 1)};
+        device_info.emplace_back(std::filesystem::canonical(fpath).string(), homestore::HSDevType::Data);
+    }
+    ioenvironment.with_iomgr(SISL_OPTIONS["num_threads"].as< uint32_t >(), false);
+
+    homestore::hs_input_params params;
+    params.app_mem_size = ((ndevices * dev_size) * 15) / 100;
+    params.data_devices = device_info;
+    homestore::HomeStore::instance()
+        ->with_params(params)
+        .with_meta_service(5.0)
+        .with_log_service(80.0, 5.0)
+        .init(true /* wait_for_init */);
+}
+
+static void shutdown_homestore() {
+    homestore::HomeStore::instance()->shutdown();
+    homestore::HomeStore::reset_instance();
+    iomanager.stop();
+    remove_files(SISL_OPTIONS["num_devs"].as< uint32_t >());
+}
+
+int main(int argc, char* argv[]) {
+    ::benchmark::Initialize(&argc, argv);
+    SISL_OPTIONS_LOAD(argc, argv, logging, bench_raft_log_store);
+    sisl::logging::SetLogger("bench_raft_log_store");
+    spdlog::set_pattern("[%D %T%z] [%^%l%$] [%t] %v");
+
+    start_homestore();
+    s_framed_store = std::make_unique< HomeRaftLogStore >();
+    s_framed_store->create_store();
+    s_serialized_store = std::make_unique< HomeRaftLogStore >();
+    s_serialized_store->create_store();
+
+    LOGINFO("Filling the log stores with {} entries each", SISL_OPTIONS["num_entries"].as< uint32_t >());
+    fill_store(*s_framed_store, true /* framed */);
+    fill_store(*s_serialized_store, false /* framed */);
+
+    ::benchmark::RegisterBenchmark("BM_catch_up/framed", BM_catch_up, s_framed_store.get())
+        ->RangeMultiplier(10)
+        ->Range(10, 1000)
+        ->Unit(benchmark::kMillisecond);
+    ::benchmark::RegisterBenchmark("BM_catch_up/serialized", BM_catch_up, s_serialized_store.get())
+        ->RangeMultiplier(10)
+        ->Range(10, 1000)
+        ->Unit(benchmark::kMillisecond);
+    ::benchmark::RunSpecifiedBenchmarks();
+    ::benchmark::Shutdown();
+
+    s_framed_store.reset();
+    s_serialized_store.reset();
+    shutdown_homestore();
+    return 0;
+}
@@ -0,0 +1,583 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/uuid/uuid_generators.hpp>
+#include <boost/uuid/uuid_io.hpp>
+#include <folly/executors/CPUThreadPoolExecutor.h>
+#include <iomgr/io_environment.hpp>
+#include <homestore/homestore.hpp>
+#include <homestore/blkdata_service.hpp>
+#include <sisl/options/options.h>
+
+#include <home_replication/repl_decls.h>
+#include <home_replication/repl_service.h>
+#include "log_store/repl_log_store.hpp"
+#include "log_store/home_raft_log_store.h"
+#include "state_machine/state_machine.h"
+#include "state_machine/rpc_data_channel.h"
+#include "storage/home_storage_engine.h"
+
+using namespace home_replication;
+
+SISL_LOGGING_INIT(HOMEREPL_LOG_MODS)
+
+SISL_OPTIONS_ENABLE(logging, bench_replication)
+SISL_OPTION_GROUP(bench_replication,
+                  (num_threads, "", "num_threads", "number of iomgr threads",
+                   ::cxxopts::value< uint32_t >()->default_value("4"), "number"),
+                  (num_net_threads, "", "num_net_threads", "number of threads delivering messages between replicas",
+                   ::cxxopts::value< uint32_t >()->default_value("4"), "number"),
+                  (num_devs, "", "num_devs", "number of devices to create",
+                   ::cxxopts::value< uint32_t >()->default_value("2"), "number"),
+                  (dev_size_mb, "", "dev_size_mb", "size of each device in MB",
+                   ::cxxopts::value< uint64_t >()->default_value("4096"), "number"),
+                  (device_list, "", "device_list", "Device List instead of default created",
+                   ::cxxopts::value< std::vector< std::string > >(), "path [...]"),
+                  (obj_size_kb, "", "obj_size_kb", "size of each object written in KB",
+                   ::cxxopts::value< uint32_t >()->default_value("4"), "number"),
+                  (batch_size, "", "batch_size", "number of objects in each write, >1 uses write_batch",
+                   ::cxxopts::value< uint32_t >()->default_value("1"), "number"),
+                  (concurrency, "", "concurrency", "number of writes outstanding at any time",
+                   ::cxxopts::value< uint32_t >()->default_value("32"), "number"),
+                  (run_time_secs, "", "run_time_secs", "duration of the run in seconds",
+                   ::cxxopts::value< uint32_t >()->default_value("30"), "number"));
+
+static constexpr int32_t num_replicas{3};
+static const std::string s_fpath_root{"/tmp/bench_replication"};
+
+static void remove_files(uint32_t ndevices) {
+    for (uint32_t i{0}; i < ndevices; ++i) {
+        const std::string fpath{s_fpath_root + std::to_string(i + 1)};
+        if (std::filesystem::exists(fpath)) { std::filesystem::remove(fpath); }
+    }
+}
+
+static void init_files(uint32_t ndevices, uint64_t dev_size) {
+    remove_files(ndevices);
+    for (uint32_t i{0}; i < ndevices; ++i) {
+        const std::string fpath{s_fpath_root + std::to_string(i + 1)};
+        std::ofstream ofs{fpath, std::ios::binary | std::ios::out | std::ios::trunc};
+        std::filesystem::resize_file(fpath, dev_size);
+    }
+}
+
+static std::string to_endpoint(int32_t id) { return fmt::format("replica_{}", id); }
+
+static sisl::io_blob flatten(const nuraft_mesg::io_blob_list_t& bufs) {
+    uint32_t size{0};
+    for (const auto& b : bufs) {
+        size += b.size;
+    }
+    if (size == 0) { return sisl::io_blob{}; }
+
+    sisl::io_blob out{size, 0 /* unaligned */};
+    uint8_t* cur = out.bytes;
+    for (const auto& b : bufs) {
+        std::memcpy(cur, b.bytes, b.size);
+        cur += b.size;
+    }
+    return out;
+}
+
+class BenchReplicaSet;
+
+// In-process stand-in of the nuraft_mesg transport between the replicas of the group. Raft messages and data channel
+// rpcs are delivered on a pool of network threads, similar to the grpc threads of the real transport. Buffers are
+// copied on delivery, so that no replica shares memory with another, as if it were serialized on the wire.
+class LocalNetwork {
+public:
+    explicit LocalNetwork(uint32_t nthreads) : m_executor{nthreads} {}
+
+    void join(const std::string& endpoint, BenchReplicaSet* rs) {
+        std::unique_lock lg(m_mtx);
+        m_members[endpoint].rs = rs;
+    }
+
+    void listen(const std::string& endpoint, const nuraft::ptr< nuraft::msg_handler >& handler) {
+        std::unique_lock lg(m_mtx);
+        m_members[endpoint].handler = handler;
+    }
+
+    void leave(const std::string& endpoint) {
+        std::unique_lock lg(m_mtx);
+        m_members.erase(endpoint);
+    }
+
+    void stop() { m_executor.join(); }
+
+    void send_raft_msg(const std::string& endpoint, nuraft::ptr< nuraft::req_msg > req, nuraft::rpc_handler when_done);
+
+    void send_data_rpc(const std::string& from, const std::string& rpc_name, const nuraft_mesg::io_blob_list_t& cli_buf,
+                       const nuraft_mesg::data_service_response_handler_t& response_cb);
+
+private:
+    struct member {
+        BenchReplicaSet* rs{nullptr};
+        nuraft::ptr< nuraft::msg_handler > handler;
+    };
+
+    folly::CPUThreadPoolExecutor m_executor;
+    std::mutex m_mtx;
+    std::map< std::string, member > m_members;
+};
+
+class LocalRpcClient : public nuraft::rpc_client {
+public:
+    LocalRpcClient(LocalNetwork& net, const std::string& endpoint) :
+            m_net{net}, m_endpoint{endpoint}, m_id{s_next_id.fetch_add(1)} {}
+
+    void send(nuraft::ptr< nuraft::req_msg >& req, nuraft::rpc_handler& when_done, uint64_t) override {
+        m_net.send_raft_msg(m_endpoint, req, when_done);
+    }
+    uint64_t get_id() const override { return m_id; }
+    bool is_abandoned() const override { return false; }
+
+private:
+    static inline std::atomic< uint64_t > s_next_id{1};
+    LocalNetwork& m_net;
+    std::string m_endpoint;
+    uint64_t m_id;
+};
+
+class LocalRpcClientFactory : public nuraft::rpc_client_factory {
+public:
+    explicit LocalRpcClientFactory(LocalNetwork& net) : m_net{net} {}
+    nuraft::ptr< nuraft::rpc_client > create_client(const std::string& endpoint) override {
+        return nuraft::cs_new< LocalRpcClient >(m_net, endpoint);
+    }
+
+private:
+    LocalNetwork& m_net;
+};
+
+class LocalRpcListener : public nuraft::rpc_listener {
+public:
+    LocalRpcListener(LocalNetwork& net, const std::string& endpoint) : m_net{net}, m_endpoint{endpoint} {}
+    void listen(nuraft::ptr< nuraft::msg_handler >& handler) override { m_net.listen(m_endpoint, handler); }
+    void stop() override { m_net.leave(m_endpoint); }
+
+private:
+    LocalNetwork& m_net;
+    std::string m_endpoint;
+};
+
+// Replica set whose raft state is kept in memory and which talks to its peers through the LocalNetwork
+class BenchReplicaSet : public ReplicaSet {
+public:
+    BenchReplicaSet(int32_t id, const std::string& group_id, const std::shared_ptr< HomeStateMachineStore >& sm_store,
+                    LocalNetwork& net) :
+            ReplicaSet{group_id, sm_store, std::make_shared< ReplicaLogStore< HomeRaftLogStore > >()},
+            m_id{id},
+            m_sm_store{sm_store},
+            m_net{net} {
+        r_cast< ReplicaLogStore< HomeRaftLogStore >* >(data_journal().get())->attach_replica_set(this);
+        m_net.join(to_endpoint(m_id), this);
+    }
+
+    void start(const std::shared_ptr< BenchReplicaSet >& self,
+               const nuraft::ptr< nuraft::delayed_task_scheduler >& scheduler) {
+        nuraft::ptr< nuraft::state_mgr > mgr = self;
+        nuraft::ptr< nuraft::state_machine > sm = get_state_machine();
+        nuraft::ptr< nuraft::rpc_listener > listener = nuraft::cs_new< LocalRpcListener >(m_net, to_endpoint(m_id));
+        nuraft::ptr< nuraft::logger > logger;
+        nuraft::ptr< nuraft::rpc_client_factory > factory = nuraft::cs_new< LocalRpcClientFactory >(m_net);
+        nuraft::ptr< nuraft::delayed_task_scheduler > sched = scheduler;
+        auto* ctx = new nuraft::context(mgr, sm, listener, logger, factory, sched, ReplicationService::raft_params());
+        m_raft = nuraft::cs_new< nuraft::raft_server >(ctx);
+
+        nuraft::ptr< nuraft::msg_handler > handler = m_raft;
+        listener->listen(handler);
+    }
+
+    void stop() {
+        m_net.leave(to_endpoint(m_id));
+        if (m_raft) { m_raft->shutdown(); }
+        m_raft.reset();
+    }
+
+    void attach(std::unique_ptr< ReplicaSetListener > listener) { attach_listener(std::move(listener)); }
+
+    ReplicaStateMachine* state_machine() { return dynamic_cast< ReplicaStateMachine* >(get_state_machine().get()); }
+    const std::shared_ptr< HomeStateMachineStore >& sm_store() const { return m_sm_store; }
+
+    nuraft::raft_server* raft_server() override { return m_raft.get(); }
+
+protected:
+    void send_data_service_request(const std::string& request_name, const nuraft_mesg::io_blob_list_t& cli_buf,
+                                   const nuraft_mesg::data_service_response_handler_t& response_cb) override {
+        m_net.send_data_rpc(to_endpoint(m_id), request_name, cli_buf, response_cb);
+    }
+
+private:
+    nuraft::ptr< nuraft::cluster_config > load_config() override {
+        std::unique_lock lg(m_state_mtx);
+        if (!m_config) {
+            // Replica 1 is preferred as the leader, so that every run measures the same replica
+            m_config = nuraft::cs_new< nuraft::cluster_config >();
+            for (int32_t id{1}; id <= num_replicas; ++id) {
+                m_config->get_servers().push_back(nuraft::cs_new< nuraft::srv_config >(
+                    id, 0 /* dc_id */, to_endpoint(id), "" /* aux */, false /* learner */, (id == 1) ? 100 : 1));
+            }
+        }
+        return m_config;
+    }
+    void save_config(const nuraft::cluster_config& config) override {
+        std::unique_lock lg(m_state_mtx);
+        m_config = nuraft::cluster_config::deserialize(*config.serialize());
+    }
+    void save_state(const nuraft::srv_state& state) override {
+        std::unique_lock lg(m_state_mtx);
+        m_state = nuraft::srv_state::deserialize(*state.serialize());
+    }
+    nuraft::ptr< nuraft::srv_state > read_state() override {
+        std::unique_lock lg(m_state_mtx);
+        return m_state;
+    }
+    nuraft::ptr< nuraft::log_store > load_log_store() override { return data_journal(); }
+    int32_t server_id() override { return m_id; }
+
+private:
+    int32_t m_id;
+    std::shared_ptr< HomeStateMachineStore > m_sm_store;
+    LocalNetwork& m_net;
+    nuraft::ptr< nuraft::raft_server > m_raft;
+
+    std::mutex m_state_mtx;
+    nuraft::ptr< nuraft::cluster_config > m_config;
+    nuraft::ptr< nuraft::srv_state > m_state;
+};
+
+void LocalNetwork::send_raft_msg(const std::string& endpoint, nuraft::ptr< nuraft::req_msg > req,
+                                 nuraft::rpc_handler when_done) {
+    // Log entries are cloned, as each replica frames and persists the entry buffer in place
+    auto msg = nuraft::cs_new< nuraft::req_msg >(req->get_term(), req->get_type(), req->get_src(), req->get_dst(),
+                                                 req->get_last_log_term(), req->get_last_log_idx(),
+                                                 req->get_commit_idx());
+    for (const auto& le : req->log_entries()) {
+        msg->log_entries().push_back(nuraft::cs_new< nuraft::log_entry >(
+            le->get_term(), nuraft::buffer::clone(le->get_buf()), le->get_val_type()));
+    }
+
+    m_executor.add([this, endpoint, msg, when_done = std::move(when_done)]() mutable {
+        nuraft::ptr< nuraft::msg_handler > handler;
+        {
+            std::unique_lock lg(m_mtx);
+            auto it = m_members.find(endpoint);
+            if (it != m_members.end()) { handler = it->second.handler; }
+        }
+
+        nuraft::ptr< nuraft::resp_msg > resp;
+        nuraft::ptr< nuraft::rpc_exception > err;
+        if (handler) { resp = handler->process_req(*msg); }
+        if (!resp) { err = nuraft::cs_new< nuraft::rpc_exception >(fmt::format("{} is unreachable", endpoint), msg); }
+        when_done(resp, err);
+    });
+}
+
+void LocalNetwork::send_data_rpc(const std::string& from, const std::string& rpc_name,
+                                 const nuraft_mesg::io_blob_list_t& cli_buf,
+                                 const nuraft_mesg::data_service_response_handler_t& response_cb) {
+    std::vector< BenchReplicaSet* > peers;
+    {
+        std::unique_lock lg(m_mtx);
+        for (const auto& [endpoint, m] : m_members) {
+            if ((endpoint != from) && (m.rs != nullptr)) { peers.push_back(m.rs); }
+        }
+    }
+
+    for (auto* peer : peers) {
+        // Receiver holds on to the incoming buffer till it responds, same as the rpc data of the real transport
+        auto incoming = flatten(cli_buf);
+        m_executor.add([peer, rpc_name, incoming, response_cb]() {
+            auto respond = [incoming, response_cb](const nuraft_mesg::io_blob_list_t& out_bufs) {
+                auto response = flatten(out_bufs);
+                response_cb(response);
+                if (response.size) { response.buf_free(); }
+                if (incoming.size) { incoming.buf_free(); }
+            };
+
+            if (rpc_name == SEND_PBAS_RPC_NAME) {
+                peer->state_machine()->on_push_data_received(incoming, std::move(respond));
+            } else if (rpc_name == FETCH_PBAS_RPC_NAME) {
+                peer->state_machine()->on_fetch_data_request(incoming, std::move(respond));
+            } else {
+                LOGERROR("Unknown data service request={}", rpc_name);
+                respond(nuraft_mesg::io_blob_list_t{});
+            }
+        });
+    }
+}
+
+// Writes are issued from a fixed number of slots, each having one write (of batch_size objects) outstanding at any
+// time. Commit latency of a write is the time from the write till all its objects are committed in the leader.
+class ReplicationBench {
+public:
+    ReplicationBench() :
+            m_obj_size{SISL_OPTIONS["obj_size_kb"].as< uint32_t >() * 1024},
+            m_batch_size{std::max(SISL_OPTIONS["batch_size"].as< uint32_t >(), 1u)},
+            m_net{SISL_OPTIONS["num_net_threads"].as< uint32_t >()},
+            m_client_executor{1} {}
+
+    void start() {
+        boost::uuids::random_generator gen;
+        auto const group_id = boost::uuids::to_string(gen());
+
+        nuraft::asio_service_options asio_opts;
+        asio_opts.thread_pool_size_ = 2;
+        m_scheduler = nuraft::cs_new< nuraft::asio_service >(asio_opts);
+
+        for (int32_t id{1}; id <= num_replicas; ++id) {
+            auto sm_store = std::make_shared< HomeStateMachineStore >(gen());
+            auto rs = std::make_shared< BenchReplicaSet >(id, group_id, sm_store, m_net);
+            rs->attach(std::make_unique< Listener >(this, rs.get()));
+            m_replicas.push_back(std::move(rs));
+        }
+        for (const auto& rs : m_replicas) {
+            rs->start(rs, m_scheduler);
+        }
+
+        LOGINFO("Waiting for {} to become the leader", to_endpoint(1));
+        while (!m_replicas[0]->is_leader()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds{100});
+        }
+        m_leader = m_replicas[0].get();
+    }
+
+    void run() {
+        auto const concurrency = std::max(SISL_OPTIONS["concurrency"].as< uint32_t >(), 1u);
+        auto const run_time = std::chrono::seconds{SISL_OPTIONS["run_time_secs"].as< uint32_t >()};
+        LOGINFO("Running for {} secs with obj_size={} batch_size={} concurrency={}", run_time.count(), m_obj_size,
+                m_batch_size, concurrency);
+
+        m_slots.reserve(concurrency);
+        for (uint32_t i{0}; i < concurrency; ++i) {
+            m_slots.push_back(std::make_unique< slot >(this));
+        }
+
+        m_outstanding.store(concurrency);
+        m_start_time = Clock::now();
+        for (auto& s : m_slots) {
+            issue(*s);
+        }
+
+        std::this_thread::sleep_for(run_time);
+        m_stopping.store(true);
+
+        std::unique_lock lg(m_done_mtx);
+        m_done_cv.wait(lg, [this] { return m_outstanding.load() == 0; });
+        m_run_time_us = get_elapsed_time_us(m_start_time);
+    }
+
+    void report() const {
+        std::vector< uint64_t > latencies;
+        for (const auto& s : m_slots) {
+            latencies.insert(latencies.end(), s->latencies_us.begin(), s->latencies_us.end());
+        }
+        std::sort(latencies.begin(), latencies.end());
+
+        auto const percentile = [&latencies](double p) -> uint64_t {
+            if (latencies.empty()) { return 0; }
+            return latencies[std::min(latencies.size() - 1, s_cast< size_t >(p * latencies.size()))];
+        };
+
+        auto const secs = s_cast< double >(m_run_time_us) / 1000000;
+        auto const nobjs = latencies.size() * m_batch_size;
+        LOGINFO("Committed {} objects in {:.2f} secs: {:.0f} ops/s, {:.2f} MB/s, commit latency us p50={} p99={} "
+                "p999={}",
+                nobjs, secs, nobjs / secs, (s_cast< double >(nobjs) * m_obj_size) / (1024 * 1024) / secs,
+                percentile(0.50), percentile(0.99), percentile(0.999));
+    }
+
+    void stop() {
+        for (const auto& rs : m_replicas) {
+            rs->stop();
+        }
+        m_client_executor.join();
+        m_net.stop();
+        m_scheduler->stop();
+        for (const auto& rs : m_replicas) {
+            rs->sm_store()->destroy();
+        }
+        m_replicas.clear();
+        m_slots.clear();
+    }
+
+private:
+    struct slot {
+        explicit slot(ReplicationBench* b) : bench{b}, keys(b->m_batch_size), objs(b->m_batch_size) {
+            std::mt19937_64 re{std::random_device{}()};
+            for (uint32_t i{0}; i < bench->m_batch_size; ++i) {
+                auto* buf = iomanager.iobuf_alloc(512, bench->m_obj_size);
+                std::generate_n(r_cast< uint64_t* >(buf), bench->m_obj_size / sizeof(uint64_t), re);
+                objs[i].key = sisl::blob{r_cast< uint8_t* >(&keys[i]), sizeof(uint64_t)};
+                objs[i].header = objs[i].key;
+                objs[i].value.size = bench->m_obj_size;
+                objs[i].value.iovs.emplace_back(iovec{buf, bench->m_obj_size});
+                objs[i].user_ctx = this;
+            }
+        }
+
+        ~slot() {
+            for (auto& obj : objs) {
+                iomanager.iobuf_free(r_cast< uint8_t* >(obj.value.iovs[0].iov_base));
+            }
+        }
+
+        ReplicationBench* bench;
+        std::vector< uint64_t > keys;
+        std::vector< ReplicaSet::write_obj > objs;
+        std::atomic< uint32_t > pending{0};
+        Clock::time_point issue_time;
+        std::vector< uint64_t > latencies_us;
+    };
+
+    class Listener : public ReplicaSetListener {
+    public:
+        Listener(ReplicationBench* bench, BenchReplicaSet* rs) : m_bench{bench}, m_rs{rs} {}
+
+        void on_commit(int64_t, const sisl::blob&, const sisl::blob&, const pba_list_t& pbas, void* ctx) override {
+            // Blocks are released right away to keep the working set bounded over long runs
+            for (auto const pba : pbas) {
+                m_rs->sm_store()->free_pba(pba);
+            }
+            if (ctx) { m_bench->on_obj_committed(*r_cast< slot* >(ctx)); }
+        }
+        void on_pre_commit(int64_t, const sisl::blob&, const sisl::blob&, void*) override {}
+        void on_rollback(int64_t, const sisl::blob&, const sisl::blob&, void*) override {}
+        // Blocks are freed on commit, so there is nothing owned to be snapshotted
+        void on_snapshot_create(int64_t, std::vector< uint8_t >&, std::vector< pba_t >&) override {}
+        void on_snapshot_install(int64_t, const sisl::blob&,
+                                 const std::vector< std::pair< pba_t, pba_list_t > >& pba_map) override {
+            for (const auto& [remote_pba, local_pbas] : pba_map) {
+                for (auto const pba : local_pbas) {
+                    m_rs->sm_store()->free_pba(pba);
+                }
+            }
+        }
+        void on_replica_stop() override {}
+
+    private:
+        ReplicationBench* m_bench;
+        BenchReplicaSet* m_rs;
+    };
+
+    void issue(slot& s) {
+        s.pending.store(m_batch_size);
+        for (auto& key : s.keys) {
+            key = m_next_key.fetch_add(1);
+        }
+
+        s.issue_time = Clock::now();
+        if (m_batch_size == 1) {
+            auto const& obj = s.objs[0];
+            m_leader->write(obj.header, obj.key, obj.value, obj.user_ctx);
+        } else {
+            m_leader->write_batch(s.objs);
+        }
+    }
+
+    void on_obj_committed(slot& s) {
+        if (s.pending.fetch_sub(1) != 1) { return; }
+        s.latencies_us.push_back(get_elapsed_time_us(s.issue_time));
+
+        if (!m_stopping.load()) {
+            // Next write is issued off the commit path, as a client would
+            m_client_executor.add([this, &s]() { issue(s); });
+        } else if (m_outstanding.fetch_sub(1) == 1) {
+            std::unique_lock lg(m_done_mtx);
+            m_done_cv.notify_all();
+        }
+    }
+
+private:
+    uint32_t m_obj_size;
+    uint32_t m_batch_size;
+    LocalNetwork m_net;
+    folly::CPUThreadPoolExecutor m_client_executor;
+    nuraft::ptr< nuraft::asio_service > m_scheduler;
+    std::vector< std::shared_ptr< BenchReplicaSet > > m_replicas;
+    BenchReplicaSet* m_leader{nullptr};
+
+    std::vector< std::unique_ptr< slot > > m_slots;
+    std::atomic< uint64_t > m_next_key{0};
+    std::atomic< bool > m_stopping{false};
+    std::atomic< uint32_t > m_outstanding{0};
+    std::mutex m_done_mtx;
+    std::condition_variable m_done_cv;
+    Clock::time_point m_start_time;
+    uint64_t m_run_time_us{0};
+};
+
+static void start_homestore() {
+    auto const ndevices = SISL_OPTIONS["num_devs"].as< uint32_t >();
+    auto const dev_size = SISL_OPTIONS["dev_size_mb"].as< uint64_t >() * 1024 * 1024;
+    auto const nthreads = SISL_OPTIONS["num_threads"].as< uint32_t >();
+
+    std::vector< homestore::dev_info > device_info;
+    if (SISL_OPTIONS.count("device_list")) {
+        for (const auto& d : SISL_OPTIONS["device_list"].as< std::vector< std::string > >()) {
+            device_info.emplace_back(d, homestore::HSDevType::Data);
+        }
+    } else {
+        LOGINFO("creating {} device files with each of size {} ", ndevices, homestore::in_bytes(dev_size));
+        init_files(ndevices, dev_size);
+        for (uint32_t i{0}; i < ndevices; ++i) {
+            const std::filesystem::path fpath{s_fpath_root + std::to_string(i + 1)};
+            device_info.emplace_back(std::filesystem::canonical(fpath).string(), homestore::HSDevType::Data);
+        }
+    }
+
+    LOGINFO("Starting iomgr with {} threads, spdk: {}", nthreads, false);
+    ioenvironment.with_iomgr(nthreads, false);
+
+    const uint64_t app_mem_size = ((ndevices * dev_size) * 15) / 100;
+    LOGINFO("Initialize and start HomeStore with app_mem_size = {}", homestore::in_bytes(app_mem_size));
+
+    homestore::hs_input_params params;
+    params.app_mem_size = app_mem_size;
+    params.data_devices = device_info;
+    homestore::HomeStore::instance()
+        ->with_params(params)
+        .with_meta_service(5.0)
+        .with_log_service(40.0, 5.0)
+        .with_data_service(40.0)
+        .before_init_devices([]() {
+            homestore::meta_service().register_handler(
+                "replica_set", [](homestore::meta_blk*, sisl::byte_view, size_t) {}, nullptr);
+        })
+        .init(true /* wait_for_init */);
+}
+
+static void shutdown_homestore() {
+    homestore::HomeStore::instance()->shutdown();
+    homestore::HomeStore::reset_instance();
+    iomanager.stop();
+    if (!SISL_OPTIONS.count("device_list")) { remove_files(SISL_OPTIONS["num_devs"].as< uint32_t >()); }
+}
+
+int main(int argc, char* argv[]) {
+    SISL_OPTIONS_LOAD(argc, argv, logging, bench_replication);
+    sisl::logging::SetLogger("bench_replication");
+    spdlog::set_pattern("[%D %T%z] [%^%l%$] [%t] %v");
+
+    start_homestore();
+    {
+        ReplicationBench bench;
+        bench.start();
+        bench.run();
+        bench.report();
+        bench.stop();
+    }
+    shutdown_homestore();
+    return 0;
+}
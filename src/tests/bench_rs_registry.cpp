@@ -0,0 +1,94 @@
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <boost/uuid/random_generator.hpp>
+
+#include "service/uuid_registry.h"
+
+using namespace home_replication;
+
+SISL_LOGGING_INIT(HOMEREPL_LOG_MODS)
+
+// Compares the former mutex guarded map of replica sets against the concurrent registry, on the lookup done to route
+// every request to its replica set, while new replica sets are created concurrently.
+struct dummy_rs {
+    uuid_t uuid;
+};
+
+struct locked_map {
+    using obj_ptr_t = std::shared_ptr< dummy_rs >;
+
+    obj_ptr_t lookup(uuid_t const& uuid) {
+        std::unique_lock lg(m_mtx);
+        auto it = m_map.find(uuid);
+        return (it == m_map.end()) ? nullptr : it->second;
+    }
+
+    std::pair< obj_ptr_t, bool > get_or_create(uuid_t const& uuid, const std::function< obj_ptr_t() >& create_cb) {
+        std::unique_lock lg(m_mtx);
+        auto [it, happened] = m_map.emplace(uuid, nullptr);
+        if (happened) { it->second = create_cb(); }
+        return {it->second, happened};
+    }
+
+    std::mutex m_mtx;
+    std::map< uuid_t, obj_ptr_t > m_map;
+};
+
+using concurrent_registry = UuidRegistry< dummy_rs >;
+
+static std::vector< uuid_t > generate_uuids(size_t count) {
+    boost::uuids::random_generator gen;
+    std::vector< uuid_t > uuids;
+    uuids.reserve(count);
+    for (size_t i{0}; i < count; ++i) {
+        uuids.push_back(gen());
+    }
+    return uuids;
+}
+
+// Thread 0 keeps creating replica sets of its own, every other thread looks up the ones created upfront. Once thread 0
+// has gone through all of its uuids, it keeps asking for them, which then only finds them under the creation lock.
+template < typename T >
+static void BM_lookup_with_creates(benchmark::State& state) {
+    static std::unique_ptr< T > s_registry;
+    static std::vector< uuid_t > s_uuids;
+    static std::vector< uuid_t > s_new_uuids;
+    if (state.thread_index() == 0) {
+        s_uuids = generate_uuids(state.range(0));
+        s_new_uuids = generate_uuids(1 << 20);
+        s_registry = std::make_unique< T >();
+        for (const auto& uuid : s_uuids) {
+            s_registry->get_or_create(uuid, [&uuid]() { return std::make_shared< dummy_rs >(dummy_rs{uuid}); });
+        }
+    }
+
+    size_t idx = state.thread_index();
+    if (state.thread_index() == 0) {
+        for (auto _ : state) {
+            auto const& uuid = s_new_uuids[idx++ % s_new_uuids.size()];
+            auto const rs =
+                s_registry->get_or_create(uuid, [&uuid]() { return std::make_shared< dummy_rs >(dummy_rs{uuid}); });
+            benchmark::DoNotOptimize(rs);
+        }
+    } else {
+        for (auto _ : state) {
+            auto const rs = s_registry->lookup(s_uuids[idx % s_uuids.size()]);
+            benchmark::DoNotOptimize(rs);
+            idx += 7;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0) { s_registry.reset(); }
+}
+
+BENCHMARK_TEMPLATE(BM_lookup_with_creates, locked_map)->Arg(1 << 16)->ThreadRange(2, 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_lookup_with_creates, concurrent_registry)->Arg(1 << 16)->ThreadRange(2, 16)->UseRealTime();
+
+BENCHMARK_MAIN();
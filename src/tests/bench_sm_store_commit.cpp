@@ -0,0 +1,119 @@
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <boost/uuid/random_generator.hpp>
+#include <iomgr/io_environment.hpp>
+#include <homestore/homestore.hpp>
+#include <homestore/meta_service.hpp>
+#include <sisl/options/options.h>
+
+#include <home_replication/repl_decls.h>
+#include "storage/home_storage_engine.h"
+
+using namespace home_replication;
+
+SISL_LOGGING_INIT(HOMEREPL_LOG_MODS)
+
+SISL_OPTIONS_ENABLE(logging, bench_sm_store_commit)
+SISL_OPTION_GROUP(bench_sm_store_commit,
+                  (num_threads, "", "num_threads", "number of threads",
+                   ::cxxopts::value< uint32_t >()->default_value("2"), "number"),
+                  (num_devs, "", "num_devs", "number of devices to create",
+                   ::cxxopts::value< uint32_t >()->default_value("2"), "number"),
+                  (dev_size_mb, "", "dev_size_mb", "size of each device in MB",
+                   ::cxxopts::value< uint64_t >()->default_value("1024"), "number"),
+                  (num_replica_sets, "", "num_replica_sets", "number of state machine stores committed to",
+                   ::cxxopts::value< uint32_t >()->default_value("64"), "number"));
+
+static const std::string s_fpath_root{"/tmp/bench_sm_store_commit"};
+
+static void remove_files(uint32_t ndevices) {
+    for (uint32_t i{0}; i < ndevices; ++i) {
+        const std::string fpath{s_fpath_root + std::to_string(i + 1)};
+        if (std::filesystem::exists(fpath)) { std::filesystem::remove(fpath); }
+    }
+}
+
+static void init_files(uint32_t ndevices, uint64_t dev_size) {
+    remove_files(ndevices);
+    for (uint32_t i{0}; i < ndevices; ++i) {
+        const std::string fpath{s_fpath_root + std::to_string(i + 1)};
+        std::ofstream ofs{fpath, std::ios::binary | std::ios::out | std::ios::trunc};
+        std::filesystem::resize_file(fpath, dev_size);
+    }
+}
+
+// Commit threads of many replica sets updating and reading back their commit lsn, while the periodic superblk flush of
+// every store snapshots it in the background. Threads share the stores round robin, so with more threads than stores
+// several committers hit the same store. Every thread counts its own lsns, so the stores are the only shared state.
+static std::vector< std::unique_ptr< HomeStateMachineStore > > s_stores;
+
+static void BM_commit_lsn(benchmark::State& state) {
+    auto& store = *s_stores[state.thread_index() % s_stores.size()];
+    repl_lsn_t lsn{0};
+    for (auto _ : state) {
+        store.commit_lsn(++lsn);
+        benchmark::DoNotOptimize(store.get_last_commit_lsn());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void start_homestore() {
+    auto const ndevices = SISL_OPTIONS["num_devs"].as< uint32_t >();
+    auto const dev_size = SISL_OPTIONS["dev_size_mb"].as< uint64_t >() * 1024 * 1024;
+    init_files(ndevices, dev_size);
+
+    std::vector< homestore::dev_info > device_info;
+    for (uint32_t i{0}; i < ndevices; ++i) {
+        const std::filesystem::path fpath{s_fpath_root + std::to_string(i + 1)};
+        device_info.emplace_back(std::filesystem::canonical(fpath).string(), homestore::HSDevType::Data);
+    }
+    ioenvironment.with_iomgr(SISL_OPTIONS["num_threads"].as< uint32_t >(), false);
+
+    homestore::hs_input_params params;
+    params.app_mem_size = ((ndevices * dev_size) * 15) / 100;
+    params.data_devices = device_info;
+    homestore::HomeStore::instance()
+        ->with_params(params)
+        .with_meta_service(5.0)
+        .with_log_service(80.0, 5.0)
+        .before_init_devices([]() {
+            homestore::meta_service().register_handler(
+                "replica_set", [](homestore::meta_blk*, sisl::byte_view, size_t) {}, nullptr);
+        })
+        .init(true /* wait_for_init */);
+}
+
+static void shutdown_homestore() {
+    homestore::HomeStore::instance()->shutdown();
+    homestore::HomeStore::reset_instance();
+    iomanager.stop();
+    remove_files(SISL_OPTIONS["num_devs"].as< uint32_t >());
+}
+
+int main(int argc, char* argv[]) {
+    ::benchmark::Initialize(&argc, argv);
+    SISL_OPTIONS_LOAD(argc, argv, logging, bench_sm_store_commit);
+    sisl::logging::SetLogger("bench_sm_store_commit");
+    spdlog::set_pattern("[%D %T%z] [%^%l%$] [%t] %v");
+
+    start_homestore();
+    for (uint32_t i{0}; i < SISL_OPTIONS["num_replica_sets"].as< uint32_t >(); ++i) {
+        s_stores.emplace_back(std::make_unique< HomeStateMachineStore >(boost::uuids::random_generator()()));
+    }
+
+    ::benchmark::RegisterBenchmark("BM_commit_lsn", BM_commit_lsn)->ThreadRange(1, 64)->UseRealTime();
+    ::benchmark::RunSpecifiedBenchmarks();
+    ::benchmark::Shutdown();
+
+    for (auto& store : s_stores) {
+        store->destroy();
+    }
+    s_stores.clear();
+    shutdown_homestore();
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include "log_store/home_raft_log_store.h"
+#include <cstring>
 #include <string>
 #include <vector>
 #include <filesystem>
@@ -83,6 +84,68 @@ public:
         ASSERT_EQ(m_rls->start_index(), m_start_lsn) << "Start Index not expected to be updated after insertion";
     }
 
+    void inline_framed_append_read_test(uint32_t num_entries) {
+        m_rls->enable_inline_framing();
+        auto const start_lsn = m_next_lsn;
+        std::vector< std::string > payloads;
+        for (uint32_t i{0}; i < num_entries; ++i) {
+            payloads.push_back(gen_random_string(g_randlogsize_generator(g_re), i));
+            auto buf = nuraft::buffer::alloc(HomeRaftLogStore::inline_framing_size + payloads.back().size());
+            std::memcpy(buf->data_begin() + HomeRaftLogStore::inline_framing_size, payloads.back().data(),
+                        payloads.back().size());
+            auto le = nuraft::cs_new< nuraft::log_entry >(m_cur_term, buf);
+            ASSERT_EQ(m_rls->append(le), uint64_cast(m_next_lsn));
+            ++m_next_lsn;
+        }
+        m_rls->flush();
+
+        // Framed entries are read back with the framing bytes intact, followed by the payload
+        auto const validate = [this, &payloads](const nuraft::ptr< nuraft::log_entry >& le, uint32_t i) {
+            ASSERT_EQ(le->get_term(), m_cur_term) << "Term mismatch for entry=" << i;
+            ASSERT_EQ(le->get_val_type(), nuraft::log_val_type::app_log);
+            auto& buf = le->get_buf();
+            ASSERT_EQ(buf.size(), HomeRaftLogStore::inline_framing_size + payloads[i].size());
+            ASSERT_EQ(std::string(r_cast< const char* >(buf.data_begin() + HomeRaftLogStore::inline_framing_size),
+                                  payloads[i].size()),
+                      payloads[i])
+                << "Payload mismatch for entry=" << i;
+        };
+        for (uint32_t i{0}; i < num_entries; ++i) {
+            validate(m_rls->entry_at(start_lsn + i), i);
+            ASSERT_EQ(m_rls->term_at(start_lsn + i), m_cur_term);
+        }
+        auto const entries = m_rls->log_entries(start_lsn, m_next_lsn);
+        ASSERT_EQ(entries->size(), num_entries);
+        for (uint32_t i{0}; i < num_entries; ++i) {
+            validate((*entries)[i], i);
+        }
+    }
+
+    // Payload which looks like an entry framed in place (type byte of a framed record at the offset of the framing)
+    void framing_lookalike_test() {
+        auto const lsn = m_next_lsn;
+        std::string payload(2 * HomeRaftLogStore::inline_framing_size, 'x');
+        payload[sizeof(uint64_t)] = s_cast< char >(0x80 | s_cast< uint8_t >(nuraft::log_val_type::app_log));
+        auto buf = nuraft::buffer::alloc(payload.size());
+        std::memcpy(buf->data_begin(), payload.data(), payload.size());
+        auto le = nuraft::cs_new< nuraft::log_entry >(m_cur_term, buf);
+        ASSERT_EQ(m_rls->append(le), uint64_cast(lsn));
+        ++m_next_lsn;
+        m_rls->flush();
+
+        // Record as shipped to other replicas is the serialized entry: framing followed by the payload untouched
+        auto pack = m_rls->pack(uint64_cast(lsn), 1);
+        pack->pos(0);
+        ASSERT_EQ(pack->get_int(), 1);
+        size_t rec_size;
+        auto const* rec = pack->get_bytes(rec_size);
+        ASSERT_EQ(rec_size, HomeRaftLogStore::inline_framing_size + payload.size());
+        ASSERT_EQ(*r_cast< const uint64_t* >(rec), m_cur_term);
+        ASSERT_EQ(rec[sizeof(uint64_t)], s_cast< uint8_t >(nuraft::log_val_type::app_log));
+        ASSERT_EQ(std::string(r_cast< const char* >(rec + HomeRaftLogStore::inline_framing_size), payload.size()),
+                  payload);
+    }
+
     void rollback_test() {
         m_next_lsn = (m_next_lsn - m_start_lsn) / 2; // Rollback half of the current logs
         ++m_cur_term;
@@ -140,6 +203,7 @@ public:
         // Do invidivual get validation
         for (uint64_t lsn = m_start_lsn; lsn < uint64_cast(m_next_lsn); ++lsn) {
             validate_log(m_rls->entry_at(lsn), lsn);
+            ASSERT_EQ(m_rls->term_at(lsn), m_rls->entry_at(lsn)->get_term()) << "Term index mismatch at lsn=" << lsn;
         }
 
         // Do bulk get validation as well.
@@ -314,6 +378,20 @@ TEST_F(TestRaftLogStore, lifecycle_test) {
     this->shutdown();
 }
 
+TEST_F(TestRaftLogStore, inline_framed_entries_test) {
+    auto nrecords = SISL_OPTIONS["num_records"].as< uint32_t >();
+    LOGINFO("Step 1: Start HomeStore");
+    this->start_homestore();
+
+    LOGINFO("Step 2: Append and read back {} entries framed in place", nrecords);
+    this->m_leader_store.inline_framed_append_read_test(nrecords);
+
+    LOGINFO("Step 3: Entries of a store without inline framing are serialized, whatever their bytes look like");
+    this->m_follower_store.framing_lookalike_test();
+
+    this->shutdown();
+}
+
 SISL_OPTIONS_ENABLE(logging, test_raft_log_store)
 SISL_OPTION_GROUP(test_raft_log_store,
                   (num_threads, "", "num_threads", "number of threads",
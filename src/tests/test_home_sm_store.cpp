@@ -6,6 +6,7 @@
 #include <homestore/homestore.hpp>
 #include <homestore/blkdata_service.hpp>
 #include <boost/uuid/uuid_generators.hpp>
+#include "service/repl_config.h"
 #include "storage/home_storage_engine.h"
 #include <home_replication/repl_decls.h>
 using namespace home_replication;
@@ -162,6 +163,18 @@ public:
         });
     }
 
+    // Every record visited must be past truncated_lsn and match the shadow log
+    uint32_t validate_visited(int64_t from_lsn, int64_t to_lsn, int64_t truncated_lsn) {
+        uint32_t nvisited{0};
+        m_hsm->get_free_pba_records(
+            from_lsn, to_lsn, [this, truncated_lsn, &nvisited](int64_t lsn, const pba_list_t& pbas) {
+                EXPECT_GT(lsn, truncated_lsn) << "Free pba record of a truncated lsn is visited";
+                EXPECT_EQ(pbas, m_shadow_log[lsn - 1]) << "Free pba record and shadow log mismatch for lsn=" << lsn;
+                ++nvisited;
+            });
+        return nvisited;
+    }
+
     void remove_upto(int64_t lsn) {
         m_hsm->remove_free_pba_records_upto(lsn - 1);
         // m_shadow_log.erase(m_shadow_log.begin(), m_shadow_log.begin() + lsn);
@@ -303,6 +316,44 @@ TEST_F(TestHomeStateMachineStore, ds_alloc_pbas) {
     this->shutdown();
 }
 
+TEST_F(TestHomeStateMachineStore, ds_alloc_pbas_clustered) {
+    LOGINFO("Step 1: Start HomeStore with the pba stream of a replica set enabled");
+    HR_SETTINGS_FACTORY().modifiable_settings([](auto& s) { s.pba_stream_extent_kb = 1024; });
+    HR_SETTINGS_FACTORY().save();
+    this->start_homestore(false /* recovery */, true /* ds test*/);
+
+    LOGINFO("Step 2: Allocate small pbas one after another, which are carved out of the extent of the replica set");
+    const auto io_size = 4 * Ki;
+    const auto first = m_hsm->alloc_pbas(io_size);
+    const auto second = m_hsm->alloc_pbas(io_size);
+    ASSERT_EQ(first.size(), 1);
+    ASSERT_EQ(second.size(), 1);
+    const homestore::BlkId first_bid{first[0]};
+    const homestore::BlkId second_bid{second[0]};
+    ASSERT_EQ(first_bid.get_chunk_num(), second_bid.get_chunk_num());
+    ASSERT_EQ(first_bid.get_blk_num() + first_bid.get_nblks(), second_bid.get_blk_num());
+
+    LOGINFO("Step 3: Allocation out of the stream is made directly");
+    pba_alloc_hints hints;
+    hints.same_stream = false;
+    ASSERT_FALSE(m_hsm->alloc_pbas(io_size, hints).empty());
+
+    LOGINFO("Step 4: Allocation of another size class is made out of an extent of its own");
+    pba_alloc_hints bulk_hints;
+    bulk_hints.size_class = pba_alloc_hints::bulk_size_class;
+    const auto bulk = m_hsm->alloc_pbas(io_size, bulk_hints);
+    ASSERT_EQ(bulk.size(), 1);
+    const homestore::BlkId bulk_bid{bulk[0]};
+    ASSERT_FALSE((bulk_bid.get_chunk_num() == second_bid.get_chunk_num()) &&
+                 (bulk_bid.get_blk_num() == second_bid.get_blk_num() + second_bid.get_nblks()))
+        << "Allocation of another size class is carved out of the same extent";
+
+    LOGINFO("Step 5: Operation completed, do shutdown.");
+    HR_SETTINGS_FACTORY().modifiable_settings([](auto& s) { s.pba_stream_extent_kb = 0; });
+    HR_SETTINGS_FACTORY().save();
+    this->shutdown();
+}
+
 TEST_F(TestHomeStateMachineStore, ds_async_write_read_then_free_blk) {
     LOGINFO("Step 1: Start HomeStore");
     this->start_homestore(false /* recovery */, true /* ds test*/);
@@ -354,6 +405,106 @@ TEST_F(TestHomeStateMachineStore, free_pba_record_maintanence) {
     this->shutdown();
 }
 
+TEST_F(TestHomeStateMachineStore, free_pba_record_batching) {
+    LOGINFO("Step 1: Start HomeStore with a small batch, so that records are persisted many to a log record");
+    HR_SETTINGS_FACTORY().modifiable_settings([](auto& s) { s.free_pba_record_batch_kb = 1; });
+    HR_SETTINGS_FACTORY().save();
+    this->start_homestore();
+
+    LOGINFO("Step 2: Add records and validate every one of them is visited");
+    for (int64_t lsn{1}; lsn <= 100; ++lsn) {
+        this->add(lsn);
+    }
+    ASSERT_EQ(this->validate_visited(1, 101, 0), 100);
+
+    LOGINFO("Step 3: Truncate in the middle of a log record, the records upto it are skipped");
+    m_hsm->remove_free_pba_records_upto(50);
+    m_hsm->checkpoint_lsn(50);
+    ASSERT_EQ(this->validate_visited(1, 101, 50), 50);
+
+    LOGINFO("Step 4: Add records which stay staged till the superblk flush and let the flusher persist them");
+    this->add(101);
+    this->add(102);
+    m_hsm->commit_lsn(102);
+    std::this_thread::sleep_for(std::chrono::milliseconds{3 * HR_DYNAMIC_CONFIG(commit_lsn_flush_ms)});
+
+    LOGINFO("Step 5: Restart homestore and validate the truncated records are still skipped");
+    this->start_homestore(true /* restart */);
+    ASSERT_EQ(m_hsm->get_last_commit_lsn(), 102);
+    ASSERT_EQ(this->validate_visited(1, 103, 50), 52);
+
+    HR_SETTINGS_FACTORY().modifiable_settings([](auto& s) { s.free_pba_record_batch_kb = 64; });
+    HR_SETTINGS_FACTORY().save();
+    this->shutdown();
+}
+
+TEST_F(TestHomeStateMachineStore, free_pba_records_of_same_lsn) {
+    LOGINFO("Step 1: Start HomeStore");
+    this->start_homestore();
+
+    LOGINFO("Step 2: Add two records for lsn 5, each persisted in a log record of its own");
+    pba_list_t const first{m_cur_pba.fetch_add(1), m_cur_pba.fetch_add(1)};
+    pba_list_t const second{m_cur_pba.fetch_add(1)};
+    m_hsm->add_free_pba_record(5, first);
+    m_hsm->flush_free_pba_records();
+    m_hsm->add_free_pba_record(5, second);
+    m_hsm->flush_free_pba_records();
+
+    auto const visit = [this]() {
+        std::vector< pba_list_t > visited;
+        m_hsm->get_free_pba_records(1, 10, [&visited](int64_t lsn, const pba_list_t& pbas) {
+            EXPECT_EQ(lsn, 5);
+            visited.push_back(pbas);
+        });
+        return visited;
+    };
+    ASSERT_EQ(visit(), (std::vector< pba_list_t >{first, second})) << "A record of lsn 5 is overwritten";
+
+    LOGINFO("Step 3: Restart homestore, both the records are recovered and a new one does not overwrite them");
+    m_hsm->commit_lsn(5);
+    this->start_homestore(true /* restart */);
+    ASSERT_EQ(visit(), (std::vector< pba_list_t >{first, second}));
+    pba_list_t const third{m_cur_pba.fetch_add(1)};
+    m_hsm->add_free_pba_record(5, third);
+    m_hsm->flush_free_pba_records();
+    ASSERT_EQ(visit(), (std::vector< pba_list_t >{first, second, third}));
+
+    LOGINFO("Step 4: Truncate upto lsn 5, no record is visited");
+    m_hsm->remove_free_pba_records_upto(5);
+    ASSERT_TRUE(visit().empty());
+    this->shutdown();
+}
+
+TEST_F(TestHomeStateMachineStore, free_pbas_merges_adjacent) {
+    // Blks 10-14 of chunk 1 are adjacent, given out of order. Blk 20 of chunk 1 and blk 15 of chunk 2 are not.
+    pba_list_t const pbas{homestore::BlkId{12, 2, 1}.to_integer(), homestore::BlkId{20, 1, 1}.to_integer(),
+                          homestore::BlkId{10, 2, 1}.to_integer(), homestore::BlkId{15, 1, 2}.to_integer(),
+                          homestore::BlkId{14, 1, 1}.to_integer()};
+    pba_list_t const expected{homestore::BlkId{10, 5, 1}.to_integer(), homestore::BlkId{20, 1, 1}.to_integer(),
+                              homestore::BlkId{15, 1, 2}.to_integer()};
+    ASSERT_EQ(HomeStateMachineStore::merge_adjacent_pbas(pbas), expected);
+    ASSERT_TRUE(HomeStateMachineStore::merge_adjacent_pbas(pba_list_t{}).empty());
+}
+
+TEST_F(TestHomeStateMachineStore, commit_lsn_recovery) {
+    LOGINFO("Step 1: Start HomeStore");
+    this->start_homestore();
+
+    LOGINFO("Step 2: Commit and let the superblk flusher pick it up");
+    m_hsm->commit_lsn(50);
+    m_hsm->checkpoint_lsn(20);
+    ASSERT_EQ(m_hsm->get_last_commit_lsn(), 50);
+    std::this_thread::sleep_for(std::chrono::milliseconds{3 * HR_DYNAMIC_CONFIG(commit_lsn_flush_ms)});
+    m_hsm->commit_lsn(60);
+
+    LOGINFO("Step 3: Restart homestore and validate the lsns are recovered");
+    this->start_homestore(true /* restart */);
+    ASSERT_EQ(m_hsm->get_last_commit_lsn(), 60);
+    ASSERT_EQ(m_hsm->get_checkpoint_lsn(), 20);
+
+    this->shutdown();
+}
+
 SISL_OPTIONS_ENABLE(logging, test_home_sm_store)
 SISL_OPTION_GROUP(test_home_sm_store,
                   (num_threads, "", "num_threads", "number of threads",
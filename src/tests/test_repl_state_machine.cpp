@@ -1,6 +1,12 @@
+#include <algorithm>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <iostream>
+#include <cstdlib>
+#include <new>
+#include <future>
+#include <mutex>
 #include <iomgr/io_environment.hpp>
 #include <homestore/homestore.hpp>
 #include <homestore/blkdata_service.hpp>
@@ -11,11 +17,25 @@
 
 #include <home_replication/repl_decls.h>
 #include "state_machine/state_machine.h"
+#include "log_store/journal_entry.h"
+#include "service/repl_config.h"
 
 using namespace home_replication;
 
 SISL_LOGGING_INIT(HOMEREPL_LOG_MODS)
 
+// Counts heap allocations made by the current thread while enabled, to catch per-pba allocations on the hot path
+static thread_local bool t_count_allocs{false};
+static thread_local uint64_t t_num_allocs{0};
+
+void* operator new(std::size_t size) {
+    if (t_count_allocs) { ++t_num_allocs; }
+    if (void* ptr = std::malloc(size)) { return ptr; }
+    throw std::bad_alloc{};
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
 static const std::string s_fpath_root{"/tmp/repl_state_machine"};
 static void remove_files(uint32_t ndevices) {
     for (uint32_t i{0}; i < ndevices; ++i) {
@@ -33,6 +53,125 @@ static void init_files(uint32_t ndevices, uint64_t dev_size) {
     }
 }
 
+// Replica set which lets the test attach its own listener. Data channel requests go nowhere, as if no other replica
+// ever responds, fetch rpcs among them are counted.
+class TestReplicaSet : public home_replication::ReplicaSet {
+public:
+    using home_replication::ReplicaSet::ReplicaSet;
+    void attach(std::unique_ptr< ReplicaSetListener > listener) { attach_listener(std::move(listener)); }
+
+    void send_data_service_request(const std::string& request_name, const nuraft_mesg::io_blob_list_t&,
+                                   const nuraft_mesg::data_service_response_handler_t&) override {
+        if (request_name == FETCH_PBAS_RPC_NAME) { m_fetch_rpcs.fetch_add(1); }
+    }
+
+    // Standalone replica set acts as the leader, unless the test makes it a follower
+    bool is_leader() override { return !m_follower && ReplicaSet::is_leader(); }
+
+    std::atomic< uint32_t > m_fetch_rpcs{0};
+    bool m_follower{false};
+};
+
+// Journal which holds no entries, only its start index, which the test moves as raft would on compaction
+class StubJournal : public nuraft::log_store {
+public:
+    ulong next_slot() const override { return m_start_index.load(); }
+    ulong start_index() const override { return m_start_index.load(); }
+    nuraft::ptr< nuraft::log_entry > last_entry() const override { return nullptr; }
+    ulong append(nuraft::ptr< nuraft::log_entry >&) override { return 0; }
+    void write_at(ulong, nuraft::ptr< nuraft::log_entry >&) override {}
+    nuraft::ptr< std::vector< nuraft::ptr< nuraft::log_entry > > > log_entries(ulong, ulong) override {
+        return nullptr;
+    }
+    nuraft::ptr< nuraft::log_entry > entry_at(ulong) override { return nullptr; }
+    ulong term_at(ulong) override { return 0; }
+    nuraft::ptr< nuraft::buffer > pack(ulong, int32_t) override { return nullptr; }
+    void apply_pack(ulong, nuraft::buffer&) override {}
+    bool compact(ulong last_log_index) override {
+        m_start_index.store(last_log_index + 1);
+        return true;
+    }
+    bool flush() override { return true; }
+
+    std::atomic< ulong > m_start_index{1};
+};
+
+// State machine store which records the calls made by the checkpoint, in the order they are made
+class RecordingStateMachineStore : public HomeStateMachineStore {
+public:
+    using HomeStateMachineStore::HomeStateMachineStore;
+
+    void checkpoint_lsn(repl_lsn_t lsn) override {
+        record(fmt::format("checkpoint_lsn:{}", lsn));
+        HomeStateMachineStore::checkpoint_lsn(lsn);
+    }
+    void remove_free_pba_records_upto(repl_lsn_t lsn) override {
+        record(fmt::format("remove_free_pba_records_upto:{}", lsn));
+        HomeStateMachineStore::remove_free_pba_records_upto(lsn);
+    }
+    void free_pbas(const pba_list_t& pbas) override {
+        record(fmt::format("free_pbas:{}", pbas.size()));
+        HomeStateMachineStore::free_pbas(pbas);
+    }
+
+    // Allocations are split into pbas of a page each, if asked to
+    using HomeStateMachineStore::alloc_pbas;
+    pba_list_t alloc_pbas(uint32_t size, const pba_alloc_hints& hints) override {
+        if (!m_split_allocs) { return HomeStateMachineStore::alloc_pbas(size, hints); }
+        pba_list_t pbas;
+        for (uint32_t off{0}; off < size; off += 4096) {
+            auto const p = HomeStateMachineStore::alloc_pbas(4096, hints);
+            pbas.insert(pbas.end(), p.begin(), p.end());
+        }
+        return pbas;
+    }
+
+    std::atomic< bool > m_split_allocs{false};
+
+    std::vector< std::string > take_calls() {
+        std::vector< std::string > calls;
+        std::unique_lock lg{m_mtx};
+        calls.swap(m_calls);
+        return calls;
+    }
+
+private:
+    void record(std::string call) {
+        std::unique_lock lg{m_mtx};
+        m_calls.push_back(std::move(call));
+    }
+
+    std::mutex m_mtx;
+    std::vector< std::string > m_calls;
+};
+
+// Listener which snapshots the pbas and data it is given and records the snapshot it is asked to install
+class SnapshotListener : public ReplicaSetListener {
+public:
+    void on_commit(int64_t, const sisl::blob&, const sisl::blob&, const pba_list_t&, void*) override {}
+    void on_pre_commit(int64_t, const sisl::blob&, const sisl::blob&, void*) override {}
+    void on_rollback(int64_t, const sisl::blob&, const sisl::blob&, void*) override {}
+    void on_replica_stop() override {}
+
+    void on_snapshot_create(int64_t, std::vector< uint8_t >& user_data, std::vector< pba_t >& pbas) override {
+        user_data = m_user_data;
+        pbas = m_pbas;
+    }
+
+    void on_snapshot_install(int64_t lsn, const sisl::blob& user_data,
+                             const std::vector< std::pair< pba_t, pba_list_t > >& pba_map) override {
+        m_installed_lsn = lsn;
+        m_installed_user_data.assign(user_data.bytes, user_data.bytes + user_data.size);
+        m_installed_pba_map = pba_map;
+    }
+
+    std::vector< uint8_t > m_user_data;
+    std::vector< pba_t > m_pbas;
+    int64_t m_installed_lsn{-1};
+    std::vector< uint8_t > m_installed_user_data;
+    std::vector< std::pair< pba_t, pba_list_t > > m_installed_pba_map;
+};
+
 class TestReplStateMachine : public ::testing::Test {
 public:
     void SetUp() {
@@ -99,9 +238,10 @@ public:
             .init(true /* wait_for_init */);
 
         if (!restart) {
-            m_hsm = std::make_shared< HomeStateMachineStore >(m_uuid);
+            m_hsm = std::make_shared< RecordingStateMachineStore >(m_uuid);
             //  m_rs = std::make_shared< home_replication::ReplicaSet >("Test_Group_Id", m_hsm, nullptr /*log store*/);
-            m_rs = new home_replication::ReplicaSet("Test_Group_Id", m_hsm, nullptr /*log store*/);
+            m_journal = std::make_shared< StubJournal >();
+            m_rs = new TestReplicaSet("Test_Group_Id", m_hsm, m_journal);
             m_sm = std::dynamic_pointer_cast< ReplicaStateMachine >(m_rs->get_state_machine());
         }
     }
@@ -125,15 +265,99 @@ public:
         m_uuid = rs_sb->uuid;
     }
 
+    SnapshotListener* attach_snapshot_listener() {
+        auto listener = std::make_unique< SnapshotListener >();
+        auto* ret = listener.get();
+        m_rs->attach(std::move(listener));
+        return ret;
+    }
+
+    void commit_lsn(repl_lsn_t lsn) { m_hsm->commit_lsn(lsn); }
+
+    // Adds a free pba record of num_pbas pbas, newly allocated, for lsn
+    void add_free_pba_record(repl_lsn_t lsn, uint32_t num_pbas) {
+        pba_list_t pbas;
+        for (uint32_t i{0}; i < num_pbas; ++i) {
+            auto const p = m_hsm->alloc_pbas(4096);
+            pbas.insert(pbas.end(), p.begin(), p.end());
+        }
+        ASSERT_EQ(pbas.size(), num_pbas);
+        m_hsm->add_free_pba_record(lsn, pbas);
+    }
+
+    repl_lsn_t checkpoint_lsn() const { return m_hsm->get_checkpoint_lsn(); }
+
+    // Compacts the journal upto lsn, as raft does once it no longer needs to keep the entries
+    void compact_journal(int64_t lsn) { m_journal->compact(uint64_cast(lsn)); }
+
+    RecordingStateMachineStore& store() { return *std::dynamic_pointer_cast< RecordingStateMachineStore >(m_hsm); }
+    TestReplicaSet& replica_set() { return *m_rs; }
+
+    std::vector< std::string > take_store_calls() {
+        return std::dynamic_pointer_cast< RecordingStateMachineStore >(m_hsm)->take_calls();
+    }
+
+    // Takes a snapshot at lsn, which commits have caught up to already
+    void create_snapshot(int64_t lsn) {
+        auto snp = nuraft::cs_new< nuraft::snapshot >(lsn, 1 /* term */, nuraft::cs_new< nuraft::cluster_config >(),
+                                                      0 /* size */, nuraft::snapshot::logical_object);
+        bool created{false};
+        nuraft::async_result< bool >::handler_type when_done = [&created](bool& ret, nuraft::ptr< std::exception >&) {
+            created = ret;
+        };
+        m_sm->create_snapshot(*snp, when_done);
+        ASSERT_TRUE(created);
+    }
+
+    uint32_t num_fetch_rpcs() const { return m_rs->m_fetch_rpcs.load(); }
+
+    // Writes size bytes filled with fill_byte to newly allocated pbas and waits for the write to complete
+    pba_list_t write_data(uint8_t fill_byte, uint32_t size) {
+        auto const pbas = m_hsm->alloc_pbas(size);
+        auto* buf = iomanager.iobuf_alloc(512, size);
+        std::memset(buf, fill_byte, size);
+        sisl::sg_list sgs;
+        sgs.size = size;
+        sgs.iovs.emplace_back(iovec{buf, size});
+
+        std::promise< void > done;
+        m_hsm->async_write(sgs, pbas, [&done](std::error_condition err) {
+            RELEASE_ASSERT(!err, "Write failed");
+            done.set_value();
+        });
+        done.get_future().wait();
+        iomanager.iobuf_free(buf);
+        return pbas;
+    }
+
+    // Reads size bytes of the pba and waits for the read to complete
+    std::vector< uint8_t > read_data(pba_t pba, uint32_t size) {
+        auto* buf = iomanager.iobuf_alloc(512, size);
+        sisl::sg_list sgs;
+        sgs.size = size;
+        sgs.iovs.emplace_back(iovec{buf, size});
+
+        std::promise< void > done;
+        m_hsm->async_read(pba, sgs, size, [&done](std::error_condition err) {
+            RELEASE_ASSERT(!err, "Read failed");
+            done.set_value();
+        });
+        done.get_future().wait();
+        std::vector< uint8_t > out{buf, buf + size};
+        iomanager.iobuf_free(buf);
+        return out;
+    }
+
 public:
     std::shared_ptr< ReplicaStateMachine > m_sm{nullptr}; // state machine
 
 private:
-    home_replication::ReplicaSet* m_rs{nullptr}; // dummy replica set, it is just initialized for unit test purpose;
+    TestReplicaSet* m_rs{nullptr}; // dummy replica set, it is just initialized for unit test purpose;
 #if 0
     std::shared_ptr< home_replication::ReplicaSet > m_rs{nullptr};
 #endif
     std::shared_ptr< HomeStateMachineStore > m_hsm{nullptr}; // Home SM Store
+    std::shared_ptr< StubJournal > m_journal{nullptr};
     boost::uuids::uuid m_uuid;
 };
 
@@ -161,6 +385,37 @@ TEST_F(TestReplStateMachine, map_pba_basic_test) {
     LOGINFO("Step 6: shutdown");
     this->shutdown();
 }
+TEST_F(TestReplStateMachine, rollback_releases_pbas) {
+    LOGINFO("Step 1: Start HomeStore");
+    this->start_homestore();
+
+    LOGINFO("Step 2: Receive a req with one pba already written and another being written");
+    fully_qualified_pba const written_pba{1 /* server_id */, 100 /* remote_pba */, 4096 /* size */};
+    fully_qualified_pba const writing_pba{1 /* server_id */, 101 /* remote_pba */, 4096 /* size */};
+    m_sm->try_map_pba(written_pba);
+    m_sm->update_map_pba(written_pba, pba_state_t::written);
+    m_sm->update_map_pba(written_pba, pba_state_t::completed);
+    m_sm->try_map_pba(writing_pba);
+    m_sm->update_map_pba(writing_pba, pba_state_t::written);
+
+    repl_req* req = sisl::ObjectAllocator< repl_req >::make_object();
+    req->remote_fq_pbas = {written_pba, writing_pba};
+    req->journal_entry = nuraft::buffer::alloc(sizeof(repl_journal_entry));
+    m_sm->link_lsn_to_req(req, 10);
+
+    LOGINFO("Step 3: Rollback the range of lsns the req is in");
+    m_sm->rollback_reqs(5, 20);
+    ASSERT_EQ(m_sm->try_lsn_to_req(10), nullptr);
+    ASSERT_EQ(m_sm->remove_map_pba(written_pba), 0);
+    ASSERT_EQ(m_sm->remove_map_pba(writing_pba), 0);
+
+    LOGINFO("Step 4: Completion of the write in flight finds it rolled back");
+    ASSERT_EQ(m_sm->update_map_pba(writing_pba, pba_state_t::completed), pba_state_t::unknown);
+
+    LOGINFO("Step 5: shutdown");
+    this->shutdown();
+}
+
 #if 0 // TODO: disable for now because of known issue not related to this test;
 TEST_F(TestReplStateMachine, async_fetch_pba_test_wait_no_timeout) {
     LOGINFO("Step 1: Start HomeStore");
@@ -176,7 +431,7 @@ TEST_F(TestReplStateMachine, async_fetch_pba_test_wait_no_timeout) {
     LOGINFO("Step 4: async_fetch_write_pbas");
     std::vector< fully_qualified_pba > fq_pbas{fq_pba};
     bool called{false};
-    const auto need_to_wait = m_sm->async_fetch_write_pbas(fq_pbas, [&called]() {
+    const auto need_to_wait = m_sm->async_fetch_write_pbas(fq_pbas, [&called](bool) {
         called = true;
         LOGINFO("callback called");
     });
@@ -210,7 +465,7 @@ TEST_F(TestReplStateMachine, async_fetch_pba_test_no_wait) {
     LOGINFO("Step 5: async_fetch_write_pbas");
     std::vector< fully_qualified_pba > fq_pbas{fq_pba};
     const auto need_to_wait =
-        m_sm->async_fetch_write_pbas(fq_pbas, []() { ASSERT_TRUE(false) << "Should not be called. "; });
+        m_sm->async_fetch_write_pbas(fq_pbas, [](bool) { ASSERT_TRUE(false) << "Should not be called. "; });
 
     ASSERT_EQ(need_to_wait, false);
 
@@ -221,10 +476,354 @@ TEST_F(TestReplStateMachine, async_fetch_pba_test_no_wait) {
 }
 #endif
 
+TEST_F(TestReplStateMachine, fetch_gives_up_after_retries) {
+    LOGINFO("Step 1: Start HomeStore with short remote fetch timeouts");
+    HR_SETTINGS_FACTORY().modifiable_settings([](auto& s) {
+        s.fetch_rpc_timeout_ms = 100;
+        s.max_fetch_rpc_retries = 2;
+    });
+    HR_SETTINGS_FACTORY().save();
+    this->start_homestore();
+
+    LOGINFO("Step 2: Wait on a remote pba which no replica serves and fetch it right away");
+    fully_qualified_pba const fq_pba{2 /* server_id */, 100 /* remote_pba */, 4096 /* size */};
+    std::promise< bool > done;
+    iomanager.run_on(
+        iomgr::thread_regex::random_worker,
+        [this, &fq_pba, &done](iomgr::io_thread_addr_t) {
+            bool const need_to_wait =
+                m_sm->async_fetch_write_pbas({fq_pba}, [&done](bool success) { done.set_value(success); });
+            ASSERT_TRUE(need_to_wait);
+            m_sm->stop_write_wait_timer();
+            m_sm->check_and_fetch_remote_pbas({fq_pba});
+        },
+        iomgr::wait_type_t::spin);
+
+    LOGINFO("Step 3: Fetch rpc is sent once and retried twice, after which the waiter is failed");
+    auto fut = done.get_future();
+    ASSERT_EQ(fut.wait_for(std::chrono::seconds{10}), std::future_status::ready);
+    ASSERT_FALSE(fut.get());
+    ASSERT_EQ(this->num_fetch_rpcs(), 3u);
+
+    LOGINFO("Step 4: Pba stays mapped, to be filled by a later write");
+    auto const [local_pbas, state] = m_sm->try_map_pba(fq_pba);
+    ASSERT_EQ(state, pba_state_t::allocated);
+    ASSERT_EQ(m_sm->update_map_pba(fq_pba, pba_state_t::written), pba_state_t::allocated);
+    ASSERT_EQ(m_sm->update_map_pba(fq_pba, pba_state_t::completed), pba_state_t::written);
+
+    HR_SETTINGS_FACTORY().modifiable_settings([](auto& s) {
+        s.fetch_rpc_timeout_ms = 5000;
+        s.max_fetch_rpc_retries = 3;
+    });
+    HR_SETTINGS_FACTORY().save();
+    this->shutdown();
+}
+
+TEST_F(TestReplStateMachine, pba_map_entries_pool_allocated) {
+    static constexpr uint32_t num_entries{100};
+    std::vector< local_pba_info_ptr > entries;
+    entries.reserve(num_entries);
+    uint32_t num_cb_called{0};
+
+    auto const alloc_and_release = [&entries, &num_cb_called]() {
+        for (uint32_t i{0}; i < num_entries; ++i) {
+            auto const waiter = pba_waiter_ptr{
+                sisl::ObjectAllocator< pba_waiter >::make_object([&num_cb_called](bool) { ++num_cb_called; })};
+            entries.emplace_back(
+                sisl::ObjectAllocator< local_pba_info >::make_object(pba_list_t{i}, pba_state_t::allocated, waiter));
+        }
+        entries.clear();
+    };
+
+    LOGINFO("Step 1: Warm up the object pools");
+    alloc_and_release();
+    ASSERT_EQ(num_cb_called, num_entries);
+
+    LOGINFO("Step 2: Allocate and release again, which should be served entirely from the pools");
+    t_num_allocs = 0;
+    t_count_allocs = true;
+    alloc_and_release();
+    t_count_allocs = false;
+    ASSERT_EQ(t_num_allocs, 0u) << "pba map entries or waiters are allocated from heap";
+    ASSERT_EQ(num_cb_called, 2 * num_entries);
+}
+
 TEST_F(TestReplStateMachine, async_fetch_pba_test_wait_timeout_fetch_remote) {
     // To be implemented;
 }
 
+TEST_F(TestReplStateMachine, snapshot_transfer_test) {
+    LOGINFO("Step 1: Start HomeStore");
+    this->start_homestore();
+    auto* listener = this->attach_snapshot_listener();
+
+    LOGINFO("Step 2: Write the data of pbas owned by the listener");
+    static constexpr uint32_t num_objs{16};
+    static constexpr uint32_t obj_size{4096};
+    for (uint32_t i{0}; i < num_objs; ++i) {
+        for (auto const pba : this->write_data(s_cast< uint8_t >(i + 1), obj_size)) {
+            listener->m_pbas.push_back(pba);
+        }
+    }
+    listener->m_user_data = {'k', 'e', 'y', 's'};
+
+    LOGINFO("Step 3: Create the snapshot, commits have already caught up to its lsn");
+    static constexpr int64_t snp_lsn{100};
+    this->commit_lsn(snp_lsn);
+    auto snp = nuraft::cs_new< nuraft::snapshot >(snp_lsn, 1 /* term */, nuraft::cs_new< nuraft::cluster_config >(),
+                                                  0 /* size */, nuraft::snapshot::logical_object);
+    bool created{false};
+    nuraft::async_result< bool >::handler_type when_done = [&created](bool& ret, nuraft::ptr< std::exception >&) {
+        created = ret;
+    };
+    m_sm->create_snapshot(*snp, when_done);
+    ASSERT_TRUE(created);
+    ASSERT_EQ(m_sm->last_snapshot()->get_last_log_idx(), uint64_cast(snp_lsn));
+
+    LOGINFO("Step 4: Ship the snapshot object by object to the same state machine, delivering one object twice");
+    void* user_snp_ctx{nullptr};
+    ulong obj_id{0};
+    bool is_last_obj{false};
+    bool resent{false};
+    while (!is_last_obj) {
+        raft_buf_ptr_t data;
+        ulong const read_id = obj_id;
+        ASSERT_EQ(m_sm->read_logical_snp_obj(*snp, user_snp_ctx, read_id, data, is_last_obj), 0);
+        m_sm->save_logical_snp_obj(*snp, obj_id, *data, (read_id == 0), is_last_obj);
+        ASSERT_EQ(obj_id, read_id + 1) << "Receiver did not ask for the next object";
+
+        if ((read_id == 1) && !resent) {
+            ulong dup_id = read_id;
+            m_sm->save_logical_snp_obj(*snp, dup_id, *data, false /* is_first_obj */, is_last_obj);
+            ASSERT_EQ(dup_id, obj_id) << "Receiver did not skip the object delivered again";
+            resent = true;
+        }
+    }
+    ASSERT_TRUE(resent);
+
+    LOGINFO("Step 5: Install the snapshot and validate the data written to local pbas");
+    ASSERT_TRUE(m_sm->apply_snapshot(*snp));
+    ASSERT_EQ(listener->m_installed_lsn, snp_lsn);
+    ASSERT_EQ(listener->m_installed_user_data, listener->m_user_data);
+    ASSERT_EQ(listener->m_installed_pba_map.size(), listener->m_pbas.size());
+    for (size_t i{0}; i < listener->m_pbas.size(); ++i) {
+        auto const& [remote_pba, local_pbas] = listener->m_installed_pba_map[i];
+        ASSERT_EQ(remote_pba, listener->m_pbas[i]);
+        ASSERT_EQ(local_pbas.size(), 1u);
+        auto const data = this->read_data(local_pbas[0], obj_size);
+        ASSERT_EQ(uint64_cast(std::count(data.begin(), data.end(), s_cast< uint8_t >(i + 1))), obj_size)
+            << "Data mismatch at pba=" << i;
+    }
+
+    LOGINFO("Step 6: shutdown");
+    this->shutdown();
+}
+
+TEST_F(TestReplStateMachine, multi_pba_journal_entry) {
+    LOGINFO("Step 1: Start HomeStore as a follower whose allocations come in pbas of a page each");
+    this->start_homestore();
+    this->replica_set().m_follower = true;
+    this->store().m_split_allocs = true;
+
+    LOGINFO("Step 2: Receive an entry whose first remote pba maps to two local pbas");
+    static constexpr uint32_t leader_id{2};
+    std::string const header{"header"};
+    std::string const key{"key"};
+    journal_entry_builder builder{journal_type_t::DATA, leader_id,
+                                  sisl::blob{r_cast< uint8_t* >(const_cast< char* >(header.data())),
+                                             uint32_cast(header.size())},
+                                  sisl::blob{r_cast< uint8_t* >(const_cast< char* >(key.data())),
+                                             uint32_cast(key.size())},
+                                  2 /* n_pbas */};
+    builder.add_pba(100, 8192);
+    builder.add_pba(200, 4096);
+    auto const buf = builder.build();
+    repl_req* req = m_sm->transform_journal_entry(buf);
+    ASSERT_NE(req, nullptr);
+
+    LOGINFO("Step 3: Entry keeps the pbas of the leader and is flagged, local pbas are known through the req");
+    auto const* entry = repl_journal_entry::from_buf(*buf);
+    ASSERT_EQ(entry->major_version, JOURNAL_ENTRY_MAJOR);
+    ASSERT_EQ(entry->replica_id, leader_id);
+    ASSERT_TRUE(entry->flags & repl_journal_entry::UNTRANSFORMED);
+    auto const* raw_pbas = r_cast< const uint8_t* >(entry) + sizeof(repl_journal_entry) + header.size() + key.size();
+    ASSERT_EQ(*r_cast< const pba_t* >(raw_pbas), 100u);
+    ASSERT_EQ(req->remote_fq_pbas.size(), 2u);
+    ASSERT_EQ(req->local_pbas.size(), 3u);
+    ASSERT_EQ(std::string(r_cast< const char* >(req->header.bytes), req->header.size), header);
+    ASSERT_EQ(std::string(r_cast< const char* >(req->key.bytes), req->key.size), key);
+
+    LOGINFO("Step 4: Entry whose every remote pba maps to one local pba is rewritten with the local pbas");
+    this->store().m_split_allocs = false;
+    journal_entry_builder single_builder{journal_type_t::DATA, leader_id, sisl::blob{}, sisl::blob{}, 1 /* n_pbas */};
+    single_builder.add_pba(300, 4096);
+    auto const single_buf = single_builder.build();
+    repl_req* single_req = m_sm->transform_journal_entry(single_buf);
+    ASSERT_NE(single_req, nullptr);
+    auto const* single_entry = repl_journal_entry::from_buf(*single_buf);
+    ASSERT_FALSE(single_entry->flags & repl_journal_entry::UNTRANSFORMED);
+    ASSERT_EQ(*r_cast< const pba_t* >(r_cast< const uint8_t* >(single_entry) + sizeof(repl_journal_entry)),
+              single_req->local_pbas[0]);
+
+    LOGINFO("Step 5: Release the reqs and shutdown");
+    m_sm->link_lsn_to_req(req, 1);
+    m_sm->link_lsn_to_req(single_req, 2);
+    m_sm->rollback_reqs(1, 3);
+    this->shutdown();
+}
+
+TEST_F(TestReplStateMachine, unclaimed_pbas_reclaimed) {
+    LOGINFO("Step 1: Start HomeStore as a follower, data received is reclaimed as soon as it is found unclaimed");
+    HR_SETTINGS_FACTORY().modifiable_settings([](auto& s) { s.unclaimed_pba_timeout_ms = 0; });
+    HR_SETTINGS_FACTORY().save();
+    this->start_homestore();
+    this->replica_set().m_follower = true;
+
+    LOGINFO("Step 2: Data channel writes two remote pbas, only one of which a journal entry arrives for");
+    static constexpr uint32_t leader_id{2};
+    fully_qualified_pba const unclaimed_pba{leader_id, 500 /* remote_pba */, 4096 /* size */};
+    fully_qualified_pba const claimed_pba{leader_id, 600 /* remote_pba */, 4096 /* size */};
+    for (const auto& fq_pba : {unclaimed_pba, claimed_pba}) {
+        m_sm->try_map_pba(fq_pba);
+        m_sm->update_map_pba(fq_pba, pba_state_t::written);
+        m_sm->update_map_pba(fq_pba, pba_state_t::completed);
+    }
+    journal_entry_builder builder{journal_type_t::DATA, leader_id, sisl::blob{}, sisl::blob{}, 1 /* n_pbas */};
+    builder.add_pba(claimed_pba.pba, claimed_pba.size);
+    repl_req* req = m_sm->transform_journal_entry(builder.build());
+    ASSERT_NE(req, nullptr);
+
+    LOGINFO("Step 3: Checkpoint frees the pbas of the unclaimed one and keeps the claimed one");
+    this->take_store_calls();
+    m_sm->checkpoint();
+    ASSERT_EQ(this->take_store_calls(), (std::vector< std::string >{"free_pbas:1"}));
+    ASSERT_EQ(m_sm->update_map_pba(unclaimed_pba, pba_state_t::completed), pba_state_t::unknown);
+    ASSERT_EQ(m_sm->update_map_pba(claimed_pba, pba_state_t::completed), pba_state_t::completed);
+
+    LOGINFO("Step 4: Release the req and shutdown");
+    m_sm->link_lsn_to_req(req, 1);
+    m_sm->rollback_reqs(1, 2);
+    HR_SETTINGS_FACTORY().modifiable_settings([](auto& s) { s.unclaimed_pba_timeout_ms = 300000; });
+    HR_SETTINGS_FACTORY().save();
+    this->shutdown();
+}
+
+TEST_F(TestReplStateMachine, checkpoint_test) {
+    LOGINFO("Step 1: Start HomeStore, checkpoint frees at most 10 pbas at a time");
+    HR_SETTINGS_FACTORY().modifiable_settings([](auto& s) {
+        s.checkpoint_max_free_pbas_per_sec = 10;
+        s.checkpoint_interval_ms = 1000;
+    });
+    HR_SETTINGS_FACTORY().save();
+    this->start_homestore();
+    this->attach_snapshot_listener();
+
+    LOGINFO("Step 2: Add free pba records of 3 pbas each for lsns 1-10 and commit upto 10");
+    for (int64_t lsn{1}; lsn <= 10; ++lsn) {
+        this->add_free_pba_record(lsn, 3);
+    }
+    this->commit_lsn(10);
+    this->compact_journal(10);
+
+    LOGINFO("Step 3: Checkpoint stops short of the record which would go past the rate limit");
+    this->take_store_calls();
+    m_sm->checkpoint();
+    ASSERT_EQ(this->checkpoint_lsn(), 3);
+    ASSERT_EQ(this->take_store_calls(),
+              (std::vector< std::string >{"checkpoint_lsn:3", "remove_free_pba_records_upto:3", "free_pbas:9"}))
+        << "Checkpoint is not persisted, then truncated, then freed";
+
+    LOGINFO("Step 4: Records past the latest snapshot are held back");
+    this->create_snapshot(5);
+    this->take_store_calls();
+    m_sm->checkpoint();
+    ASSERT_EQ(this->checkpoint_lsn(), 5);
+    ASSERT_EQ(this->take_store_calls(),
+              (std::vector< std::string >{"checkpoint_lsn:5", "remove_free_pba_records_upto:5", "free_pbas:6"}));
+
+    m_sm->checkpoint();
+    ASSERT_EQ(this->checkpoint_lsn(), 5);
+    ASSERT_TRUE(this->take_store_calls().empty()) << "Checkpoint went past the snapshot";
+
+    LOGINFO("Step 5: Once a snapshot is taken past them, the rest of the records are freed");
+    this->create_snapshot(10);
+    m_sm->checkpoint();
+    ASSERT_EQ(this->checkpoint_lsn(), 8);
+    m_sm->checkpoint();
+    ASSERT_EQ(this->checkpoint_lsn(), 10);
+
+    HR_SETTINGS_FACTORY().modifiable_settings([](auto& s) { s.checkpoint_max_free_pbas_per_sec = 0; });
+    HR_SETTINGS_FACTORY().save();
+    this->shutdown();
+}
+
+TEST_F(TestReplStateMachine, checkpoint_takes_whole_lsns) {
+    LOGINFO("Step 1: Start HomeStore, checkpoint frees at most 10 pbas at a time");
+    HR_SETTINGS_FACTORY().modifiable_settings([](auto& s) {
+        s.checkpoint_max_free_pbas_per_sec = 10;
+        s.checkpoint_interval_ms = 1000;
+    });
+    HR_SETTINGS_FACTORY().save();
+    this->start_homestore();
+    this->attach_snapshot_listener();
+
+    LOGINFO("Step 2: Add a record of 3 pbas for lsn 1, two records of 6 and 3 pbas for lsn 2, and commit upto 2");
+    this->add_free_pba_record(1, 3);
+    this->add_free_pba_record(2, 6);
+    this->add_free_pba_record(2, 3);
+    this->commit_lsn(2);
+    this->compact_journal(2);
+    this->create_snapshot(2);
+
+    LOGINFO("Step 3: Rate limit falls within the records of lsn 2, none of them are freed");
+    this->take_store_calls();
+    m_sm->checkpoint();
+    ASSERT_EQ(this->checkpoint_lsn(), 1);
+    ASSERT_EQ(this->take_store_calls(),
+              (std::vector< std::string >{"checkpoint_lsn:1", "remove_free_pba_records_upto:1", "free_pbas:3"}))
+        << "Records of lsn 2 are freed while the checkpoint stays behind it";
+
+    LOGINFO("Step 4: Next checkpoint frees both the records of lsn 2 at once");
+    m_sm->checkpoint();
+    ASSERT_EQ(this->checkpoint_lsn(), 2);
+    ASSERT_EQ(this->take_store_calls(),
+              (std::vector< std::string >{"checkpoint_lsn:2", "remove_free_pba_records_upto:2", "free_pbas:9"}));
+
+    HR_SETTINGS_FACTORY().modifiable_settings([](auto& s) { s.checkpoint_max_free_pbas_per_sec = 0; });
+    HR_SETTINGS_FACTORY().save();
+    this->shutdown();
+}
+
+TEST_F(TestReplStateMachine, checkpoint_keeps_pbas_of_journal_entries) {
+    LOGINFO("Step 1: Start HomeStore");
+    this->start_homestore();
+    this->attach_snapshot_listener();
+
+    LOGINFO("Step 2: Add free pba records for lsns 1-10, commit and snapshot upto 10, journal keeps entries from 5");
+    for (int64_t lsn{1}; lsn <= 10; ++lsn) {
+        this->add_free_pba_record(lsn, 1);
+    }
+    this->commit_lsn(10);
+    this->create_snapshot(10);
+    this->compact_journal(4);
+
+    LOGINFO("Step 3: Checkpoint stops below the start of the journal");
+    this->take_store_calls();
+    m_sm->checkpoint();
+    ASSERT_EQ(this->checkpoint_lsn(), 4);
+    ASSERT_EQ(this->take_store_calls(),
+              (std::vector< std::string >{"checkpoint_lsn:4", "remove_free_pba_records_upto:4", "free_pbas:4"}))
+        << "Pbas of entries still in the journal are freed";
+
+    LOGINFO("Step 4: Once raft compacts the journal, the rest of the records are freed");
+    this->compact_journal(10);
+    m_sm->checkpoint();
+    ASSERT_EQ(this->checkpoint_lsn(), 10);
+    ASSERT_EQ(this->take_store_calls(),
+              (std::vector< std::string >{"checkpoint_lsn:10", "remove_free_pba_records_upto:10", "free_pbas:6"}));
+    this->shutdown();
+}
+
 SISL_OPTIONS_ENABLE(logging, test_repl_state_machine)
 SISL_OPTION_GROUP(test_repl_state_machine,
                   (num_threads, "", "num_threads", "number of threads",